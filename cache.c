@@ -0,0 +1,723 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+
+#include "cache.h"
+#include "defaults.h"
+#include "zones.h"
+#include "rules.h"
+#include "redirects.h"
+#include "snats.h"
+#include "forwards.h"
+#include "ipsets.h"
+#include "includes.h"
+#include "helpers.h"
+#include "statefile.h"
+#include "ubus.h"
+
+
+/*
+ * The cache holds the validated configuration state. Every object is stored
+ * as a raw copy of its structure, followed by the values of all pointers it
+ * carries in the order given by its option table: list elements, strings,
+ * and references to other objects as index + 1 into their state list.
+ */
+
+struct fw3_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t crc;
+	struct fw3_cache_key key;
+};
+
+struct fw3_cache_type {
+	size_t size;
+	const struct fw3_option *opts;
+	size_t src_zone;
+	size_t dest_zone;
+};
+
+/* zone references, 0 is never one as all objects start with their list */
+#define zone_ref(structure, member) \
+	offsetof(struct fw3_##structure, member)
+
+static const struct fw3_cache_type cthelper_type = {
+	sizeof(struct fw3_cthelper), fw3_cthelper_opts
+};
+
+static const struct fw3_cache_type ipset_type = {
+	sizeof(struct fw3_ipset), fw3_ipset_opts
+};
+
+static const struct fw3_cache_type zone_type = {
+	sizeof(struct fw3_zone), fw3_zone_opts
+};
+
+static const struct fw3_cache_type rule_type = {
+	sizeof(struct fw3_rule), fw3_rule_opts,
+	zone_ref(rule, _src), zone_ref(rule, _dest)
+};
+
+static const struct fw3_cache_type redirect_type = {
+	sizeof(struct fw3_redirect), fw3_redirect_opts,
+	zone_ref(redirect, _src), zone_ref(redirect, _dest)
+};
+
+static const struct fw3_cache_type snat_type = {
+	sizeof(struct fw3_snat), fw3_snat_opts,
+	zone_ref(snat, _src), 0
+};
+
+static const struct fw3_cache_type forward_type = {
+	sizeof(struct fw3_forward), fw3_forward_opts,
+	zone_ref(forward, _src), zone_ref(forward, _dest)
+};
+
+static const struct fw3_cache_type include_type = {
+	sizeof(struct fw3_include), fw3_include_opts
+};
+
+struct fw3_cache_buf {
+	char *data;
+	size_t len;
+	size_t alloc;
+	bool ok;
+};
+
+struct fw3_cache_cursor {
+	const char *p;
+	const char *end;
+	bool ok;
+};
+
+
+static uint32_t
+hash_file(uint32_t hv, const char *path)
+{
+	int fd;
+	ssize_t n;
+	char buf[4096];
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return fw3_hash(hv, "", 1);
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		hv = fw3_hash(hv, buf, n);
+
+	close(fd);
+
+	return hv;
+}
+
+/* the use counts change with every rule referencing a module, only the
+ * names of the loaded modules matter */
+static uint32_t
+hash_modules(uint32_t hv)
+{
+	FILE *f;
+	char name[64];
+
+	if (!(f = fopen("/proc/modules", "r")))
+		return fw3_hash(hv, "", 1);
+
+	while (fscanf(f, "%63s%*[^\n]", name) == 1)
+		hv = fw3_hash(hv, name, strlen(name) + 1);
+
+	fclose(f);
+
+	return hv;
+}
+
+/* Everything the validated state is derived from: the configuration incl.
+ * uncommitted changes, ubus data and what the kernel supports. */
+void
+fw3_cache_key(struct fw3_state *state, struct fw3_cache_key *key)
+{
+	static const char *files[] = {
+		"/etc/config/firewall",
+		"/tmp/.uci/firewall",
+		FW3_HELPERCONF,
+		"/proc/net/ip_tables_targets",
+		"/proc/net/ip6_tables_targets",
+	};
+	static const size_t sizes[] = {
+		sizeof(struct fw3_defaults), sizeof(struct fw3_zone),
+		sizeof(struct fw3_rule), sizeof(struct fw3_redirect),
+		sizeof(struct fw3_snat), sizeof(struct fw3_forward),
+		sizeof(struct fw3_ipset), sizeof(struct fw3_include),
+		sizeof(struct fw3_cthelper),
+	};
+	unsigned int i, j;
+	uint32_t hv;
+
+	for (i = 0; i < ARRAY_SIZE(key->hash); i++)
+	{
+		hv = i ? ~FW3_HASH_INIT : FW3_HASH_INIT;
+		hv = fw3_hash(hv, sizes, sizeof(sizes));
+		hv = fw3_hash(hv, &state->disable_ipsets, sizeof(state->disable_ipsets));
+
+		for (j = 0; j < ARRAY_SIZE(files); j++)
+			hv = hash_file(hv, files[j]);
+
+		hv = hash_modules(hv);
+
+		key->hash[i] = fw3_ubus_hash(hv);
+	}
+}
+
+
+static void
+put(struct fw3_cache_buf *b, const void *data, size_t len)
+{
+	size_t pad = (len + 3) & ~3;
+
+	if (b->len + pad > b->alloc)
+	{
+		while (b->len + pad > b->alloc)
+			b->alloc = b->alloc ? b->alloc * 2 : 4096;
+
+		b->data = realloc(b->data, b->alloc);
+
+		if (!b->data)
+			error("Out of memory");
+	}
+
+	memcpy(b->data + b->len, data, len);
+	memset(b->data + b->len + len, 0, pad - len);
+
+	b->len += pad;
+}
+
+static void
+put_u32(struct fw3_cache_buf *b, uint32_t v)
+{
+	put(b, &v, sizeof(v));
+}
+
+static void
+put_str(struct fw3_cache_buf *b, const char *s)
+{
+	put_u32(b, s ? strlen(s) + 1 : 0);
+
+	if (s)
+		put(b, s, strlen(s) + 1);
+}
+
+static uint32_t
+list_index(struct list_head *head, const void *obj)
+{
+	uint32_t n = 1;
+	struct list_head *cur;
+
+	if (!obj)
+		return 0;
+
+	list_for_each(cur, head)
+	{
+		if (cur == obj)
+			return n;
+
+		n++;
+	}
+
+	return 0;
+}
+
+static uint32_t
+dir_code(const char *dir)
+{
+	if (!dir)
+		return 0;
+
+	return strcmp(dir, "dst") ? 1 : 2;
+}
+
+static const char *
+code_dir(uint32_t code)
+{
+	return (code == 2) ? "dst" : (code == 1) ? "src" : NULL;
+}
+
+/* size of the list elements produced by the given parser */
+static size_t
+elem_size(const struct fw3_option *ol)
+{
+	if (ol->parse == fw3_parse_device)
+		return sizeof(struct fw3_device);
+	else if (ol->parse == fw3_parse_address || ol->parse == fw3_parse_network)
+		return sizeof(struct fw3_address);
+	else if (ol->parse == fw3_parse_mac)
+		return sizeof(struct fw3_mac);
+	else if (ol->parse == fw3_parse_port)
+		return sizeof(struct fw3_port);
+	else if (ol->parse == fw3_parse_protocol)
+		return sizeof(struct fw3_protocol);
+	else if (ol->parse == fw3_parse_icmptype)
+		return sizeof(struct fw3_icmptype);
+	else if (ol->parse == fw3_parse_ipset_datatype)
+		return sizeof(struct fw3_ipset_datatype);
+	else if (ol->parse == fw3_parse_cthelper)
+		return sizeof(struct fw3_cthelpermatch);
+	else if (ol->parse == fw3_parse_setentry)
+		return sizeof(struct fw3_setentry);
+
+	return 0;
+}
+
+/* options sharing a member with an earlier option are aliases */
+static bool
+is_alias(const struct fw3_option *opts, const struct fw3_option *ol)
+{
+	const struct fw3_option *o;
+
+	for (o = opts; o != ol; o++)
+		if (o->offset == ol->offset)
+			return true;
+
+	return false;
+}
+
+static void
+put_pointers(struct fw3_cache_buf *b, struct fw3_state *state,
+             const struct fw3_option *ol, void *field)
+{
+	int i;
+	struct fw3_setmatch *m;
+
+	if (ol->parse == fw3_parse_string)
+	{
+		put_str(b, *(const char **)field);
+	}
+	else if (ol->parse == fw3_parse_setentry)
+	{
+		put_str(b, ((struct fw3_setentry *)field)->value);
+	}
+	else if (ol->parse == fw3_parse_ipset_datatype)
+	{
+		put_u32(b, dir_code(((struct fw3_ipset_datatype *)field)->dir));
+	}
+	else if (ol->parse == fw3_parse_cthelper)
+	{
+		put_u32(b, list_index(&state->cthelpers,
+		                      ((struct fw3_cthelpermatch *)field)->ptr));
+	}
+	else if (ol->parse == fw3_parse_setmatch)
+	{
+		m = field;
+
+		for (i = 0; i < ARRAY_SIZE(m->dir); i++)
+			put_u32(b, dir_code(m->dir[i]));
+
+		put_u32(b, list_index(&state->ipsets, m->ptr));
+	}
+}
+
+static void
+put_object(struct fw3_cache_buf *b, struct fw3_state *state,
+           const struct fw3_cache_type *t, void *obj)
+{
+	size_t size;
+	uint32_t n;
+	const struct fw3_option *ol;
+	struct list_head *list, *cur;
+
+	put(b, obj, t->size);
+
+	for (ol = t->opts; ol->name; ol++)
+	{
+		if (is_alias(t->opts, ol))
+			continue;
+
+		if (!ol->elem_size)
+		{
+			put_pointers(b, state, ol, (char *)obj + ol->offset);
+			continue;
+		}
+
+		if (!(size = elem_size(ol)))
+		{
+			b->ok = false;
+			continue;
+		}
+
+		list = (struct list_head *)((char *)obj + ol->offset);
+		n = 0;
+
+		list_for_each(cur, list)
+			n++;
+
+		put_u32(b, n);
+
+		list_for_each(cur, list)
+		{
+			put(b, cur, size);
+			put_pointers(b, state, ol, cur);
+		}
+	}
+
+	if (t->src_zone)
+		put_u32(b, list_index(&state->zones,
+		                      *(void **)((char *)obj + t->src_zone)));
+
+	if (t->dest_zone)
+		put_u32(b, list_index(&state->zones,
+		                      *(void **)((char *)obj + t->dest_zone)));
+}
+
+static void
+put_objects(struct fw3_cache_buf *b, struct fw3_state *state,
+            const struct fw3_cache_type *t, struct list_head *list)
+{
+	uint32_t n = 0;
+	struct list_head *cur;
+
+	list_for_each(cur, list)
+		n++;
+
+	put_u32(b, n);
+
+	list_for_each(cur, list)
+		put_object(b, state, t, cur);
+}
+
+void
+fw3_cache_save(struct fw3_state *state, struct fw3_cache_key *key)
+{
+	int fd;
+	struct fw3_cache_header hdr = { };
+	struct fw3_cache_buf b = { .ok = true };
+
+	put(&b, &hdr, sizeof(hdr));
+	put(&b, &state->defaults, sizeof(state->defaults));
+
+	put_objects(&b, state, &cthelper_type, &state->cthelpers);
+	put_objects(&b, state, &ipset_type, &state->ipsets);
+	put_objects(&b, state, &zone_type, &state->zones);
+	put_objects(&b, state, &rule_type, &state->rules);
+	put_objects(&b, state, &redirect_type, &state->redirects);
+	put_objects(&b, state, &snat_type, &state->snats);
+	put_objects(&b, state, &forward_type, &state->forwards);
+	put_objects(&b, state, &include_type, &state->includes);
+
+	if (!b.ok)
+	{
+		free(b.data);
+		return;
+	}
+
+	hdr.magic   = FW3_CACHE_MAGIC;
+	hdr.version = FW3_CACHE_VERSION;
+	hdr.size    = b.len;
+	hdr.key     = *key;
+	hdr.crc     = fw3_hash(FW3_HASH_INIT, b.data + sizeof(hdr),
+	                       b.len - sizeof(hdr));
+
+	memcpy(b.data, &hdr, sizeof(hdr));
+
+	fd = open(FW3_CACHEFILE ".new", O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR);
+
+	if (fd < 0)
+	{
+		free(b.data);
+		return;
+	}
+
+	if (write(fd, b.data, b.len) != b.len || rename(FW3_CACHEFILE ".new",
+	                                                FW3_CACHEFILE))
+	{
+		warn("Cannot write cache %s: %s", FW3_CACHEFILE, strerror(errno));
+		unlink(FW3_CACHEFILE ".new");
+	}
+
+	close(fd);
+	free(b.data);
+}
+
+
+static const void *
+get(struct fw3_cache_cursor *c, size_t len)
+{
+	const char *p = c->p;
+	size_t pad = (len + 3) & ~3;
+
+	if (!c->ok || pad > c->end - c->p)
+	{
+		c->ok = false;
+		return NULL;
+	}
+
+	c->p += pad;
+
+	return p;
+}
+
+static uint32_t
+get_u32(struct fw3_cache_cursor *c)
+{
+	const uint32_t *v = get(c, sizeof(*v));
+
+	return v ? *v : 0;
+}
+
+static const char *
+get_str(struct fw3_cache_cursor *c)
+{
+	uint32_t len = get_u32(c);
+	const char *s;
+
+	if (!len)
+		return NULL;
+
+	s = get(c, len);
+
+	if (s && s[len - 1])
+	{
+		c->ok = false;
+		return NULL;
+	}
+
+	return s;
+}
+
+static void *
+index_list(struct fw3_cache_cursor *c, struct list_head *head)
+{
+	uint32_t n = get_u32(c);
+	struct list_head *cur;
+
+	if (!n)
+		return NULL;
+
+	list_for_each(cur, head)
+		if (!--n)
+			return cur;
+
+	c->ok = false;
+	return NULL;
+}
+
+static void
+get_pointers(struct fw3_cache_cursor *c, struct fw3_state *state,
+             const struct fw3_option *ol, void *field)
+{
+	int i;
+	struct fw3_setmatch *m;
+
+	if (ol->parse == fw3_parse_string)
+	{
+		*(const char **)field = get_str(c);
+	}
+	else if (ol->parse == fw3_parse_setentry)
+	{
+		((struct fw3_setentry *)field)->value = get_str(c);
+	}
+	else if (ol->parse == fw3_parse_ipset_datatype)
+	{
+		((struct fw3_ipset_datatype *)field)->dir = code_dir(get_u32(c));
+	}
+	else if (ol->parse == fw3_parse_cthelper)
+	{
+		((struct fw3_cthelpermatch *)field)->ptr =
+			index_list(c, &state->cthelpers);
+	}
+	else if (ol->parse == fw3_parse_setmatch)
+	{
+		m = field;
+
+		for (i = 0; i < ARRAY_SIZE(m->dir); i++)
+			m->dir[i] = code_dir(get_u32(c));
+
+		m->ptr = index_list(c, &state->ipsets);
+	}
+}
+
+static bool
+get_object(struct fw3_cache_cursor *c, struct fw3_state *state,
+           const struct fw3_cache_type *t, struct list_head *head)
+{
+	size_t size;
+	uint32_t n;
+	const void *raw;
+	const struct fw3_option *ol;
+	struct list_head *list, *elem;
+	char *obj;
+
+	if (!(raw = get(c, t->size)))
+		return false;
+
+	obj = fw3_alloc(t->size);
+	memcpy(obj, raw, t->size);
+	list_add_tail((struct list_head *)obj, head);
+
+	/* reset all lists first, the object must be freeable at any point */
+	for (ol = t->opts; ol->name; ol++)
+		if (ol->elem_size)
+			INIT_LIST_HEAD((struct list_head *)(obj + ol->offset));
+
+	for (ol = t->opts; ol->name; ol++)
+	{
+		if (is_alias(t->opts, ol))
+			continue;
+
+		if (!ol->elem_size)
+		{
+			get_pointers(c, state, ol, obj + ol->offset);
+			continue;
+		}
+
+		if (!(size = elem_size(ol)))
+			return false;
+
+		list = (struct list_head *)(obj + ol->offset);
+
+		for (n = get_u32(c); c->ok && n > 0; n--)
+		{
+			if (!(raw = get(c, size)))
+				break;
+
+			elem = fw3_alloc(size);
+			memcpy(elem, raw, size);
+			list_add_tail(elem, list);
+
+			get_pointers(c, state, ol, elem);
+		}
+	}
+
+	if (t->src_zone)
+		*(void **)(obj + t->src_zone) = index_list(c, &state->zones);
+
+	if (t->dest_zone)
+		*(void **)(obj + t->dest_zone) = index_list(c, &state->zones);
+
+	return c->ok;
+}
+
+static bool
+get_objects(struct fw3_cache_cursor *c, struct fw3_state *state,
+            const struct fw3_cache_type *t, struct list_head *head)
+{
+	uint32_t n;
+
+	for (n = get_u32(c); c->ok && n > 0; n--)
+		if (!get_object(c, state, t, head))
+			return false;
+
+	return c->ok;
+}
+
+static void
+free_objects(struct list_head *head, const struct fw3_option *opts)
+{
+	struct list_head *cur, *tmp;
+
+	list_for_each_safe(cur, tmp, head)
+	{
+		list_del(cur);
+		fw3_free_object(cur, opts);
+	}
+}
+
+/* Load the cached state if it was derived from the very same inputs, strings
+ * point into the mapping which is released along with the state. */
+bool
+fw3_cache_load(struct fw3_state *state, struct fw3_cache_key *key)
+{
+	int fd;
+	struct stat st;
+	const struct fw3_cache_header *hdr;
+	struct fw3_cache_cursor c = { .ok = true };
+	void *map;
+
+	if ((fd = open(FW3_CACHEFILE, O_RDONLY)) < 0)
+		return false;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*hdr) + sizeof(state->defaults))
+	{
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	hdr = map;
+
+	if (hdr->magic != FW3_CACHE_MAGIC || hdr->version != FW3_CACHE_VERSION ||
+	    hdr->size != st.st_size || memcmp(&hdr->key, key, sizeof(*key)) ||
+	    hdr->crc != fw3_hash(FW3_HASH_INIT, (char *)map + sizeof(*hdr),
+	                         st.st_size - sizeof(*hdr)))
+	{
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	INIT_LIST_HEAD(&state->cthelpers);
+	INIT_LIST_HEAD(&state->ipsets);
+	INIT_LIST_HEAD(&state->zones);
+	INIT_LIST_HEAD(&state->rules);
+	INIT_LIST_HEAD(&state->redirects);
+	INIT_LIST_HEAD(&state->snats);
+	INIT_LIST_HEAD(&state->forwards);
+	INIT_LIST_HEAD(&state->includes);
+
+	c.p = (const char *)map + sizeof(*hdr);
+	c.end = (const char *)map + st.st_size;
+
+	memcpy(&state->defaults, get(&c, sizeof(state->defaults)),
+	       sizeof(state->defaults));
+
+	if (get_objects(&c, state, &cthelper_type, &state->cthelpers) &&
+	    get_objects(&c, state, &ipset_type, &state->ipsets) &&
+	    get_objects(&c, state, &zone_type, &state->zones) &&
+	    get_objects(&c, state, &rule_type, &state->rules) &&
+	    get_objects(&c, state, &redirect_type, &state->redirects) &&
+	    get_objects(&c, state, &snat_type, &state->snats) &&
+	    get_objects(&c, state, &forward_type, &state->forwards) &&
+	    get_objects(&c, state, &include_type, &state->includes))
+	{
+		state->statemap = map;
+		state->statemap_size = st.st_size;
+
+		fw3_index_cthelpers(state);
+		fw3_index_ipsets(state);
+		fw3_index_zones(state);
+
+		return true;
+	}
+
+	warn("Ignoring corrupt cache %s", FW3_CACHEFILE);
+
+	free_objects(&state->cthelpers, fw3_cthelper_opts);
+	free_objects(&state->ipsets, fw3_ipset_opts);
+	free_objects(&state->zones, fw3_zone_opts);
+	free_objects(&state->rules, fw3_rule_opts);
+	free_objects(&state->redirects, fw3_redirect_opts);
+	free_objects(&state->snats, fw3_snat_opts);
+	free_objects(&state->forwards, fw3_forward_opts);
+	free_objects(&state->includes, fw3_include_opts);
+
+	memset(&state->defaults, 0, sizeof(state->defaults));
+	munmap(map, st.st_size);
+
+	return false;
+}
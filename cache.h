@@ -0,0 +1,38 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __FW3_CACHE_H
+#define __FW3_CACHE_H
+
+#include "options.h"
+
+
+#define FW3_CACHE_MAGIC		0x43335746	/* "FW3C" */
+#define FW3_CACHE_VERSION	1
+
+struct fw3_cache_key {
+	uint32_t hash[2];
+};
+
+void fw3_cache_key(struct fw3_state *state, struct fw3_cache_key *key);
+
+bool fw3_cache_load(struct fw3_state *state, struct fw3_cache_key *key);
+
+void fw3_cache_save(struct fw3_state *state, struct fw3_cache_key *key);
+
+#endif
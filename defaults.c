@@ -61,9 +61,15 @@ const struct fw3_option fw3_flag_opts[] = {
 	FW3_OPT("disable_ipv6",        bool,     defaults, disable_ipv6),
 	FW3_OPT("flow_offloading",     bool,     defaults, flow_offloading),
 	FW3_OPT("flow_offloading_hw",  bool,     defaults, flow_offloading_hw),
+	FW3_OPT("auto_ipset_threshold", int,     defaults, auto_ipset_threshold),
+	FW3_OPT("subchain_threshold",  int,      defaults, subchain_threshold),
+	FW3_OPT("expansion_limit",     int,      defaults, expansion_limit),
+	FW3_OPT("optimize_rules",      bool,     defaults, optimize_rules),
+	FW3_OPT("dispatch_threshold",  int,      defaults, dispatch_threshold),
 
 	FW3_OPT("__flags_v4",          int,      defaults, flags[0]),
 	FW3_OPT("__flags_v6",          int,      defaults, flags[1]),
+	FW3_OPT("__digest",            int,      defaults, digest),
 
 	{ }
 };
@@ -104,21 +110,6 @@ check_any_reject_code(struct uci_element *e, enum fw3_reject_code *any_reject_co
 	}
 }
 
-static const char*
-get_reject_code(enum fw3_family family, enum fw3_reject_code reject_code)
-{
-	switch (reject_code) {
-	case FW3_REJECT_CODE_TCP_RESET:
-		return "tcp-reset";
-	case FW3_REJECT_CODE_PORT_UNREACH:
-		return "port-unreach";
-	case FW3_REJECT_CODE_ADM_PROHIBITED:
-		return family == FW3_FAMILY_V6 ? "adm-prohibited": "admin-prohib";
-	default:
-		return "unknown";
-	}
-}
-
 void
 fw3_load_defaults(struct fw3_state *state, struct uci_package *p)
 {
@@ -136,6 +127,11 @@ fw3_load_defaults(struct fw3_state *state, struct uci_package *p)
 	defs->tcp_window_scaling   = true;
 	defs->custom_chains        = true;
 	defs->auto_helper          = true;
+	defs->auto_ipset_threshold = 32;
+	defs->subchain_threshold   = 64;
+	defs->expansion_limit      = 1000;
+	defs->optimize_rules       = false;
+	defs->dispatch_threshold   = 32;
 
 	uci_foreach_element(&p->sections, e)
 	{
@@ -151,6 +147,7 @@ fw3_load_defaults(struct fw3_state *state, struct uci_package *p)
 		}
 
 		seen = true;
+		defs->hash = fw3_hash_section(s);
 
 		if(!fw3_parse_options(&state->defaults, fw3_flag_opts, s))
 			warn_elem(e, "has invalid options");
@@ -204,7 +201,10 @@ fw3_print_default_chains(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		    !fw3_hasbit(defs->flags[handle->family == FW3_FAMILY_V6], c->flag))
 			continue;
 
-		fw3_ipt_create_chain(handle, reload, c->format);
+		if (c->flag == FW3_FLAG_CUSTOM_CHAINS)
+			fw3_ipt_create_custom_chain(handle, reload, c->format);
+		else
+			fw3_ipt_create_chain(handle, reload, c->format);
 	}
 
 	set(defs->flags, handle->family, handle->table);
@@ -253,7 +253,7 @@ fw3_print_default_head_rules(struct fw3_ipt_handle *handle,
 		{
 			r = fw3_ipt_rule_new(handle);
 			fw3_ipt_rule_comment(r, "Traffic offloading");
-			fw3_ipt_rule_extra(r, "-m conntrack --ctstate RELATED,ESTABLISHED");
+			fw3_ipt_rule_ctstate(r, false, FW3_CTSTATE_RELATED | FW3_CTSTATE_ESTABLISHED);
 			fw3_ipt_rule_target(r, "FLOWOFFLOAD");
 			if (defs->flow_offloading_hw)
 				fw3_ipt_rule_addarg(r, false, "--hw", NULL);
@@ -263,14 +263,14 @@ fw3_print_default_head_rules(struct fw3_ipt_handle *handle,
 		for (i = 0; i < ARRAY_SIZE(chains); i += 2)
 		{
 			r = fw3_ipt_rule_new(handle);
-			fw3_ipt_rule_extra(r, "-m conntrack --ctstate RELATED,ESTABLISHED");
+			fw3_ipt_rule_ctstate(r, false, FW3_CTSTATE_RELATED | FW3_CTSTATE_ESTABLISHED);
 			fw3_ipt_rule_target(r, "ACCEPT");
 			fw3_ipt_rule_append(r, chains[i]);
 
 			if (defs->drop_invalid)
 			{
 				r = fw3_ipt_rule_new(handle);
-				fw3_ipt_rule_extra(r, "-m conntrack --ctstate INVALID");
+				fw3_ipt_rule_ctstate(r, false, FW3_CTSTATE_INVALID);
 				fw3_ipt_rule_target(r, "DROP");
 				fw3_ipt_rule_append(r, chains[i]);
 			}
@@ -294,13 +294,11 @@ fw3_print_default_head_rules(struct fw3_ipt_handle *handle,
 		}
 
 		r = fw3_ipt_rule_create(handle, &tcp, NULL, NULL, NULL, NULL);
-		fw3_ipt_rule_target(r, "REJECT");
-		fw3_ipt_rule_addarg(r, false, "--reject-with", get_reject_code(handle->family, defs->tcp_reject_code));
+		fw3_ipt_rule_reject(r, defs->tcp_reject_code);
 		fw3_ipt_rule_append(r, "reject");
 
 		r = fw3_ipt_rule_new(handle);
-		fw3_ipt_rule_target(r, "REJECT");
-		fw3_ipt_rule_addarg(r, false, "--reject-with", get_reject_code(handle->family, defs->any_reject_code));
+		fw3_ipt_rule_reject(r, defs->any_reject_code);
 		fw3_ipt_rule_append(r, "reject");
 
 		break;
@@ -441,6 +439,8 @@ fw3_flush_rules(struct fw3_ipt_handle *handle, struct fw3_state *state,
 	}
 
 	/* ... then remove the chains */
+	fw3_ipt_delete_chains(handle, FW3_RULE_CHAIN_PREFIX);
+
 	for (c = default_chains; c->format; c++)
 	{
 		if (!fw3_is_family(c, handle->family))
@@ -110,6 +110,8 @@ fw3_load_forwards(struct fw3_state *state, struct uci_package *p,
 		if (!forward)
 			continue;
 
+		forward->hash = fw3_hash_blob(entry);
+
 		if (!fw3_parse_blob_options(forward, fw3_forward_opts, entry, name))
 		{
 			warn_section("forward", forward, NULL, "skipped due to invalid options");
@@ -132,6 +134,8 @@ fw3_load_forwards(struct fw3_state *state, struct uci_package *p,
 		if (!forward)
 			continue;
 
+		forward->hash = fw3_hash_section(s);
+
 		if (!fw3_parse_options(forward, fw3_forward_opts, s))
 			warn_elem(e, "has invalid options");
 
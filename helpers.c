@@ -154,25 +154,40 @@ fw3_load_cthelpers(struct fw3_state *state, struct uci_package *p)
 	}
 
 	load_cthelpers(state, p);
+
+	fw3_index_cthelpers(state);
 }
 
-struct fw3_cthelper *
-fw3_lookup_cthelper(struct fw3_state *state, const char *name)
+/* helper names are matched case-insensitively */
+static int
+avl_strcasecmp(const void *k1, const void *k2, void *ptr)
+{
+	return strcasecmp(k1, k2);
+}
+
+void
+fw3_index_cthelpers(struct fw3_state *state)
 {
 	struct fw3_cthelper *h;
 
-	if (list_empty(&state->cthelpers))
-		return NULL;
+	avl_init(&state->cthelper_index, avl_strcasecmp, false, NULL);
 
 	list_for_each_entry(h, &state->cthelpers, list)
 	{
-		if (strcasecmp(h->name, name))
-			continue;
-
-		return h;
+		h->index.key = h->name;
+		avl_insert(&state->cthelper_index, &h->index);
 	}
+}
 
-	return NULL;
+struct fw3_cthelper *
+fw3_lookup_cthelper(struct fw3_state *state, const char *name)
+{
+	struct fw3_cthelper *h;
+
+	if (list_empty(&state->cthelpers))
+		return NULL;
+
+	return avl_find_element(&state->cthelper_index, name, h, index);
 }
 
 bool
@@ -29,6 +29,9 @@ extern const struct fw3_option fw3_cthelper_opts[];
 void
 fw3_load_cthelpers(struct fw3_state *state, struct uci_package *p);
 
+void
+fw3_index_cthelpers(struct fw3_state *state);
+
 struct fw3_cthelper *
 fw3_lookup_cthelper(struct fw3_state *state, const char *name);
 
@@ -18,6 +18,8 @@
 
 #include <ctype.h>
 
+#include <libubox/avl-cmp.h>
+
 #include "ipsets.h"
 
 
@@ -249,7 +251,7 @@ check_ipset(struct fw3_state *state, struct fw3_ipset *ipset, struct uci_element
 	return false;
 }
 
-static struct fw3_ipset *
+struct fw3_ipset *
 fw3_alloc_ipset(struct fw3_state *state)
 {
 	struct fw3_ipset *ipset;
@@ -273,6 +275,55 @@ fw3_alloc_ipset(struct fw3_state *state)
 	return ipset;
 }
 
+/* Sets generated for long rule lists are named after their contents, so
+ * rules sharing a list share the set and changed lists yield a new one. */
+struct fw3_ipset *
+fw3_alloc_auto_ipset(struct fw3_state *state, enum fw3_family family,
+                     enum fw3_ipset_type type, uint32_t hash)
+{
+	char *name;
+	struct fw3_ipset *ipset;
+	struct fw3_ipset_datatype *dt;
+
+	ipset = fw3_alloc(sizeof(*ipset) + sizeof(FW3_AUTO_IPSET_PREFIX "00000000"));
+	name = (char *)(ipset + 1);
+
+	sprintf(name, FW3_AUTO_IPSET_PREFIX "%08x", hash);
+
+	INIT_LIST_HEAD(&ipset->datatypes);
+	INIT_LIST_HEAD(&ipset->entries);
+
+	ipset->enabled = true;
+	ipset->name    = name;
+	ipset->family  = family;
+	ipset->method  = FW3_IPSET_METHOD_HASH;
+	ipset->timeout = -1;
+	ipset->hash    = hash;
+
+	dt = fw3_alloc(sizeof(*dt));
+	dt->type = type;
+	dt->dir  = "src";
+
+	list_add_tail(&dt->list, &ipset->datatypes);
+	list_add_tail(&ipset->list, &state->ipsets);
+
+	ipset->index.key = ipset->name;
+	avl_insert(&state->ipset_index, &ipset->index);
+
+	return ipset;
+}
+
+void
+fw3_add_auto_ipset_entry(struct fw3_ipset *ipset, const char *value)
+{
+	struct fw3_setentry *entry;
+
+	entry = fw3_alloc(sizeof(*entry) + strlen(value) + 1);
+	entry->value = strcpy((char *)(entry + 1), value);
+
+	list_add_tail(&entry->list, &ipset->entries);
+}
+
 void
 fw3_load_ipsets(struct fw3_state *state, struct uci_package *p,
 		struct blob_attr *a)
@@ -303,6 +354,8 @@ fw3_load_ipsets(struct fw3_state *state, struct uci_package *p,
 		if (!ipset)
 			continue;
 
+		ipset->hash = fw3_hash_blob(entry);
+
 		if (!fw3_parse_blob_options(ipset, fw3_ipset_opts, entry, name))
 		{
 			warn_section("ipset", ipset, NULL, "skipped due to invalid options");
@@ -326,12 +379,30 @@ fw3_load_ipsets(struct fw3_state *state, struct uci_package *p,
 		if (!ipset)
 			continue;
 
+		ipset->hash = fw3_hash_section(s);
+
 		if (!fw3_parse_options(ipset, fw3_ipset_opts, s))
 			warn_elem(e, "has invalid options");
 
 		if (!check_ipset(state, ipset, e))
 			fw3_free_ipset(ipset);
 	}
+
+	fw3_index_ipsets(state);
+}
+
+void
+fw3_index_ipsets(struct fw3_state *state)
+{
+	struct fw3_ipset *s;
+
+	avl_init(&state->ipset_index, avl_strcmp, false, NULL);
+
+	list_for_each_entry(s, &state->ipsets, list)
+	{
+		s->index.key = s->name;
+		avl_insert(&state->ipset_index, &s->index);
+	}
 }
 
 
@@ -366,7 +437,7 @@ load_file(struct fw3_ipset *ipset)
 }
 
 static void
-create_ipset(struct fw3_ipset *ipset, struct fw3_state *state)
+create_ipset(struct fw3_ipset *ipset, struct fw3_state *state, bool refill)
 {
 	bool first = true;
 	struct fw3_setentry *entry;
@@ -383,7 +454,10 @@ create_ipset(struct fw3_ipset *ipset, struct fw3_state *state)
 		first = false;
 	}
 
-	if (ipset->method == FW3_IPSET_METHOD_HASH)
+	/* hash:mac sets are family independent and take no family option */
+	type = list_first_entry(&ipset->datatypes, struct fw3_ipset_datatype, list);
+
+	if (ipset->method == FW3_IPSET_METHOD_HASH && type->type != FW3_IPSET_TYPE_MAC)
 		fw3_pr(" family inet%s", (ipset->family == FW3_FAMILY_V4) ? "" : "6");
 
 	if (ipset->iprange.set)
@@ -416,6 +490,10 @@ create_ipset(struct fw3_ipset *ipset, struct fw3_state *state)
 
 	fw3_pr("\n");
 
+	/* sets in use by live rules are refilled instead of recreated */
+	if (refill)
+		fw3_pr("flush %s\n", ipset->name);
+
 	list_for_each_entry(entry, &ipset->entries, list)
 		fw3_pr("add %s %s\n", ipset->name, entry->value);
 
@@ -427,7 +505,7 @@ fw3_create_ipsets(struct fw3_state *state, enum fw3_family family,
 		  bool reload_set)
 {
 	unsigned int delay, tries;
-	bool exec = false;
+	bool exists, exec = false;
 	struct fw3_ipset *ipset;
 
 	if (state->disable_ipsets)
@@ -442,8 +520,9 @@ fw3_create_ipsets(struct fw3_state *state, enum fw3_family family,
 		if (ipset->external)
 			continue;
 
-		if (fw3_check_ipset(ipset) &&
-		    (reload_set && !ipset->reload_set))
+		exists = fw3_check_ipset(ipset);
+
+		if (exists && (reload_set && !ipset->reload_set))
 			continue;
 
 		if (!exec)
@@ -454,7 +533,7 @@ fw3_create_ipsets(struct fw3_state *state, enum fw3_family family,
 				return;
 		}
 
-		create_ipset(ipset, state);
+		create_ipset(ipset, state, exists && reload_set);
 	}
 
 	if (exec)
@@ -533,15 +612,7 @@ fw3_lookup_ipset(struct fw3_state *state, const char *name)
 	if (list_empty(&state->ipsets))
 		return NULL;
 
-	list_for_each_entry(s, &state->ipsets, list)
-	{
-		if (strcmp(s->name, name))
-			continue;
-
-		return s;
-	}
-
-	return NULL;
+	return avl_find_element(&state->ipset_index, name, s, index);
 }
 
 bool
@@ -581,12 +652,61 @@ out:
 	return rv;
 }
 
-void
+static bool
+same_range(const struct fw3_address *a, const struct fw3_address *b)
+{
+	if (a->set != b->set)
+		return false;
+
+	return !a->set ||
+	       (a->family == b->family && a->range == b->range &&
+	        !memcmp(&a->address, &b->address, sizeof(a->address)) &&
+	        !memcmp(&a->mask, &b->mask, sizeof(a->mask)));
+}
+
+/* Whether the kernel set created for one definition can take the other,
+ * "create -exist" fails on any mismatch. */
+static bool
+same_definition(struct fw3_ipset *a, struct fw3_ipset *b)
+{
+	struct fw3_ipset_datatype *ta, *tb;
+
+	if (a->method != b->method || a->family != b->family ||
+	    a->timeout != b->timeout || a->netmask != b->netmask ||
+	    a->maxelem != b->maxelem || a->hashsize != b->hashsize ||
+	    a->counters != b->counters || a->comment != b->comment)
+		return false;
+
+	if (!same_range(&a->iprange, &b->iprange))
+		return false;
+
+	if (a->portrange.set != b->portrange.set ||
+	    (a->portrange.set &&
+	     (a->portrange.port_min != b->portrange.port_min ||
+	      a->portrange.port_max != b->portrange.port_max)))
+		return false;
+
+	tb = list_first_entry(&b->datatypes, struct fw3_ipset_datatype, list);
+
+	list_for_each_entry(ta, &a->datatypes, list)
+	{
+		if (&tb->list == &b->datatypes || ta->type != tb->type)
+			return false;
+
+		tb = list_entry(tb->list.next, struct fw3_ipset_datatype, list);
+	}
+
+	return (&tb->list == &b->datatypes);
+}
+
+/* Mark the sets of the runtime state which have to be destroyed and tell
+ * whether any of them is still configured with a different definition. */
+bool
 fw3_ipsets_update_run_state(enum fw3_family family, struct fw3_state *run_state,
 			    struct fw3_state *cfg_state)
 {
 	struct fw3_ipset *ipset_run, *ipset_cfg;
-	bool in_cfg;
+	bool in_cfg, changed = false;
 
 	list_for_each_entry(ipset_run, &run_state->ipsets, list) {
 		if (ipset_run->family != family)
@@ -608,15 +728,22 @@ fw3_ipsets_update_run_state(enum fw3_family family, struct fw3_state *run_state,
 
 		/* If a set is found in run_state, but not in cfg_state then the
 		 * set has been deleted/renamed. Set reload_set to true to force
-		 * the old set to be destroyed in the "stop" fase of the reload.
-		 * If the set is found, then copy the reload_set value from the
-		 * configuration state. This ensures that the elements are
-		 * always updated according to the configuration, and not the
-		 * runtime state (which the user might have forgotten).
+		 * the old set to be destroyed once the reloaded tables no longer
+		 * reference it. Sets which are still configured stay in place,
+		 * their elements are refreshed by fw3_create_ipsets() according
+		 * to the reload_set value of the configuration state. A set
+		 * whose definition changed cannot be refilled, it is destroyed
+		 * as well and recreated.
 		 */
-		if (!in_cfg)
-			ipset_run->reload_set = true;
-		else
-			ipset_run->reload_set = ipset_cfg->reload_set;
+		if (in_cfg && !ipset_cfg->external &&
+		    !same_definition(ipset_run, ipset_cfg)) {
+			info(" * Definition of ipset %s changed", ipset_run->name);
+			changed = true;
+			in_cfg = false;
+		}
+
+		ipset_run->reload_set = !in_cfg;
 	}
+
+	return changed;
 }
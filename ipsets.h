@@ -27,7 +27,18 @@
 
 extern const struct fw3_option fw3_ipset_opts[];
 
+#define FW3_AUTO_IPSET_PREFIX	"fw3_"
+
+struct fw3_ipset * fw3_alloc_ipset(struct fw3_state *state);
+
+struct fw3_ipset * fw3_alloc_auto_ipset(struct fw3_state *state,
+                                        enum fw3_family family,
+                                        enum fw3_ipset_type type,
+                                        uint32_t hash);
+void fw3_add_auto_ipset_entry(struct fw3_ipset *ipset, const char *value);
+
 void fw3_load_ipsets(struct fw3_state *state, struct uci_package *p, struct blob_attr *a);
+void fw3_index_ipsets(struct fw3_state *state);
 void fw3_create_ipsets(struct fw3_state *state, enum fw3_family family,
 		       bool reload_set);
 void fw3_destroy_ipsets(struct fw3_state *state, enum fw3_family family,
@@ -37,7 +48,7 @@ struct fw3_ipset * fw3_lookup_ipset(struct fw3_state *state, const char *name);
 
 bool fw3_check_ipset(struct fw3_ipset *set);
 
-void
+bool
 fw3_ipsets_update_run_state(enum fw3_family family, struct fw3_state *run_state,
 			    struct fw3_state *cfg_state);
 
@@ -26,6 +26,8 @@
 #include <netinet/in.h>
 #include <sys/utsname.h>
 #include <sys/socket.h>
+#include <syslog.h>
+#include <time.h>
 
 /* prevent indirect inclusion of kernel headers */
 #define _LINUX_IF_H
@@ -40,8 +42,24 @@
 #include <libiptc/libip6tc.h>
 #include <xtables.h>
 
+/* match and target payloads filled by the compiled rule builder */
+#include <linux/netfilter/xt_tcpudp.h>
+#include <linux/netfilter/xt_multiport.h>
+#include <linux/netfilter/xt_comment.h>
+#include <linux/netfilter/xt_conntrack.h>
+#include <linux/netfilter/xt_mark.h>
+#include <linux/netfilter/xt_limit.h>
+#include <linux/netfilter/xt_set.h>
+#include <linux/netfilter/xt_LOG.h>
+#include <linux/netfilter/nf_nat.h>
+#include <linux/netfilter_ipv4/ipt_REJECT.h>
+#include <linux/netfilter_ipv6/ip6t_REJECT.h>
+
 #include <setjmp.h>
 
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
+
 #include "options.h"
 
 /* xtables interface */
@@ -56,7 +74,22 @@
 #include "iptables.h"
 
 #define XT_LOCK_NAME "/var/run/xtables.lock"
+#define XT_LOCK_WAIT_MIN 10	/* ms */
+#define XT_LOCK_WAIT_MAX 200	/* ms */
 static int xt_lock_fd = -1;
+static unsigned int xt_lock_depth = 0;
+
+/* match or target payload built directly from fw3 structures */
+struct fw3_ipt_xt {
+	struct fw3_ipt_xt *next;
+	size_t userspacesize;
+	int pos;
+
+	union {
+		struct xt_entry_match *m;
+		struct xt_entry_target *t;
+	};
+};
 
 struct fw3_ipt_rule {
 	struct fw3_ipt_handle *h;
@@ -69,6 +102,14 @@ struct fw3_ipt_rule {
 	struct xtables_rule_match *matches;
 	struct xtables_target *target;
 
+	/* argv positions the parsed matches were loaded at */
+	int *match_pos;
+	unsigned int nmatch_pos;
+
+	struct fw3_ipt_xt *xt_matches;
+	struct fw3_ipt_xt *xt_target;
+	struct xt_comment_info *comment;
+
 	int argc;
 	char **argv;
 
@@ -76,6 +117,25 @@ struct fw3_ipt_rule {
 	bool protocol_loaded;
 };
 
+/* Cache of parsed argv fragments. Each "-m name ..." or "-j name ..."
+ * segment is parsed once in isolation and the resulting payloads are
+ * replayed for every further rule carrying the very same segment. */
+
+struct fw3_ipt_cache_entry {
+	struct avl_node node;
+	struct fw3_ipt_xt *matches;
+	struct fw3_ipt_xt *target;
+	char key[];
+};
+
+static AVL_TREE(xt_cache, avl_strcmp, false, NULL);
+
+static struct {
+	unsigned int hits;
+	unsigned int misses;
+} xt_cache_stats;
+
+
 static struct option base_opts[] = {
 	{ .name = "match",         .has_arg = 1, .val = 'm' },
 	{ .name = "jump",          .has_arg = 1, .val = 'j' },
@@ -133,6 +193,15 @@ static struct {
 	void (*register_target)(struct xtables_target *);
 } xext;
 
+/* Family whose extensions are currently registered with libxtables and
+ * the time spent registering them since the last table was closed */
+static struct {
+	bool init;
+	enum fw3_family family;
+	unsigned int runs;
+	unsigned long usec;
+} xt_setup;
+
 
 /* Required by certain extensions like SNAT and DNAT */
 int kernel_version = 0;
@@ -159,19 +228,117 @@ static void fw3_init_extensions(void)
 #endif
 }
 
+/* The xtables lock is taken once per transaction, table handles opened
+ * within it only bump the nesting depth. Other xtables users are polled
+ * with a short, growing interval instead of whole second sleeps. */
+bool
+fw3_ipt_lock(void)
+{
+	struct timespec ts;
+	long wait = XT_LOCK_WAIT_MIN;
+	bool busy = false;
+
+	if (xt_lock_depth++ > 0)
+		return true;
+
+	xt_lock_fd = open(XT_LOCK_NAME, O_CREAT|O_WRONLY|O_CLOEXEC, S_IRUSR|S_IWUSR);
+
+	if (xt_lock_fd < 0)
+	{
+		warn("Cannot create lock file %s: %s", XT_LOCK_NAME, strerror(errno));
+		xt_lock_depth = 0;
+		return false;
+	}
+
+	while (flock(xt_lock_fd, LOCK_EX|LOCK_NB))
+	{
+		if (errno != EWOULDBLOCK && errno != EINTR)
+		{
+			warn("Cannot acquire exclusive lock: %s", strerror(errno));
+			close(xt_lock_fd);
+			xt_lock_fd = -1;
+			xt_lock_depth = 0;
+			return false;
+		}
+
+		if (!busy)
+		{
+			warn("Currently busy xtables.lock - waiting");
+			busy = true;
+		}
+
+		ts.tv_sec = 0;
+		ts.tv_nsec = wait * 1000000;
+		nanosleep(&ts, NULL);
+
+		if (wait < XT_LOCK_WAIT_MAX)
+			wait = (wait * 2 < XT_LOCK_WAIT_MAX) ? wait * 2 : XT_LOCK_WAIT_MAX;
+	}
+
+	return true;
+}
+
+void
+fw3_ipt_unlock(void)
+{
+	if (!xt_lock_depth || --xt_lock_depth > 0)
+		return;
+
+	fw3_unlock_path(&xt_lock_fd, XT_LOCK_NAME);
+}
+
+/* Matches and targets are chained through their own next pointers and
+ * libxtables drops those of the other family on registration, so the
+ * registry is only rebuilt when the family changes between opens. */
+static void
+register_extensions(enum fw3_family family)
+{
+	int i;
+	struct timespec t0, t1;
+
+	if (xt_setup.init && xt_setup.family == family)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	fw3_xt_reset();
+	fw3_init_extensions();
+
+	if (xext.register_match)
+		for (i = 0; i < xext.mcount; i++)
+			xext.register_match(xext.matches[i]);
+
+	if (xext.register_target)
+		for (i = 0; i < xext.tcount; i++)
+			xext.register_target(xext.targets[i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	xt_setup.init = true;
+	xt_setup.family = family;
+	xt_setup.runs++;
+	xt_setup.usec += (t1.tv_sec - t0.tv_sec) * 1000000 +
+	                 (t1.tv_nsec - t0.tv_nsec) / 1000;
+}
+
 struct fw3_ipt_handle *
 fw3_ipt_open(enum fw3_family family, enum fw3_table table)
 {
-	int i;
 	struct fw3_ipt_handle *h;
+	static bool xt_init = false;
 
 	h = fw3_alloc(sizeof(*h));
 
-	xtables_init();
+	if (!xt_init)
+	{
+		xtables_init();
+		xt_init = true;
+	}
 
-	while (!fw3_lock_path(&xt_lock_fd, XT_LOCK_NAME)) {
-		warn("Currently busy xtables.lock - wait 1 second");
-		sleep(1);
+	if (!fw3_ipt_lock())
+	{
+		free(h);
+		return NULL;
 	}
 
 	if (family == FW3_FAMILY_V6)
@@ -198,20 +365,11 @@ fw3_ipt_open(enum fw3_family family, enum fw3_table table)
 	if (!h->handle)
 	{
 		free(h);
-		fw3_unlock_path(&xt_lock_fd, XT_LOCK_NAME);
+		fw3_ipt_unlock();
 		return NULL;
 	}
 
-	fw3_xt_reset();
-	fw3_init_extensions();
-
-	if (xext.register_match)
-		for (i = 0; i < xext.mcount; i++)
-			xext.register_match(xext.matches[i]);
-
-	if (xext.register_target)
-		for (i = 0; i < xext.tcount; i++)
-			xext.register_target(xext.targets[i]);
+	register_extensions(h->family);
 
 	return h;
 }
@@ -229,111 +387,213 @@ debug(struct fw3_ipt_handle *h, const char *fmt, ...)
 	va_end(ap);
 }
 
-void
-fw3_ipt_set_policy(struct fw3_ipt_handle *h, const char *chain,
-                   enum fw3_flag policy)
+/* Rule index of an open table, built on first use. Every rule of every
+ * chain is represented by a reference which is linked into the list of
+ * the target it jumps to, so finding all users of a chain does not
+ * require walking the whole table. Chains which see replace operations
+ * additionally get hash buckets over the entry shape of their rules. */
+
+struct fw3_ipt_target {
+	struct avl_node node;
+	struct list_head refs;
+	char name[];
+};
+
+struct fw3_ipt_chain {
+	struct avl_node node;
+	struct fw3_ipt_ref **rules;
+	unsigned int count;
+	struct list_head *buckets;
+	unsigned int nbuckets;
+	char name[];
+};
+
+struct fw3_ipt_ref {
+	struct list_head list;
+	struct list_head hlist;
+	struct fw3_ipt_target *target;
+	struct fw3_ipt_chain *chain;
+	unsigned int num;
+	uint32_t hash;
+	const void *entry;
+	void *copy;
+};
+
+struct fw3_ipt_index {
+	struct avl_tree chains;
+	struct avl_tree targets;
+};
+
+static struct fw3_ipt_chain *
+index_chain(struct fw3_ipt_handle *h, const char *name, bool add)
 {
-	if (fw3_pr_debug)
-		debug(h, "-P %s %s\n", chain, fw3_flag_names[policy]);
+	struct fw3_ipt_chain *c;
 
-#ifndef DISABLE_IPV6
-	if (h->family == FW3_FAMILY_V6)
-		ip6tc_set_policy(chain, fw3_flag_names[policy], NULL, h->handle);
-	else
-#endif
-		iptc_set_policy(chain, fw3_flag_names[policy], NULL, h->handle);
+	c = avl_find_element(&h->index->chains, name, c, node);
+
+	if (c || !add)
+		return c;
+
+	c = fw3_alloc(sizeof(*c) + strlen(name) + 1);
+	strcpy(c->name, name);
+
+	c->node.key = c->name;
+	avl_insert(&h->index->chains, &c->node);
+
+	return c;
 }
 
-void
-fw3_ipt_flush_chain(struct fw3_ipt_handle *h, const char *chain)
+/* hash over the entry parts which are compared unmasked on replace */
+static uint32_t
+entry_hash(struct fw3_ipt_handle *h, const void *entry, const char *target)
 {
-	if (fw3_pr_debug)
-		debug(h, "-F %s\n", chain);
+	unsigned int i, start, end;
+	uint32_t hv = FW3_HASH_INIT;
+	const struct xt_entry_match *m;
 
 #ifndef DISABLE_IPV6
 	if (h->family == FW3_FAMILY_V6)
-		ip6tc_flush_entries(chain, h->handle);
+	{
+		const struct ip6t_entry *e6 = entry;
+
+		hv = fw3_hash(hv, &e6->ipv6.src, sizeof(e6->ipv6.src));
+		hv = fw3_hash(hv, &e6->ipv6.dst, sizeof(e6->ipv6.dst));
+		hv = fw3_hash(hv, &e6->ipv6.proto, sizeof(e6->ipv6.proto));
+		hv = fw3_hash(hv, &e6->ipv6.invflags, sizeof(e6->ipv6.invflags));
+		hv = fw3_hash(hv, e6->ipv6.iniface,
+		              strnlen(e6->ipv6.iniface, IFNAMSIZ));
+		hv = fw3_hash(hv, e6->ipv6.outiface,
+		              strnlen(e6->ipv6.outiface, IFNAMSIZ));
+
+		start = sizeof(*e6);
+		end = e6->target_offset;
+	}
 	else
 #endif
-		iptc_flush_entries(chain, h->handle);
+	{
+		const struct ipt_entry *e = entry;
+
+		hv = fw3_hash(hv, &e->ip.src, sizeof(e->ip.src));
+		hv = fw3_hash(hv, &e->ip.dst, sizeof(e->ip.dst));
+		hv = fw3_hash(hv, &e->ip.proto, sizeof(e->ip.proto));
+		hv = fw3_hash(hv, &e->ip.invflags, sizeof(e->ip.invflags));
+		hv = fw3_hash(hv, e->ip.iniface, strnlen(e->ip.iniface, IFNAMSIZ));
+		hv = fw3_hash(hv, e->ip.outiface, strnlen(e->ip.outiface, IFNAMSIZ));
+
+		start = sizeof(*e);
+		end = e->target_offset;
+	}
+
+	for (i = start; i < end; i += m->u.match_size)
+	{
+		m = entry + i;
+
+		hv = fw3_hash(hv, m->u.user.name, strlen(m->u.user.name));
+		hv = fw3_hash(hv, &m->u.match_size, sizeof(m->u.match_size));
+	}
+
+	return fw3_hash(hv, target, strlen(target));
 }
 
 static void
-delete_rules(struct fw3_ipt_handle *h, const char *target)
+index_hash_rule(struct fw3_ipt_chain *c, struct fw3_ipt_ref *ref)
 {
-	unsigned int num;
-	const struct ipt_entry *e;
-	const char *chain;
-	const char *t;
-	bool found;
+	list_add_tail(&ref->hlist, &c->buckets[ref->hash & (c->nbuckets - 1)]);
+}
 
-#ifndef DISABLE_IPV6
-	if (h->family == FW3_FAMILY_V6)
-	{
-		for (chain = ip6tc_first_chain(h->handle);
-		     chain != NULL;
-		     chain = ip6tc_next_chain(h->handle))
-		{
-			do {
-				found = false;
+/* (re)distribute the rules of a chain, keeping buckets short as it grows */
+static void
+index_hash_chain(struct fw3_ipt_chain *c)
+{
+	unsigned int i, n = 64;
+
+	if (c->buckets && c->count < c->nbuckets * 2)
+		return;
 
-				const struct ip6t_entry *e6;
-				for (num = 0, e6 = ip6tc_first_rule(chain, h->handle);
-					 e6 != NULL;
-					 num++, e6 = ip6tc_next_rule(e6, h->handle))
-				{
-					t = ip6tc_get_target(e6, h->handle);
+	while (n < c->count)
+		n *= 2;
 
-					if (*t && !strcmp(t, target))
-					{
-						if (fw3_pr_debug)
-							debug(h, "-D %s %u\n", chain, num + 1);
+	free(c->buckets);
 
-						ip6tc_delete_num_entry(chain, num, h->handle);
-						found = true;
-						break;
-					}
-				}
-			} while (found);
-		}
+	c->buckets = fw3_alloc(n * sizeof(*c->buckets));
+	c->nbuckets = n;
+
+	for (i = 0; i < n; i++)
+		INIT_LIST_HEAD(&c->buckets[i]);
+
+	for (i = 0; i < c->count; i++)
+		index_hash_rule(c, c->rules[i]);
+}
+
+static void
+index_add_rule(struct fw3_ipt_handle *h, struct fw3_ipt_chain *c,
+               const char *target, const void *entry, void *copy)
+{
+	struct fw3_ipt_ref *ref, **tmp;
+	struct fw3_ipt_target *t;
+
+	if (!(c->count % 16))
+	{
+		tmp = realloc(c->rules, (c->count + 16) * sizeof(*tmp));
+
+		if (!tmp)
+			error("Out of memory while indexing chain %s", c->name);
+
+		c->rules = tmp;
 	}
-	else
-#endif
+
+	ref = fw3_alloc(sizeof(*ref));
+	ref->chain = c;
+	ref->num = c->count;
+	ref->entry = entry;
+	ref->copy = copy;
+	ref->hash = entry_hash(h, entry, target ? target : "");
+
+	INIT_LIST_HEAD(&ref->list);
+	INIT_LIST_HEAD(&ref->hlist);
+
+	if (target && *target)
 	{
-		for (chain = iptc_first_chain(h->handle);
-		     chain != NULL;
-		     chain = iptc_next_chain(h->handle))
-		{
-			do {
-				found = false;
+		t = avl_find_element(&h->index->targets, target, t, node);
 
-				for (num = 0, e = iptc_first_rule(chain, h->handle);
-				     e != NULL;
-					 num++, e = iptc_next_rule(e, h->handle))
-				{
-					t = iptc_get_target(e, h->handle);
+		if (!t)
+		{
+			t = fw3_alloc(sizeof(*t) + strlen(target) + 1);
+			strcpy(t->name, target);
 
-					if (*t && !strcmp(t, target))
-					{
-						if (fw3_pr_debug)
-							debug(h, "-D %s %u\n", chain, num + 1);
+			INIT_LIST_HEAD(&t->refs);
 
-						iptc_delete_num_entry(chain, num, h->handle);
-						found = true;
-						break;
-					}
-				}
-			} while (found);
+			t->node.key = t->name;
+			avl_insert(&h->index->targets, &t->node);
 		}
+
+		ref->target = t;
+		list_add_tail(&ref->list, &t->refs);
+	}
+
+	c->rules[c->count++] = ref;
+
+	if (c->buckets)
+	{
+		index_hash_rule(c, ref);
+		index_hash_chain(c);
 	}
 }
 
-static bool
-is_referenced(struct fw3_ipt_handle *h, const char *target)
+static void
+index_build(struct fw3_ipt_handle *h)
 {
-	const struct ipt_entry *e;
 	const char *chain;
-	const char *t;
+	const struct ipt_entry *e;
+	struct fw3_ipt_chain *c;
+
+	if (h->index)
+		return;
+
+	h->index = fw3_alloc(sizeof(*h->index));
+
+	avl_init(&h->index->chains, avl_strcmp, false, NULL);
+	avl_init(&h->index->targets, avl_strcmp, false, NULL);
 
 #ifndef DISABLE_IPV6
 	if (h->family == FW3_FAMILY_V6)
@@ -342,15 +602,15 @@ is_referenced(struct fw3_ipt_handle *h, const char *target)
 		     chain != NULL;
 		     chain = ip6tc_next_chain(h->handle))
 		{
+			c = index_chain(h, chain, true);
+
 			const struct ip6t_entry *e6;
 			for (e6 = ip6tc_first_rule(chain, h->handle);
 			     e6 != NULL;
 			     e6 = ip6tc_next_rule(e6, h->handle))
 			{
-				t = ip6tc_get_target(e6, h->handle);
-
-				if (*t && !strcmp(t, target))
-					return true;
+				index_add_rule(h, c, ip6tc_get_target(e6, h->handle),
+				               e6, NULL);
 			}
 		}
 	}
@@ -361,119 +621,424 @@ is_referenced(struct fw3_ipt_handle *h, const char *target)
 		     chain != NULL;
 		     chain = iptc_next_chain(h->handle))
 		{
+			c = index_chain(h, chain, true);
+
 			for (e = iptc_first_rule(chain, h->handle);
 			     e != NULL;
 			     e = iptc_next_rule(e, h->handle))
 			{
-				t = iptc_get_target(e, h->handle);
-
-				if (*t && !strcmp(t, target))
-					return true;
+				index_add_rule(h, c, iptc_get_target(e, h->handle),
+				               e, NULL);
 			}
 		}
 	}
+}
 
-	return false;
+static void
+index_flush_chain(struct fw3_ipt_chain *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->count; i++)
+	{
+		list_del(&c->rules[i]->list);
+		free(c->rules[i]->copy);
+		free(c->rules[i]);
+	}
+
+	free(c->rules);
+	free(c->buckets);
+
+	c->rules = NULL;
+	c->count = 0;
+	c->buckets = NULL;
+	c->nbuckets = 0;
 }
 
-void
-fw3_ipt_delete_chain(struct fw3_ipt_handle *h, bool if_unused,
-                     const char *chain)
+static void
+index_free(struct fw3_ipt_handle *h)
 {
-	if (if_unused && is_referenced(h, chain))
+	struct fw3_ipt_chain *c, *ctmp;
+	struct fw3_ipt_target *t, *ttmp;
+
+	if (!h->index)
 		return;
 
-	delete_rules(h, chain);
+	avl_remove_all_elements(&h->index->chains, c, node, ctmp)
+	{
+		index_flush_chain(c);
+		free(c);
+	}
 
-	if (fw3_pr_debug)
-		debug(h, "-X %s\n", chain);
+	avl_remove_all_elements(&h->index->targets, t, node, ttmp)
+		free(t);
 
-#ifndef DISABLE_IPV6
-	if (h->family == FW3_FAMILY_V6)
-		ip6tc_delete_chain(chain, h->handle);
-	else
-#endif
-		iptc_delete_chain(chain, h->handle);
+	free(h->index);
+	h->index = NULL;
 }
 
-static bool
-has_rule_tag(const void *base, unsigned int start, unsigned int end)
+/* drop the given ascending rule numbers from an indexed chain */
+static void
+index_remove(struct fw3_ipt_handle *h, const char *chain,
+             unsigned int *nums, unsigned int n)
 {
-	unsigned int i;
-	const struct xt_entry_match *em;
+	unsigned int i, j, k;
+	struct fw3_ipt_chain *c;
 
-	for (i = start; i < end; i += em->u.match_size)
-	{
-		em = base + i;
+	if (!h->index || !(c = index_chain(h, chain, false)))
+		return;
 
-		if (strcmp(em->u.user.name, "comment"))
+	for (i = 0, j = 0, k = 0; i < c->count; i++)
+	{
+		if (k < n && nums[k] == i)
+		{
+			list_del(&c->rules[i]->list);
+			list_del(&c->rules[i]->hlist);
+			free(c->rules[i]->copy);
+			free(c->rules[i]);
+			k++;
 			continue;
+		}
 
-		if (!memcmp(em->data, "!fw3", 4))
-			return true;
+		c->rules[j] = c->rules[i];
+		c->rules[j]->num = j;
+		j++;
 	}
 
-	return false;
+	c->count = j;
 }
 
-void
-fw3_ipt_delete_id_rules(struct fw3_ipt_handle *h, const char *chain)
+static int
+cmp_num(const void *a, const void *b)
 {
-	unsigned int num;
-	const struct ipt_entry *e;
-	bool found;
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
 
-#ifndef DISABLE_IPV6
-	if (h->family == FW3_FAMILY_V6)
-	{
-		if (!ip6tc_is_chain(chain, h->handle))
-			return;
+	return (x > y) - (x < y);
+}
 
-		do {
-			found = false;
+static void push_chain(struct fw3_ipt_chain ***list, unsigned int *n,
+                       struct fw3_ipt_chain *c);
 
-			const struct ip6t_entry *e6;
-			for (num = 0, e6 = ip6tc_first_rule(chain, h->handle);
-				 e6 != NULL;
-				 num++, e6 = ip6tc_next_rule(e6, h->handle))
-			{
-				if (has_rule_tag(e6, sizeof(*e6), e6->target_offset))
-				{
-					if (fw3_pr_debug)
-						debug(h, "-D %s %u\n", chain, num + 1);
+/* Chain name sets of a handle. Kept chains are those whose contributing
+ * sections did not change since the last run, flushing, deleting and
+ * appending to them is skipped so they survive a reload untouched. Created
+ * chains are the ones built by this run, see fw3_ipt_optimize(). */
 
-					ip6tc_delete_num_entry(chain, num, h->handle);
-					found = true;
-					break;
-				}
-			}
-		} while (found);
-	}
-	else
-#endif
+struct fw3_ipt_name {
+	struct avl_node node;
+	char name[];
+};
+
+static void
+add_name(struct avl_tree **tree, const char *name)
+{
+	struct fw3_ipt_name *k;
+
+	if (!*tree)
 	{
-		if (!iptc_is_chain(chain, h->handle))
-			return;
+		*tree = fw3_alloc(sizeof(**tree));
+		avl_init(*tree, avl_strcmp, false, NULL);
+	}
 
-		do {
-			found = false;
+	if (avl_find(*tree, name))
+		return;
 
-			for (num = 0, e = iptc_first_rule(chain, h->handle);
-				 e != NULL;
-				 num++, e = iptc_next_rule(e, h->handle))
-			{
-				if (has_rule_tag(e, sizeof(*e), e->target_offset))
-				{
-					if (fw3_pr_debug)
-						debug(h, "-D %s %u\n", chain, num + 1);
+	k = fw3_alloc(sizeof(*k) + strlen(name) + 1);
+	strcpy(k->name, name);
 
-					iptc_delete_num_entry(chain, num, h->handle);
-					found = true;
-					break;
-				}
-			}
-		} while (found);
+	k->node.key = k->name;
+	avl_insert(*tree, &k->node);
+}
+
+static void
+free_names(struct avl_tree **tree)
+{
+	struct fw3_ipt_name *k, *tmp;
+
+	if (!*tree)
+		return;
+
+	avl_remove_all_elements(*tree, k, node, tmp)
+		free(k);
+
+	free(*tree);
+	*tree = NULL;
+}
+
+void
+fw3_ipt_keep_chain(struct fw3_ipt_handle *h, const char *chain)
+{
+	add_name(&h->kept, chain);
+}
+
+static bool
+is_kept(struct fw3_ipt_handle *h, const char *chain)
+{
+	return (h->kept && avl_find(h->kept, chain));
+}
+
+void
+fw3_ipt_set_policy(struct fw3_ipt_handle *h, const char *chain,
+                   enum fw3_flag policy)
+{
+	if (fw3_pr_debug)
+		debug(h, "-P %s %s\n", chain, fw3_flag_names[policy]);
+
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		ip6tc_set_policy(chain, fw3_flag_names[policy], NULL, h->handle);
+	else
+#endif
+		iptc_set_policy(chain, fw3_flag_names[policy], NULL, h->handle);
+}
+
+void
+fw3_ipt_flush_chain(struct fw3_ipt_handle *h, const char *chain)
+{
+	struct fw3_ipt_chain *c;
+
+	if (is_kept(h, chain))
+		return;
+
+	if (fw3_pr_debug)
+		debug(h, "-F %s\n", chain);
+
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		ip6tc_flush_entries(chain, h->handle);
+	else
+#endif
+		iptc_flush_entries(chain, h->handle);
+
+	if (h->index && (c = index_chain(h, chain, false)) != NULL)
+		index_flush_chain(c);
+}
+
+static void
+push_num(unsigned int **nums, unsigned int *n, unsigned int num)
+{
+	unsigned int *tmp;
+
+	if (!(*n % 32))
+	{
+		tmp = realloc(*nums, (*n + 32) * sizeof(**nums));
+
+		if (!tmp)
+			error("Out of memory");
+
+		*nums = tmp;
+	}
+
+	(*nums)[(*n)++] = num;
+}
+
+/* delete the given ascending rule numbers from the end so that the
+ * positions of the remaining ones stay valid */
+static void
+delete_nums(struct fw3_ipt_handle *h, const char *chain,
+            unsigned int *nums, unsigned int n, bool print)
+{
+	unsigned int i = n;
+
+	while (i-- > 0)
+	{
+		if (print && fw3_pr_debug)
+			debug(h, "-D %s %u\n", chain, nums[i] + 1);
+
+#ifndef DISABLE_IPV6
+		if (h->family == FW3_FAMILY_V6)
+			ip6tc_delete_num_entry(chain, nums[i], h->handle);
+		else
+#endif
+			iptc_delete_num_entry(chain, nums[i], h->handle);
+	}
+
+	index_remove(h, chain, nums, n);
+}
+
+static void
+delete_rules(struct fw3_ipt_handle *h, const char *target)
+{
+	unsigned int n, *nums = NULL;
+	struct fw3_ipt_target *t;
+	struct fw3_ipt_chain *c;
+	struct fw3_ipt_ref *ref;
+
+	index_build(h);
+
+	t = avl_find_element(&h->index->targets, target, t, node);
+
+	if (!t)
+		return;
+
+	/* each round clears all references held by one chain */
+	while (!list_empty(&t->refs))
+	{
+		c = list_first_entry(&t->refs, struct fw3_ipt_ref, list)->chain;
+		n = 0;
+
+		list_for_each_entry(ref, &t->refs, list)
+			if (ref->chain == c)
+				push_num(&nums, &n, ref->num);
+
+		if (!n)
+			break;
+
+		qsort(nums, n, sizeof(*nums), cmp_num);
+		delete_nums(h, c->name, nums, n, true);
+	}
+
+	free(nums);
+}
+
+static bool
+is_referenced(struct fw3_ipt_handle *h, const char *target)
+{
+	struct fw3_ipt_target *t;
+
+	index_build(h);
+
+	t = avl_find_element(&h->index->targets, target, t, node);
+
+	return (t && !list_empty(&t->refs));
+}
+
+static void
+delete_chain(struct fw3_ipt_handle *h, const char *chain)
+{
+	int rv;
+	struct fw3_ipt_chain *c;
+
+	delete_rules(h, chain);
+
+	if (fw3_pr_debug)
+		debug(h, "-X %s\n", chain);
+
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		rv = ip6tc_delete_chain(chain, h->handle);
+	else
+#endif
+		rv = iptc_delete_chain(chain, h->handle);
+
+	if (rv && h->index && (c = index_chain(h, chain, false)) != NULL)
+	{
+		index_flush_chain(c);
+		avl_delete(&h->index->chains, &c->node);
+		free(c);
+	}
+}
+
+void
+fw3_ipt_delete_chain(struct fw3_ipt_handle *h, bool if_unused,
+                     const char *chain)
+{
+	if (is_kept(h, chain))
+		return;
+
+	if (if_unused && is_referenced(h, chain))
+		return;
+
+	delete_chain(h, chain);
+}
+
+/* Delete all chains whose name starts with the given prefix. Chains still
+ * jumped to from kept chains are kept as well. */
+void
+fw3_ipt_delete_chains(struct fw3_ipt_handle *h, const char *prefix)
+{
+	bool keep;
+	unsigned int i, n = 0;
+	size_t len = strlen(prefix);
+	struct fw3_ipt_chain *c, **list = NULL;
+	struct fw3_ipt_target *t;
+	struct fw3_ipt_ref *ref;
+
+	index_build(h);
+
+	avl_for_each_element(&h->index->chains, c, node)
+	{
+		if (strncmp(c->name, prefix, len))
+			continue;
+
+		keep = false;
+		t = avl_find_element(&h->index->targets, c->name, t, node);
+
+		if (t)
+			list_for_each_entry(ref, &t->refs, list)
+				if (is_kept(h, ref->chain->name))
+					keep = true;
+
+		if (keep)
+			fw3_ipt_keep_chain(h, c->name);
+		else
+			push_chain(&list, &n, c);
+	}
+
+	for (i = 0; i < n; i++)
+		delete_chain(h, list[i]->name);
+
+	free(list);
+}
+
+static bool
+has_rule_tag(const void *base, unsigned int start, unsigned int end)
+{
+	unsigned int i;
+	const struct xt_entry_match *em;
+
+	for (i = start; i < end; i += em->u.match_size)
+	{
+		em = base + i;
+
+		if (strcmp(em->u.user.name, "comment"))
+			continue;
+
+		if (!memcmp(em->data, "!fw3", 4))
+			return true;
 	}
+
+	return false;
+}
+
+void
+fw3_ipt_delete_id_rules(struct fw3_ipt_handle *h, const char *chain)
+{
+	unsigned int num, n = 0, *nums = NULL;
+	const struct ipt_entry *e;
+
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+	{
+		if (!ip6tc_is_chain(chain, h->handle))
+			return;
+
+		const struct ip6t_entry *e6;
+		for (num = 0, e6 = ip6tc_first_rule(chain, h->handle);
+		     e6 != NULL;
+		     num++, e6 = ip6tc_next_rule(e6, h->handle))
+		{
+			if (has_rule_tag(e6, sizeof(*e6), e6->target_offset))
+				push_num(&nums, &n, num);
+		}
+	}
+	else
+#endif
+	{
+		if (!iptc_is_chain(chain, h->handle))
+			return;
+
+		for (num = 0, e = iptc_first_rule(chain, h->handle);
+		     e != NULL;
+		     num++, e = iptc_next_rule(e, h->handle))
+		{
+			if (has_rule_tag(e, sizeof(*e), e->target_offset))
+				push_num(&nums, &n, num);
+		}
+	}
+
+	delete_nums(h, chain, nums, n, true);
+	free(nums);
 }
 
 
@@ -488,17 +1053,39 @@ is_chain(struct fw3_ipt_handle *h, const char *name)
 		return iptc_is_chain(name, h->handle);
 }
 
-void
-fw3_ipt_create_chain(struct fw3_ipt_handle *h, bool ignore_existing,
-                     const char *chain)
+static void
+create_chain(struct fw3_ipt_handle *h, bool ignore_existing,
+             const char *chain)
 {
-	if (ignore_existing && is_chain(h, chain))
+	if ((ignore_existing && is_chain(h, chain)) || is_kept(h, chain))
 		return;
 
 	if (fw3_pr_debug)
 		debug(h, "-N %s\n", chain);
 
 	iptc_create_chain(chain, h->handle);
+
+	if (h->index)
+		index_chain(h, chain, true);
+}
+
+void
+fw3_ipt_create_chain(struct fw3_ipt_handle *h, bool ignore_existing,
+                     const char *chain)
+{
+	if (is_kept(h, chain))
+		return;
+
+	create_chain(h, ignore_existing, chain);
+	add_name(&h->created, chain);
+}
+
+/* custom chains are filled by the user and left alone by the optimiser */
+void
+fw3_ipt_create_custom_chain(struct fw3_ipt_handle *h, bool ignore_existing,
+                            const char *chain)
+{
+	create_chain(h, ignore_existing, chain);
 }
 
 void
@@ -540,6 +1127,8 @@ fw3_ipt_flush(struct fw3_ipt_handle *h)
 			iptc_delete_chain(chain, h->handle);
 		}
 	}
+
+	index_free(h);
 }
 
 static bool
@@ -555,1111 +1144,3094 @@ chain_is_empty(struct fw3_ipt_handle *h, const char *chain)
 	        !iptc_first_rule(chain, h->handle));
 }
 
+static void
+push_chain(struct fw3_ipt_chain ***list, unsigned int *n,
+           struct fw3_ipt_chain *c)
+{
+	struct fw3_ipt_chain **tmp;
+
+	if (!(*n % 16))
+	{
+		tmp = realloc(*list, (*n + 16) * sizeof(*tmp));
+
+		if (!tmp)
+			error("Out of memory");
+
+		*list = tmp;
+	}
+
+	(*list)[(*n)++] = c;
+}
+
 void
 fw3_ipt_gc(struct fw3_ipt_handle *h)
 {
-	const char *chain;
-	bool found;
+	unsigned int i, nw = 0, np, deleted = 0;
+	struct fw3_ipt_chain *c, **work = NULL, **parents = NULL;
+	struct fw3_ipt_target *t;
+	struct fw3_ipt_ref *ref;
 
-#ifndef DISABLE_IPV6
-	if (h->family == FW3_FAMILY_V6)
+	index_build(h);
+
+	avl_for_each_element(&h->index->chains, c, node)
+		if (chain_is_empty(h, c->name))
+			push_chain(&work, &nw, c);
+
+	while (nw > 0)
 	{
-		do {
-			found = false;
+		c = work[--nw];
+		np = 0;
 
-			for (chain = ip6tc_first_chain(h->handle);
-				 chain != NULL;
-				 chain = ip6tc_next_chain(h->handle))
+		/* remember the chains jumping here, dropping the jumps may
+		 * leave them empty in turn */
+		t = avl_find_element(&h->index->targets, c->name, t, node);
+
+		if (t)
+		{
+			list_for_each_entry(ref, &t->refs, list)
 			{
-				if (!chain_is_empty(h, chain))
-					continue;
+				for (i = 0; i < np; i++)
+					if (parents[i] == ref->chain)
+						break;
 
-				fw3_ipt_delete_chain(h, false, chain);
-				found = true;
-				break;
+				if (i == np && ref->chain != c)
+					push_chain(&parents, &np, ref->chain);
 			}
-		} while(found);
+		}
+
+		fw3_ipt_delete_chain(h, false, c->name);
+		deleted++;
+
+		for (i = 0; i < np; i++)
+			if (chain_is_empty(h, parents[i]->name))
+				push_chain(&work, &nw, parents[i]);
 	}
-	else
-#endif
-	{
-		do {
-			found = false;
 
-			for (chain = iptc_first_chain(h->handle);
-				 chain != NULL;
-				 chain = iptc_next_chain(h->handle))
-			{
-				warn("C=%s\n", chain);
+	free(work);
+	free(parents);
 
-				if (!chain_is_empty(h, chain))
-					continue;
+	if (deleted)
+		info("   * Removed %u empty chains from %s table",
+		     deleted, fw3_flag_names[h->table]);
+}
 
-				warn("D=%s\n", chain);
+/* Snapshot of the live rules of a table taken before a reload. At commit
+ * time every rebuilt chain is diffed against it, rules found unchanged
+ * get their packet counters back and the size of the delta is reported. */
 
-				fw3_ipt_delete_chain(h, false, chain);
-				found = true;
-				break;
-			}
-		} while (found);
-	}
+struct fw3_ipt_snap_rule {
+	uint64_t digest;
+	struct xt_counters counters;
+};
+
+struct fw3_ipt_snap_chain {
+	struct avl_node node;
+	struct fw3_ipt_snap_rule *rules;
+	unsigned int count;
+	bool seen;
+	char name[];
+};
+
+struct fw3_ipt_snapshot {
+	struct avl_tree chains;
+};
+
+static uint64_t
+digest_data(uint64_t d, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len-- > 0)
+		d = (d ^ *p++) * 1099511628211ULL;
+
+	return d;
 }
 
-void
-fw3_ipt_commit(struct fw3_ipt_handle *h)
+/* only the userspace part of extension data is stable across a kernel
+ * round trip, fall back to the full size for unknown revisions */
+static size_t
+xt_data_size(bool target, const char *name, uint8_t revision, size_t size)
 {
-	int rv;
+	struct xtables_match *m;
+	struct xtables_target *t;
+	size_t us = size;
 
-#ifndef DISABLE_IPV6
-	if (h->family == FW3_FAMILY_V6)
+	xext.retain = true;
+
+	if (target)
 	{
-		rv = ip6tc_commit(h->handle);
-		if (!rv)
-			warn("ip6tc_commit(): %s", ip6tc_strerror(errno));
+		t = xtables_find_target(name, XTF_TRY_LOAD);
+
+		if (t && t->revision == revision)
+			us = t->userspacesize;
 	}
 	else
-#endif
 	{
-		rv = iptc_commit(h->handle);
-		if (!rv)
-			warn("iptc_commit(): %s", iptc_strerror(errno));
+		m = xtables_find_match(name, XTF_TRY_LOAD, NULL);
+
+		if (m && m->revision == revision)
+			us = m->userspacesize;
 	}
-}
 
-void
-fw3_ipt_close(struct fw3_ipt_handle *h)
-{
-	fw3_unlock_path(&xt_lock_fd, XT_LOCK_NAME);
-	free(h);
+	xext.retain = false;
+
+	return (us < size) ? us : size;
 }
 
-struct fw3_ipt_rule *
-fw3_ipt_rule_new(struct fw3_ipt_handle *h)
+static uint64_t
+entry_digest(struct fw3_ipt_handle *h, const void *e, const char *target)
 {
-	struct fw3_ipt_rule *r;
+	uint64_t d = 14695981039346656037ULL;
+	unsigned int i, start, end, next;
+	const struct xt_entry_match *m;
+	const struct xt_entry_target *t;
 
-	r = fw3_alloc(sizeof(*r));
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+	{
+		const struct ip6t_entry *e6 = e;
 
-	r->h = h;
-	r->argv = fw3_alloc(sizeof(char *));
-	r->argv[r->argc++] = "fw3";
+		d = digest_data(d, &e6->ipv6, sizeof(e6->ipv6));
+		start = sizeof(*e6);
+		end = e6->target_offset;
+		next = e6->next_offset;
+	}
+	else
+#endif
+	{
+		const struct ipt_entry *e4 = e;
 
-	return r;
-}
+		d = digest_data(d, &e4->ip, sizeof(e4->ip));
+		start = sizeof(*e4);
+		end = e4->target_offset;
+		next = e4->next_offset;
+	}
 
+	for (i = start; i < end; i += m->u.match_size)
+	{
+		m = e + i;
 
-static char *
-get_protoname(struct fw3_ipt_rule *r)
-{
-	const struct xtables_pprot *pp;
+		d = digest_data(d, m->u.user.name, strlen(m->u.user.name));
+		d = digest_data(d, &m->u.user.revision, sizeof(m->u.user.revision));
+		d = digest_data(d, m->data,
+		                xt_data_size(false, m->u.user.name, m->u.user.revision,
+		                             m->u.match_size - sizeof(*m)));
+	}
 
-	if (r->protocol)
-		for (pp = xtables_chain_protos; pp->name; pp++)
-			if (pp->num == r->protocol)
-				return (char *)pp->name;
+	d = digest_data(d, target, strlen(target));
 
-	return NULL;
+	if (next > end)
+	{
+		t = e + end;
+
+		if (t->u.user.name[0])
+			d = digest_data(d, t->data,
+			                xt_data_size(true, t->u.user.name, t->u.user.revision,
+			                             t->u.target_size - sizeof(*t)));
+	}
+
+	return d;
 }
 
-static struct xtables_match *
-find_match(struct fw3_ipt_rule *r, const char *name)
+static const char *
+first_chain(struct fw3_ipt_handle *h)
 {
-	struct xtables_match *m;
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		return ip6tc_first_chain(h->handle);
+#endif
 
-	xext.retain = true;
-	m = xtables_find_match(name, XTF_TRY_LOAD, &r->matches);
-	xext.retain = false;
+	return iptc_first_chain(h->handle);
+}
 
-	return m;
+static const char *
+next_chain(struct fw3_ipt_handle *h)
+{
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		return ip6tc_next_chain(h->handle);
+#endif
+
+	return iptc_next_chain(h->handle);
 }
 
-static void
-init_match(struct fw3_ipt_rule *r, struct xtables_match *m, bool no_clone)
+/* digest and counters of every rule in a chain */
+static unsigned int
+read_chain(struct fw3_ipt_handle *h, const char *chain,
+           struct fw3_ipt_snap_rule **rules)
 {
-	size_t s;
-	struct xtables_globals *g;
+	unsigned int n = 0;
+	struct fw3_ipt_snap_rule *tmp;
+	const struct ipt_entry *e;
 
-	if (!m)
-		return;
+	*rules = NULL;
 
-	s = XT_ALIGN(sizeof(struct xt_entry_match)) + m->size;
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+	{
+		const struct ip6t_entry *e6;
+		for (e6 = ip6tc_first_rule(chain, h->handle);
+		     e6 != NULL;
+		     e6 = ip6tc_next_rule(e6, h->handle), n++)
+		{
+			if (!(n % 32))
+			{
+				if (!(tmp = realloc(*rules, (n + 32) * sizeof(*tmp))))
+					error("Out of memory while reading chain %s", chain);
 
-	m->m = fw3_alloc(s);
+				*rules = tmp;
+			}
 
-	fw3_xt_set_match_name(m);
+			(*rules)[n].digest =
+				entry_digest(h, e6, ip6tc_get_target(e6, h->handle));
+			(*rules)[n].counters = e6->counters;
+		}
+	}
+	else
+#endif
+	{
+		for (e = iptc_first_rule(chain, h->handle);
+		     e != NULL;
+		     e = iptc_next_rule(e, h->handle), n++)
+		{
+			if (!(n % 32))
+			{
+				if (!(tmp = realloc(*rules, (n + 32) * sizeof(*tmp))))
+					error("Out of memory while reading chain %s", chain);
 
-	m->m->u.user.revision = m->revision;
-	m->m->u.match_size = s;
+				*rules = tmp;
+			}
 
-	/* free previous userspace data */
-	fw3_xt_free_match_udata(m);
+			(*rules)[n].digest =
+				entry_digest(h, e, iptc_get_target(e, h->handle));
+			(*rules)[n].counters = e->counters;
+		}
+	}
 
-	if (m->init)
-		m->init(m->m);
+	return n;
+}
 
-	/* don't merge options if no_clone is set and this match is a clone */
-	if (no_clone && (m == m->next))
+void
+fw3_ipt_snapshot(struct fw3_ipt_handle *h)
+{
+	const char *chain;
+	struct fw3_ipt_snap_chain *c;
+
+	if (h->snapshot)
 		return;
 
-	/* merge option table */
-	g = (r->h->family == FW3_FAMILY_V6) ? &xtg6 : &xtg;
-	fw3_xt_merge_match_options(g, m);
+	h->snapshot = fw3_alloc(sizeof(*h->snapshot));
+	avl_init(&h->snapshot->chains, avl_strcmp, false, NULL);
+
+	for (chain = first_chain(h); chain != NULL; chain = next_chain(h))
+	{
+		c = fw3_alloc(sizeof(*c) + strlen(chain) + 1);
+		strcpy(c->name, chain);
+
+		c->count = read_chain(h, chain, &c->rules);
+		c->node.key = c->name;
+		avl_insert(&h->snapshot->chains, &c->node);
+	}
 }
 
-static bool
-need_protomatch(struct fw3_ipt_rule *r, const char *pname)
+static void
+snapshot_free(struct fw3_ipt_handle *h)
 {
-	if (!pname)
-		return false;
+	struct fw3_ipt_snap_chain *c, *tmp;
 
-	if (!xtables_find_match(pname, XTF_DONT_LOAD, NULL))
-		return true;
+	if (!h->snapshot)
+		return;
 
-	return !r->protocol_loaded;
+	avl_remove_all_elements(&h->snapshot->chains, c, node, tmp)
+	{
+		free(c->rules);
+		free(c);
+	}
+
+	free(h->snapshot);
+	h->snapshot = NULL;
 }
 
-static struct xtables_match *
-load_protomatch(struct fw3_ipt_rule *r)
+static void
+keep_rule(struct fw3_ipt_handle *h, const char *chain, unsigned int num,
+          struct fw3_ipt_snap_rule *old, struct fw3_ipt_snap_rule *new)
 {
-	const char *pname = get_protoname(r);
-
-	if (!need_protomatch(r, pname))
-		return NULL;
+	/* rebuilt rules start from zero, carry the old counters over */
+	if (new->counters.pcnt || new->counters.bcnt ||
+	    (!old->counters.pcnt && !old->counters.bcnt))
+		return;
 
-	return find_match(r, pname);
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		ip6tc_set_counter(chain, num, &old->counters, h->handle);
+	else
+#endif
+		iptc_set_counter(chain, num, &old->counters, h->handle);
 }
 
-static struct xtables_target *
-find_target(struct fw3_ipt_rule *r, const char *name)
+/* longest common subsequence of the old and new rule digests, trimming
+ * the common head and tail first; returns the number of kept rules */
+static unsigned int
+diff_chain(struct fw3_ipt_handle *h, const char *chain,
+           struct fw3_ipt_snap_rule *a, unsigned int n,
+           struct fw3_ipt_snap_rule *b, unsigned int m)
 {
-	struct xtables_target *t;
+	unsigned int i, j, w, kept = 0, *lcs;
+	unsigned int head = 0, tail = 0;
 
-	xext.retain = true;
+	while (head < n && head < m && a[head].digest == b[head].digest)
+	{
+		keep_rule(h, chain, head, &a[head], &b[head]);
+		head++;
+	}
 
-	if (is_chain(r->h, name))
-		t = xtables_find_target(XT_STANDARD_TARGET, XTF_TRY_LOAD);
-	else
-		t = xtables_find_target(name, XTF_TRY_LOAD);
+	while (tail < n - head && tail < m - head &&
+	       a[n - tail - 1].digest == b[m - tail - 1].digest)
+	{
+		keep_rule(h, chain, m - tail - 1, &a[n - tail - 1], &b[m - tail - 1]);
+		tail++;
+	}
 
-	xext.retain = false;
+	kept = head + tail;
+	a += head; n -= head + tail;
+	b += head; m -= head + tail;
 
-	return t;
+	if (!n || !m || (size_t)n * m > (1 << 20))
+		return kept;
+
+	w = m + 1;
+	lcs = fw3_alloc((n + 1) * w * sizeof(*lcs));
+
+	for (i = n; i-- > 0; )
+		for (j = m; j-- > 0; )
+			lcs[i * w + j] = (a[i].digest == b[j].digest)
+				? lcs[(i + 1) * w + j + 1] + 1
+				: (lcs[(i + 1) * w + j] > lcs[i * w + j + 1])
+					? lcs[(i + 1) * w + j] : lcs[i * w + j + 1];
+
+	for (i = 0, j = 0; i < n && j < m; )
+	{
+		if (a[i].digest == b[j].digest)
+		{
+			keep_rule(h, chain, head + j, &a[i], &b[j]);
+			kept++;
+			i++;
+			j++;
+		}
+		else if (lcs[(i + 1) * w + j] >= lcs[i * w + j + 1])
+		{
+			i++;
+		}
+		else
+		{
+			j++;
+		}
+	}
+
+	free(lcs);
+
+	return kept;
 }
 
-static struct xtables_target *
-get_target(struct fw3_ipt_rule *r, const char *name)
+static void
+snapshot_diff(struct fw3_ipt_handle *h)
 {
-	size_t s;
-	struct xtables_target *t;
-	struct xtables_globals *g;
+	const char *chain;
+	unsigned int n, k, added = 0, removed = 0, kept = 0;
+	struct fw3_ipt_snap_rule *rules;
+	struct fw3_ipt_snap_chain *c;
 
-	t = find_target(r, name);
+	for (chain = first_chain(h); chain != NULL; chain = next_chain(h))
+	{
+		n = read_chain(h, chain, &rules);
+		c = avl_find_element(&h->snapshot->chains, chain, c, node);
 
-	if (!t)
-		return NULL;
+		if (c && !c->seen)
+		{
+			c->seen = true;
+			k = diff_chain(h, chain, c->rules, c->count, rules, n);
 
-	s = XT_ALIGN(sizeof(struct xt_entry_target)) + t->size;
-	t->t = fw3_alloc(s);
+			kept += k;
+			added += n - k;
+			removed += c->count - k;
+		}
+		else
+		{
+			added += n;
+		}
 
-	fw3_xt_set_target_name(t, name);
+		free(rules);
+	}
 
-	t->t->u.user.revision = t->revision;
-	t->t->u.target_size = s;
+	avl_for_each_element(&h->snapshot->chains, c, node)
+		if (!c->seen)
+			removed += c->count;
 
-	/* free previous userspace data */
-	fw3_xt_free_target_udata(t);
+	info("   * %u rules added, %u removed, %u kept", added, removed, kept);
+}
 
-	if (t->init)
-		t->init(t->t);
+/* Rule optimiser. Rules in the chains created by this run which can never
+ * match, because an earlier terminal rule of the same chain matches all of
+ * their packets, are removed before the commit. Exact duplicates are the
+ * common case. Only matches known to be free of side effects are reasoned
+ * about, rules using any other extension, e.g. from extra options, are
+ * never removed and never considered to shadow others. */
 
-	/* merge option table */
-	g = (r->h->family == FW3_FAMILY_V6) ? &xtg6 : &xtg;
-	fw3_xt_merge_target_options(g, t);
+static const char *opt_matches[] = {
+	"comment", "conntrack", "dscp", "helper", "icmp", "icmp6", "iprange",
+	"mac", "mark", "multiport", "physdev", "state", "tcp", "udp", NULL
+};
 
-	r->target = t;
+static const char *opt_targets[] = {
+	"ACCEPT", "DROP", "REJECT", "RETURN", NULL
+};
 
-	return t;
+static const char *opt_passive[] = {
+	"", "LOG", "NFLOG", NULL
+};
+
+struct fw3_ipt_opt_rule {
+	const void *entry;
+	const char *target;
+	unsigned int start, end;
+	bool known;
+};
+
+static bool
+opt_listed(const char **list, const char *name)
+{
+	while (*list)
+		if (!strcmp(*list++, name))
+			return true;
+
+	return false;
 }
 
-void
-fw3_ipt_rule_proto(struct fw3_ipt_rule *r, struct fw3_protocol *proto)
+static bool
+opt_addr(const void *a, const void *am, const void *b, const void *bm,
+         size_t len)
 {
-	uint32_t pr;
+	size_t i;
+	const uint8_t *pa = a, *pam = am, *pb = b, *pbm = bm;
 
-	if (!proto || proto->any)
-		return;
+	for (i = 0; i < len; i++)
+		if ((pam[i] & pbm[i]) != pam[i] || (pb[i] & pam[i]) != (pa[i] & pam[i]))
+			return false;
 
-	pr = proto->protocol;
+	return true;
+}
+
+static bool
+opt_iface(const char *a, const unsigned char *am,
+          const char *b, const unsigned char *bm)
+{
+	return (!a[0] ||
+	        (!memcmp(a, b, IFNAMSIZ) && !memcmp(am, bm, IFNAMSIZ)));
+}
 
+/* whether the address part of entry a matches everything that of b does,
+ * parts using inversion or fragment flags must be identical */
+static bool
+opt_covers_ip(struct fw3_ipt_handle *h, const void *a, const void *b)
+{
 #ifndef DISABLE_IPV6
-	if (r->h->family == FW3_FAMILY_V6)
+	if (h->family == FW3_FAMILY_V6)
 	{
-		if (pr == 1)
-			pr = 58;
-
-		r->e6.ipv6.proto = pr;
-		r->e6.ipv6.flags |= IP6T_F_PROTO;
-
-		if (proto->invert)
-			r->e6.ipv6.invflags |= XT_INV_PROTO;
+		const struct ip6t_ip6 *x = &((const struct ip6t_entry *)a)->ipv6;
+		const struct ip6t_ip6 *y = &((const struct ip6t_entry *)b)->ipv6;
+
+		/* inverted or unusual selectors on either side are only
+		 * covered by an identical rule */
+		if (x->invflags || (x->flags & ~IP6T_F_GOTO & ~IP6T_F_PROTO) ||
+		    (y->invflags & ~XT_INV_PROTO) ||
+		    (y->flags & ~IP6T_F_GOTO & ~IP6T_F_PROTO))
+			return !memcmp(x, y, sizeof(*x));
+
+		if ((x->flags & IP6T_F_PROTO) &&
+		    (!(y->flags & IP6T_F_PROTO) || y->proto != x->proto ||
+		     (y->invflags & XT_INV_PROTO)))
+			return false;
+
+		return (opt_addr(&x->src, &x->smsk, &y->src, &y->smsk, 16) &&
+		        opt_addr(&x->dst, &x->dmsk, &y->dst, &y->dmsk, 16) &&
+		        opt_iface(x->iniface, x->iniface_mask,
+		                  y->iniface, y->iniface_mask) &&
+		        opt_iface(x->outiface, x->outiface_mask,
+		                  y->outiface, y->outiface_mask));
 	}
 	else
 #endif
 	{
-		r->e.ip.proto = pr;
-
-		if (proto->invert)
-			r->e.ip.invflags |= XT_INV_PROTO;
+		const struct ipt_ip *x = &((const struct ipt_entry *)a)->ip;
+		const struct ipt_ip *y = &((const struct ipt_entry *)b)->ip;
+
+		if (x->invflags || (x->flags & ~IPT_F_GOTO) ||
+		    (y->invflags & ~XT_INV_PROTO) || (y->flags & ~IPT_F_GOTO))
+			return !memcmp(x, y, sizeof(*x));
+
+		if (x->proto && (y->proto != x->proto || (y->invflags & XT_INV_PROTO)))
+			return false;
+
+		return (opt_addr(&x->src, &x->smsk, &y->src, &y->smsk, 4) &&
+		        opt_addr(&x->dst, &x->dmsk, &y->dst, &y->dmsk, 4) &&
+		        opt_iface(x->iniface, x->iniface_mask,
+		                  y->iniface, y->iniface_mask) &&
+		        opt_iface(x->outiface, x->outiface_mask,
+		                  y->outiface, y->outiface_mask));
 	}
-
-	r->protocol = pr;
 }
 
-void
-fw3_ipt_rule_in_out(struct fw3_ipt_rule *r,
-                    struct fw3_device *in, struct fw3_device *out)
+static bool
+opt_has_match(struct fw3_ipt_opt_rule *r, const struct xt_entry_match *m)
 {
-#ifndef DISABLE_IPV6
-	if (r->h->family == FW3_FAMILY_V6)
+	unsigned int i;
+	const struct xt_entry_match *n;
+
+	for (i = r->start; i < r->end; i += n->u.match_size)
 	{
-		if (in && !in->any)
-		{
-			xtables_parse_interface(in->name, r->e6.ipv6.iniface,
-			                                  r->e6.ipv6.iniface_mask);
+		n = r->entry + i;
+
+		if (n->u.match_size == m->u.match_size &&
+		    n->u.user.revision == m->u.user.revision &&
+		    !strcmp(n->u.user.name, m->u.user.name) &&
+		    !memcmp(n->data, m->data,
+		            xt_data_size(false, m->u.user.name, m->u.user.revision,
+		                         m->u.match_size - sizeof(*m))))
+			return true;
+	}
 
-			if (in->invert)
-				r->e6.ipv6.invflags |= IP6T_INV_VIA_IN;
-		}
+	return false;
+}
 
-		if (out && !out->any)
-		{
-			xtables_parse_interface(out->name, r->e6.ipv6.outiface,
-			                                   r->e6.ipv6.outiface_mask);
-
-			if (out->invert)
-				r->e6.ipv6.invflags |= IP6T_INV_VIA_OUT;
-		}
-	}
-	else
-#endif
-	{
-		if (in && !in->any)
-		{
-			xtables_parse_interface(in->name, r->e.ip.iniface,
-			                                  r->e.ip.iniface_mask);
+/* rule a matches at least every packet rule b matches */
+static bool
+opt_covers(struct fw3_ipt_handle *h,
+           struct fw3_ipt_opt_rule *a, struct fw3_ipt_opt_rule *b)
+{
+	unsigned int i;
+	const struct xt_entry_match *m;
 
-			if (in->invert)
-				r->e.ip.invflags |= IPT_INV_VIA_IN;
-		}
+	if (!opt_covers_ip(h, a->entry, b->entry))
+		return false;
 
-		if (out && !out->any)
-		{
-			xtables_parse_interface(out->name, r->e.ip.outiface,
-			                                   r->e.ip.outiface_mask);
+	for (i = a->start; i < a->end; i += m->u.match_size)
+	{
+		m = a->entry + i;
 
-			if (out->invert)
-				r->e.ip.invflags |= IPT_INV_VIA_OUT;
-		}
+		if (strcmp(m->u.user.name, "comment") && !opt_has_match(b, m))
+			return false;
 	}
-}
 
+	return true;
+}
 
-void
-fw3_ipt_rule_src_dest(struct fw3_ipt_rule *r,
-                      struct fw3_address *src, struct fw3_address *dest)
+static const char *
+opt_comment(struct fw3_ipt_opt_rule *r)
 {
-	if ((src && src->range) || (dest && dest->range))
+	unsigned int i;
+	const struct xt_entry_match *m;
+
+	for (i = r->start; i < r->end; i += m->u.match_size)
 	{
-		fw3_ipt_rule_addarg(r, false, "-m", "iprange");
+		m = r->entry + i;
+
+		if (!strcmp(m->u.user.name, "comment"))
+			return ((const struct xt_comment_info *)m->data)->comment;
 	}
 
-	if (src && src->set)
-	{
-		if (src->range)
-		{
-			fw3_ipt_rule_addarg(r, src->invert, "--src-range",
-			                    fw3_address_to_string(src, false, false));
-		}
+	return "-";
+}
+
+static const void *
+first_rule(struct fw3_ipt_handle *h, const char *chain)
+{
 #ifndef DISABLE_IPV6
-		else if (r->h->family == FW3_FAMILY_V6)
-		{
-			r->e6.ipv6.src = src->address.v6;
-			r->e6.ipv6.smsk = src->mask.v6;
+	if (h->family == FW3_FAMILY_V6)
+		return ip6tc_first_rule(chain, h->handle);
+#endif
 
-			int i;
-			for (i = 0; i < 4; i++)
-				r->e6.ipv6.src.s6_addr32[i] &= r->e6.ipv6.smsk.s6_addr32[i];
+	return iptc_first_rule(chain, h->handle);
+}
 
-			if (src->invert)
-				r->e6.ipv6.invflags |= IP6T_INV_SRCIP;
-		}
+static const void *
+next_rule(struct fw3_ipt_handle *h, const void *e)
+{
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		return ip6tc_next_rule(e, h->handle);
 #endif
-		else
-		{
-			r->e.ip.src = src->address.v4;
-			r->e.ip.smsk = src->mask.v4;
 
-			r->e.ip.src.s_addr &= r->e.ip.smsk.s_addr;
+	return iptc_next_rule(e, h->handle);
+}
 
-			if (src->invert)
-				r->e.ip.invflags |= IPT_INV_SRCIP;
-		}
-	}
+static unsigned int
+opt_read_chain(struct fw3_ipt_handle *h, const char *chain,
+               struct fw3_ipt_opt_rule **rules)
+{
+	unsigned int i, n = 0;
+	struct fw3_ipt_opt_rule *tmp, *r;
+	const struct xt_entry_match *m;
+	const void *e;
 
-	if (dest && dest->set)
+	*rules = NULL;
+
+	for (e = first_rule(h, chain); e != NULL; e = next_rule(h, e), n++)
 	{
-		if (dest->range)
+		if (!(n % 32))
 		{
-			fw3_ipt_rule_addarg(r, dest->invert, "--dst-range",
-			                    fw3_address_to_string(dest, false, false));
+			if (!(tmp = realloc(*rules, (n + 32) * sizeof(*tmp))))
+				error("Out of memory while reading chain %s", chain);
+
+			*rules = tmp;
 		}
-#ifndef DISABLE_IPV6
-		else if (r->h->family == FW3_FAMILY_V6)
-		{
-			r->e6.ipv6.dst = dest->address.v6;
-			r->e6.ipv6.dmsk = dest->mask.v6;
 
-			int i;
-			for (i = 0; i < 4; i++)
-				r->e6.ipv6.dst.s6_addr32[i] &= r->e6.ipv6.dmsk.s6_addr32[i];
+		r = &(*rules)[n];
+		r->entry = e;
+		r->known = true;
 
-			if (dest->invert)
-				r->e6.ipv6.invflags |= IP6T_INV_DSTIP;
+#ifndef DISABLE_IPV6
+		if (h->family == FW3_FAMILY_V6)
+		{
+			r->target = ip6tc_get_target(e, h->handle);
+			r->start = sizeof(struct ip6t_entry);
+			r->end = ((const struct ip6t_entry *)e)->target_offset;
 		}
-#endif
 		else
+#endif
 		{
-			r->e.ip.dst = dest->address.v4;
-			r->e.ip.dmsk = dest->mask.v4;
+			r->target = iptc_get_target(e, h->handle);
+			r->start = sizeof(struct ipt_entry);
+			r->end = ((const struct ipt_entry *)e)->target_offset;
+		}
 
-			r->e.ip.dst.s_addr &= r->e.ip.dmsk.s_addr;
+		for (i = r->start; r->known && i < r->end; i += m->u.match_size)
+		{
+			m = e + i;
 
-			if (dest->invert)
-				r->e.ip.invflags |= IPT_INV_DSTIP;
+			if (!opt_listed(opt_matches, m->u.user.name))
+				r->known = false;
 		}
 	}
+
+	return n;
 }
 
-void
-fw3_ipt_rule_sport_dport(struct fw3_ipt_rule *r,
-                         struct fw3_port *sp, struct fw3_port *dp)
+/* Rules between a shadowing rule and the one it shadows must not alter
+ * anything later matches could look at, such as marks or conntrack state.
+ * Jumps are only trusted in the filter table and only into chains built by
+ * fw3 itself. */
+static bool
+opt_barrier(struct fw3_ipt_handle *h, struct fw3_ipt_opt_rule *r)
 {
-	char buf[sizeof("65535:65535")];
+	if (opt_listed(opt_targets, r->target) ||
+	    opt_listed(opt_passive, r->target))
+		return false;
 
-	if ((!sp || !sp->set) && (!dp || !dp->set))
-		return;
+	return (h->table != FW3_TABLE_FILTER || !avl_find(h->created, r->target));
+}
 
-	if (!get_protoname(r))
-		return;
+static unsigned int
+optimize_chain(struct fw3_ipt_handle *h, const char *chain)
+{
+	bool dup;
+	unsigned int i, j, n, k = 0, first = 0, *nums = NULL;
+	struct fw3_ipt_opt_rule *rules;
 
-	if (sp && sp->set)
-	{
-		if (sp->port_min == sp->port_max)
-			snprintf(buf, sizeof(buf), "%u", sp->port_min);
-		else
-			snprintf(buf, sizeof(buf), "%u:%u", sp->port_min, sp->port_max);
+	n = opt_read_chain(h, chain, &rules);
 
-		fw3_ipt_rule_addarg(r, sp->invert, "--sport", buf);
-	}
+	if ((size_t)n * n > (1 << 22))
+		n = 0;
 
-	if (dp && dp->set)
+	for (j = 0; j < n; j++)
 	{
-		if (dp->port_min == dp->port_max)
-			snprintf(buf, sizeof(buf), "%u", dp->port_min);
-		else
-			snprintf(buf, sizeof(buf), "%u:%u", dp->port_min, dp->port_max);
+		for (i = first; rules[j].known && i < j; i++)
+		{
+			if (!rules[i].entry || !rules[i].known ||
+			    !opt_listed(opt_targets, rules[i].target) ||
+			    !opt_covers(h, &rules[i], &rules[j]))
+				continue;
 
-		fw3_ipt_rule_addarg(r, dp->invert, "--dport", buf);
-	}
-}
+			dup = (!strcmp(rules[i].target, rules[j].target) &&
+			       opt_covers(h, &rules[j], &rules[i]));
 
-void
-fw3_ipt_rule_device(struct fw3_ipt_rule *r, const char *device, bool out)
-{
-	struct fw3_device dev = { .any = false };
+			info("     - Removing rule %u (%s) of chain %s, %s rule %u (%s)",
+			     j + 1, opt_comment(&rules[j]), chain,
+			     dup ? "duplicate of" : "shadowed by",
+			     i + 1, opt_comment(&rules[i]));
 
-	if (device) {
-		snprintf(dev.name, sizeof(dev.name), "%s", device);
-		fw3_ipt_rule_in_out(r, (out) ? NULL : &dev, (out) ? &dev : NULL);
+			push_num(&nums, &k, j);
+			rules[j].entry = NULL;
+			break;
+		}
+
+		if (rules[j].entry && opt_barrier(h, &rules[j]))
+			first = j + 1;
 	}
+
+	if (k)
+		delete_nums(h, chain, nums, k, true);
+
+	free(nums);
+	free(rules);
+
+	return k;
 }
 
 void
-fw3_ipt_rule_mac(struct fw3_ipt_rule *r, struct fw3_mac *mac)
+fw3_ipt_optimize(struct fw3_ipt_handle *h)
 {
-	char buf[sizeof("ff:ff:ff:ff:ff:ff")];
-	uint8_t *addr = mac->mac.ether_addr_octet;
+	unsigned int n = 0;
+	struct fw3_ipt_name *c;
 
-	if (!mac)
+	if (!h->created)
 		return;
 
-	snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x",
-	         addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+	avl_for_each_element(h->created, c, node)
+		if (is_chain(h, c->name))
+			n += optimize_chain(h, c->name);
 
-	fw3_ipt_rule_addarg(r, false, "-m", "mac");
-	fw3_ipt_rule_addarg(r, mac->invert, "--mac-source", buf);
+	if (n)
+		info("   * Removed %u redundant rules", n);
 }
 
 void
-fw3_ipt_rule_icmptype(struct fw3_ipt_rule *r, struct fw3_icmptype *icmp)
+fw3_ipt_commit(struct fw3_ipt_handle *h)
 {
-	char buf[sizeof("255/255")];
+	int rv;
 
-	if (!icmp)
-		return;
+	if (h->snapshot)
+	{
+		snapshot_diff(h);
+		snapshot_free(h);
+	}
 
 #ifndef DISABLE_IPV6
-	if (r->h->family == FW3_FAMILY_V6)
+	if (h->family == FW3_FAMILY_V6)
 	{
-		if (icmp->code6_min == 0 && icmp->code6_max == 0xFF)
-			snprintf(buf, sizeof(buf), "%u", icmp->type6);
-		else
-			snprintf(buf, sizeof(buf), "%u/%u", icmp->type6, icmp->code6_min);
-
-		fw3_ipt_rule_addarg(r, icmp->invert, "--icmpv6-type", buf);
+		rv = ip6tc_commit(h->handle);
+		if (!rv)
+			warn("ip6tc_commit(): %s", ip6tc_strerror(errno));
 	}
 	else
 #endif
 	{
-		if (icmp->code_min == 0 && icmp->code_max == 0xFF)
-			snprintf(buf, sizeof(buf), "%u", icmp->type);
-		else
-			snprintf(buf, sizeof(buf), "%u/%u", icmp->type, icmp->code_min);
-
-		fw3_ipt_rule_addarg(r, icmp->invert, "--icmp-type", buf);
+		rv = iptc_commit(h->handle);
+		if (!rv)
+			warn("iptc_commit(): %s", iptc_strerror(errno));
 	}
 }
 
 void
-fw3_ipt_rule_limit(struct fw3_ipt_rule *r, struct fw3_limit *limit)
+fw3_ipt_close(struct fw3_ipt_handle *h)
 {
-	char buf[sizeof("-4294967296/second")];
+	if (fw3_pr_debug && (xt_cache_stats.hits || xt_cache_stats.misses))
+		info(" * Fragment cache: %u hits, %u misses",
+		     xt_cache_stats.hits, xt_cache_stats.misses);
 
-	if (!limit || limit->rate <= 0)
-		return;
+	xt_cache_stats.hits = xt_cache_stats.misses = 0;
 
-	fw3_ipt_rule_addarg(r, false, "-m", "limit");
+	if (fw3_pr_debug && xt_setup.runs)
+		info(" * Extension setup: %lu.%03lu ms",
+		     xt_setup.usec / 1000, xt_setup.usec % 1000);
 
-	snprintf(buf, sizeof(buf), "%u/%s", limit->rate, fw3_limit_units[limit->unit]);
-	fw3_ipt_rule_addarg(r, limit->invert, "--limit", buf);
+	xt_setup.runs = 0;
+	xt_setup.usec = 0;
 
-	if (limit->burst > 0)
-	{
-		snprintf(buf, sizeof(buf), "%u", limit->burst);
-		fw3_ipt_rule_addarg(r, limit->invert, "--limit-burst", buf);
-	}
+	index_free(h);
+	snapshot_free(h);
+	free_names(&h->kept);
+	free_names(&h->created);
+
+	fw3_ipt_unlock();
+	free(h);
 }
 
-void
-fw3_ipt_rule_ipset(struct fw3_ipt_rule *r, struct fw3_setmatch *match)
+struct fw3_ipt_rule *
+fw3_ipt_rule_new(struct fw3_ipt_handle *h)
 {
-	char buf[sizeof("dst,dst,dst")];
-	char *p = buf;
-	int i = 0, len;
-	size_t rem = sizeof(buf);
+	struct fw3_ipt_rule *r;
 
-	struct fw3_ipset *set;
-	struct fw3_ipset_datatype *type;
+	r = fw3_alloc(sizeof(*r));
 
-	if (!match || !match->set || !match->ptr)
-		return;
+	r->h = h;
+	r->argv = fw3_alloc(sizeof(char *));
+	r->argv[r->argc++] = "fw3";
 
-	set = match->ptr;
-	list_for_each_entry(type, &set->datatypes, list)
-	{
-		if (i >= 3)
-			break;
+	return r;
+}
 
-		if (p > buf) {
-			if (rem <= 1)
-				break;
 
-			*p++ = ',';
-			*p = 0;
-			rem--;
-		}
+static char *
+get_protoname(struct fw3_ipt_rule *r)
+{
+	const struct xtables_pprot *pp;
 
-		len = snprintf(p, rem, "%s", match->dir[i] ? match->dir[i] : type->dir);
+	if (r->protocol)
+		for (pp = xtables_chain_protos; pp->name; pp++)
+			if (pp->num == r->protocol)
+				return (char *)pp->name;
 
-		if (len < 0 || len >= rem)
-			break;
+	return NULL;
+}
 
-		rem -= len;
-		p += len;
+static struct xtables_match *
+find_match(struct fw3_ipt_rule *r, const char *name)
+{
+	struct xtables_match *m;
 
-		i++;
-	}
+	int *tmp;
 
-	fw3_ipt_rule_addarg(r, false, "-m", "set");
+	xext.retain = true;
+	m = xtables_find_match(name, XTF_TRY_LOAD, &r->matches);
+	xext.retain = false;
 
-	fw3_ipt_rule_addarg(r, match->invert, "--match-set",
-	                    set->external ? set->external : set->name);
+	if (m)
+	{
+		tmp = realloc(r->match_pos, (r->nmatch_pos + 1) * sizeof(*tmp));
+
+		if (!tmp)
+			error("Out of memory while loading match %s", name);
+
+		r->match_pos = tmp;
+		r->match_pos[r->nmatch_pos++] = optind - 1;
+	}
+
+	return m;
+}
+
+static void
+init_match(struct fw3_ipt_rule *r, struct xtables_match *m, bool no_clone)
+{
+	size_t s;
+	struct xtables_globals *g;
+
+	if (!m)
+		return;
+
+	s = XT_ALIGN(sizeof(struct xt_entry_match)) + m->size;
+
+	m->m = fw3_alloc(s);
+
+	fw3_xt_set_match_name(m);
+
+	m->m->u.user.revision = m->revision;
+	m->m->u.match_size = s;
+
+	/* free previous userspace data */
+	fw3_xt_free_match_udata(m);
+
+	if (m->init)
+		m->init(m->m);
+
+	/* don't merge options if no_clone is set and this match is a clone */
+	if (no_clone && (m == m->next))
+		return;
+
+	/* merge option table */
+	g = (r->h->family == FW3_FAMILY_V6) ? &xtg6 : &xtg;
+	fw3_xt_merge_match_options(g, m);
+}
+
+static bool
+need_protomatch(struct fw3_ipt_rule *r, const char *pname)
+{
+	if (!pname)
+		return false;
+
+	if (!xtables_find_match(pname, XTF_DONT_LOAD, NULL))
+		return true;
+
+	return !r->protocol_loaded;
+}
+
+static struct xtables_match *
+load_protomatch(struct fw3_ipt_rule *r)
+{
+	const char *pname = get_protoname(r);
+
+	if (!need_protomatch(r, pname))
+		return NULL;
+
+	return find_match(r, pname);
+}
+
+static struct xtables_target *
+find_target(struct fw3_ipt_rule *r, const char *name)
+{
+	struct xtables_target *t;
+
+	xext.retain = true;
+
+	if (is_chain(r->h, name))
+		t = xtables_find_target(XT_STANDARD_TARGET, XTF_TRY_LOAD);
+	else
+		t = xtables_find_target(name, XTF_TRY_LOAD);
+
+	xext.retain = false;
+
+	return t;
+}
+
+static struct xtables_target *
+get_target(struct fw3_ipt_rule *r, const char *name)
+{
+	size_t s;
+	struct xtables_target *t;
+	struct xtables_globals *g;
+
+	t = find_target(r, name);
+
+	if (!t)
+		return NULL;
+
+	s = XT_ALIGN(sizeof(struct xt_entry_target)) + t->size;
+	t->t = fw3_alloc(s);
+
+	fw3_xt_set_target_name(t, name);
+
+	t->t->u.user.revision = t->revision;
+	t->t->u.target_size = s;
+
+	/* free previous userspace data */
+	fw3_xt_free_target_udata(t);
+
+	if (t->init)
+		t->init(t->t);
+
+	/* merge option table */
+	g = (r->h->family == FW3_FAMILY_V6) ? &xtg6 : &xtg;
+	fw3_xt_merge_target_options(g, t);
+
+	r->target = t;
+
+	return t;
+}
+
+/* Matches are evaluated in the order they were added to the rule,
+ * compiled ones carry the argv position they were added at so that they
+ * can be merged with the parsed ones. */
+static void
+xt_insert(struct fw3_ipt_rule *r, struct fw3_ipt_xt *x, int pos)
+{
+	struct fw3_ipt_xt **tail;
+
+	x->pos = pos;
+
+	for (tail = &r->xt_matches; *tail && (*tail)->pos <= pos;
+	     tail = &(*tail)->next);
+
+	x->next = *tail;
+	*tail = x;
+}
+
+static void *
+xt_add_match(struct fw3_ipt_rule *r, const char *name, uint8_t revision,
+             size_t size, size_t userspacesize)
+{
+	size_t s;
+	struct fw3_ipt_xt *x;
+
+	s = XT_ALIGN(sizeof(struct xt_entry_match)) + XT_ALIGN(size);
+
+	x = fw3_alloc(sizeof(*x));
+	x->m = fw3_alloc(s);
+	x->userspacesize = userspacesize;
+
+	snprintf(x->m->u.user.name, sizeof(x->m->u.user.name), "%s", name);
+
+	x->m->u.user.revision = revision;
+	x->m->u.match_size = s;
+
+	xt_insert(r, x, r->argc);
+
+	return x->m->data;
+}
+
+static void *
+xt_set_target(struct fw3_ipt_rule *r, const char *name, uint8_t revision,
+              size_t size, size_t userspacesize)
+{
+	size_t s;
+	struct fw3_ipt_xt *x;
+
+	s = XT_ALIGN(sizeof(struct xt_entry_target)) + XT_ALIGN(size);
+
+	if (r->xt_target)
+	{
+		free(r->xt_target->t);
+		free(r->xt_target);
+	}
+
+	x = fw3_alloc(sizeof(*x));
+	x->t = fw3_alloc(s);
+	x->userspacesize = userspacesize;
+
+	snprintf(x->t->u.user.name, sizeof(x->t->u.user.name), "%s", name);
+
+	x->t->u.user.revision = revision;
+	x->t->u.target_size = s;
+
+	r->xt_target = x;
+
+	return x->t->data;
+}
+
+static void
+xt_free(struct fw3_ipt_rule *r)
+{
+	struct fw3_ipt_xt *x, *next;
+
+	for (x = r->xt_matches; x; x = next)
+	{
+		next = x->next;
+		free(x->m);
+		free(x);
+	}
+
+	if (r->xt_target)
+	{
+		free(r->xt_target->t);
+		free(r->xt_target);
+	}
+}
+
+static struct xt_entry_target *
+rule_target(struct fw3_ipt_rule *r, size_t *userspacesize)
+{
+	if (r->target)
+	{
+		*userspacesize = r->target->userspacesize;
+		return r->target->t;
+	}
+
+	if (r->xt_target)
+	{
+		*userspacesize = r->xt_target->userspacesize;
+		return r->xt_target->t;
+	}
+
+	*userspacesize = 0;
+	return NULL;
+}
+
+/* protocols which carry ports the kernel nat and port matches understand */
+static bool
+has_port_proto(struct fw3_ipt_rule *r)
+{
+#ifndef DISABLE_IPV6
+	if (r->h->family == FW3_FAMILY_V6 &&
+	    (r->e6.ipv6.invflags & XT_INV_PROTO))
+		return false;
+#endif
+
+	if (r->h->family == FW3_FAMILY_V4 &&
+	    (r->e.ip.invflags & XT_INV_PROTO))
+		return false;
+
+	switch (r->protocol)
+	{
+	case 6:
+	case 17:
+	case 33:
+	case 132:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+void
+fw3_ipt_rule_proto(struct fw3_ipt_rule *r, struct fw3_protocol *proto)
+{
+	uint32_t pr;
+
+	if (!proto || proto->any)
+		return;
+
+	pr = proto->protocol;
+
+#ifndef DISABLE_IPV6
+	if (r->h->family == FW3_FAMILY_V6)
+	{
+		if (pr == 1)
+			pr = 58;
+
+		r->e6.ipv6.proto = pr;
+		r->e6.ipv6.flags |= IP6T_F_PROTO;
+
+		if (proto->invert)
+			r->e6.ipv6.invflags |= XT_INV_PROTO;
+	}
+	else
+#endif
+	{
+		r->e.ip.proto = pr;
+
+		if (proto->invert)
+			r->e.ip.invflags |= XT_INV_PROTO;
+	}
+
+	r->protocol = pr;
+}
+
+void
+fw3_ipt_rule_in_out(struct fw3_ipt_rule *r,
+                    struct fw3_device *in, struct fw3_device *out)
+{
+#ifndef DISABLE_IPV6
+	if (r->h->family == FW3_FAMILY_V6)
+	{
+		if (in && !in->any)
+		{
+			xtables_parse_interface(in->name, r->e6.ipv6.iniface,
+			                                  r->e6.ipv6.iniface_mask);
+
+			if (in->invert)
+				r->e6.ipv6.invflags |= IP6T_INV_VIA_IN;
+		}
+
+		if (out && !out->any)
+		{
+			xtables_parse_interface(out->name, r->e6.ipv6.outiface,
+			                                   r->e6.ipv6.outiface_mask);
+
+			if (out->invert)
+				r->e6.ipv6.invflags |= IP6T_INV_VIA_OUT;
+		}
+	}
+	else
+#endif
+	{
+		if (in && !in->any)
+		{
+			xtables_parse_interface(in->name, r->e.ip.iniface,
+			                                  r->e.ip.iniface_mask);
+
+			if (in->invert)
+				r->e.ip.invflags |= IPT_INV_VIA_IN;
+		}
+
+		if (out && !out->any)
+		{
+			xtables_parse_interface(out->name, r->e.ip.outiface,
+			                                   r->e.ip.outiface_mask);
+
+			if (out->invert)
+				r->e.ip.invflags |= IPT_INV_VIA_OUT;
+		}
+	}
+}
+
+
+void
+fw3_ipt_rule_src_dest(struct fw3_ipt_rule *r,
+                      struct fw3_address *src, struct fw3_address *dest)
+{
+	if ((src && src->range) || (dest && dest->range))
+	{
+		fw3_ipt_rule_addarg(r, false, "-m", "iprange");
+	}
+
+	if (src && src->set)
+	{
+		if (src->range)
+		{
+			fw3_ipt_rule_addarg(r, src->invert, "--src-range",
+			                    fw3_address_to_string(src, false, false));
+		}
+#ifndef DISABLE_IPV6
+		else if (r->h->family == FW3_FAMILY_V6)
+		{
+			r->e6.ipv6.src = src->address.v6;
+			r->e6.ipv6.smsk = src->mask.v6;
+
+			int i;
+			for (i = 0; i < 4; i++)
+				r->e6.ipv6.src.s6_addr32[i] &= r->e6.ipv6.smsk.s6_addr32[i];
+
+			if (src->invert)
+				r->e6.ipv6.invflags |= IP6T_INV_SRCIP;
+		}
+#endif
+		else
+		{
+			r->e.ip.src = src->address.v4;
+			r->e.ip.smsk = src->mask.v4;
+
+			r->e.ip.src.s_addr &= r->e.ip.smsk.s_addr;
+
+			if (src->invert)
+				r->e.ip.invflags |= IPT_INV_SRCIP;
+		}
+	}
+
+	if (dest && dest->set)
+	{
+		if (dest->range)
+		{
+			fw3_ipt_rule_addarg(r, dest->invert, "--dst-range",
+			                    fw3_address_to_string(dest, false, false));
+		}
+#ifndef DISABLE_IPV6
+		else if (r->h->family == FW3_FAMILY_V6)
+		{
+			r->e6.ipv6.dst = dest->address.v6;
+			r->e6.ipv6.dmsk = dest->mask.v6;
+
+			int i;
+			for (i = 0; i < 4; i++)
+				r->e6.ipv6.dst.s6_addr32[i] &= r->e6.ipv6.dmsk.s6_addr32[i];
+
+			if (dest->invert)
+				r->e6.ipv6.invflags |= IP6T_INV_DSTIP;
+		}
+#endif
+		else
+		{
+			r->e.ip.dst = dest->address.v4;
+			r->e.ip.dmsk = dest->mask.v4;
+
+			r->e.ip.dst.s_addr &= r->e.ip.dmsk.s_addr;
+
+			if (dest->invert)
+				r->e.ip.invflags |= IPT_INV_DSTIP;
+		}
+	}
+}
+
+void
+fw3_ipt_rule_sport_dport(struct fw3_ipt_rule *r,
+                         struct fw3_port *sp, struct fw3_port *dp)
+{
+	char buf[sizeof("65535:65535")];
+	struct xt_tcp *tcp;
+	struct xt_udp *udp;
+
+	if ((!sp || !sp->set) && (!dp || !dp->set))
+		return;
+
+	if (!get_protoname(r))
+		return;
+
+	if (r->protocol == 6 && has_port_proto(r))
+	{
+		tcp = xt_add_match(r, "tcp", 0, sizeof(*tcp), sizeof(*tcp));
+		tcp->spts[1] = tcp->dpts[1] = 0xFFFF;
+
+		if (sp && sp->set)
+		{
+			tcp->spts[0] = sp->port_min;
+			tcp->spts[1] = sp->port_max;
+
+			if (sp->invert)
+				tcp->invflags |= XT_TCP_INV_SRCPT;
+		}
+
+		if (dp && dp->set)
+		{
+			tcp->dpts[0] = dp->port_min;
+			tcp->dpts[1] = dp->port_max;
+
+			if (dp->invert)
+				tcp->invflags |= XT_TCP_INV_DSTPT;
+		}
+
+		return;
+	}
+	else if (r->protocol == 17 && has_port_proto(r))
+	{
+		udp = xt_add_match(r, "udp", 0, sizeof(*udp), sizeof(*udp));
+		udp->spts[1] = udp->dpts[1] = 0xFFFF;
+
+		if (sp && sp->set)
+		{
+			udp->spts[0] = sp->port_min;
+			udp->spts[1] = sp->port_max;
+
+			if (sp->invert)
+				udp->invflags |= XT_UDP_INV_SRCPT;
+		}
+
+		if (dp && dp->set)
+		{
+			udp->dpts[0] = dp->port_min;
+			udp->dpts[1] = dp->port_max;
+
+			if (dp->invert)
+				udp->invflags |= XT_UDP_INV_DSTPT;
+		}
+
+		return;
+	}
+
+	if (sp && sp->set)
+	{
+		if (sp->port_min == sp->port_max)
+			snprintf(buf, sizeof(buf), "%u", sp->port_min);
+		else
+			snprintf(buf, sizeof(buf), "%u:%u", sp->port_min, sp->port_max);
+
+		fw3_ipt_rule_addarg(r, sp->invert, "--sport", buf);
+	}
+
+	if (dp && dp->set)
+	{
+		if (dp->port_min == dp->port_max)
+			snprintf(buf, sizeof(buf), "%u", dp->port_min);
+		else
+			snprintf(buf, sizeof(buf), "%u:%u", dp->port_min, dp->port_max);
+
+		fw3_ipt_rule_addarg(r, dp->invert, "--dport", buf);
+	}
+}
+
+void
+fw3_ipt_rule_device(struct fw3_ipt_rule *r, const char *device, bool out)
+{
+	struct fw3_device dev = { .any = false };
+
+	if (device) {
+		snprintf(dev.name, sizeof(dev.name), "%s", device);
+		fw3_ipt_rule_in_out(r, (out) ? NULL : &dev, (out) ? &dev : NULL);
+	}
+}
+
+void
+fw3_ipt_rule_mac(struct fw3_ipt_rule *r, struct fw3_mac *mac)
+{
+	char buf[sizeof("ff:ff:ff:ff:ff:ff")];
+	uint8_t *addr = mac->mac.ether_addr_octet;
+
+	if (!mac)
+		return;
+
+	snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x",
+	         addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+
+	fw3_ipt_rule_addarg(r, false, "-m", "mac");
+	fw3_ipt_rule_addarg(r, mac->invert, "--mac-source", buf);
+}
+
+void
+fw3_ipt_rule_icmptype(struct fw3_ipt_rule *r, struct fw3_icmptype *icmp)
+{
+	char buf[sizeof("255/255")];
+
+	if (!icmp)
+		return;
+
+#ifndef DISABLE_IPV6
+	if (r->h->family == FW3_FAMILY_V6)
+	{
+		if (icmp->code6_min == 0 && icmp->code6_max == 0xFF)
+			snprintf(buf, sizeof(buf), "%u", icmp->type6);
+		else
+			snprintf(buf, sizeof(buf), "%u/%u", icmp->type6, icmp->code6_min);
+
+		fw3_ipt_rule_addarg(r, icmp->invert, "--icmpv6-type", buf);
+	}
+	else
+#endif
+	{
+		if (icmp->code_min == 0 && icmp->code_max == 0xFF)
+			snprintf(buf, sizeof(buf), "%u", icmp->type);
+		else
+			snprintf(buf, sizeof(buf), "%u/%u", icmp->type, icmp->code_min);
+
+		fw3_ipt_rule_addarg(r, icmp->invert, "--icmp-type", buf);
+	}
+}
+
+void
+fw3_ipt_rule_limit(struct fw3_ipt_rule *r, struct fw3_limit *limit)
+{
+	char buf[sizeof("-4294967296/second")];
+	struct xt_rateinfo *ri;
+	static const uint32_t unit_secs[__FW3_LIMIT_UNIT_MAX] = {
+		[FW3_LIMIT_UNIT_SECOND] = 1,
+		[FW3_LIMIT_UNIT_MINUTE] = 60,
+		[FW3_LIMIT_UNIT_HOUR]   = 60 * 60,
+		[FW3_LIMIT_UNIT_DAY]    = 24 * 60 * 60,
+	};
+
+	if (!limit || limit->rate <= 0)
+		return;
+
+	/* inverted limits are rejected by the limit match, let it complain */
+	if (!limit->invert &&
+	    XT_LIMIT_SCALE * unit_secs[limit->unit] / limit->rate > 0)
+	{
+		ri = xt_add_match(r, "limit", 0, sizeof(*ri),
+		                  offsetof(struct xt_rateinfo, prev));
+
+		ri->avg = XT_LIMIT_SCALE * unit_secs[limit->unit] / limit->rate;
+		ri->burst = (limit->burst > 0) ? limit->burst : 5;
+		return;
+	}
+
+	fw3_ipt_rule_addarg(r, false, "-m", "limit");
+
+	snprintf(buf, sizeof(buf), "%u/%s", limit->rate, fw3_limit_units[limit->unit]);
+	fw3_ipt_rule_addarg(r, limit->invert, "--limit", buf);
+
+	if (limit->burst > 0)
+	{
+		snprintf(buf, sizeof(buf), "%u", limit->burst);
+		fw3_ipt_rule_addarg(r, limit->invert, "--limit-burst", buf);
+	}
+}
+
+static bool
+get_set_index(const char *name, ip_set_id_t *index)
+{
+	int fd;
+	bool rv = false;
+	socklen_t len;
+	struct ip_set_req_version rv_req = { .op = IP_SET_OP_VERSION };
+	struct ip_set_req_get_set gs_req = { .op = IP_SET_OP_GET_BYNAME };
+
+	fd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+
+	if (fd < 0)
+		return false;
+
+	len = sizeof(rv_req);
+
+	if (getsockopt(fd, SOL_IP, SO_IP_SET, &rv_req, &len))
+		goto out;
+
+	gs_req.version = rv_req.version;
+	snprintf(gs_req.set.name, sizeof(gs_req.set.name), "%s", name);
+
+	len = sizeof(gs_req);
+
+	if (!getsockopt(fd, SOL_IP, SO_IP_SET, &gs_req, &len) &&
+	    gs_req.set.index != IPSET_INVALID_ID)
+	{
+		*index = gs_req.set.index;
+		rv = true;
+	}
+
+out:
+	close(fd);
+	return rv;
+}
+
+void
+fw3_ipt_rule_ipset(struct fw3_ipt_rule *r, struct fw3_setmatch *match)
+{
+	char buf[sizeof("dst,dst,dst")];
+	char *p = buf;
+	int i = 0, len;
+	size_t rem = sizeof(buf);
+
+	struct fw3_ipset *set;
+	struct fw3_ipset_datatype *type;
+	struct xt_set_info_match_v1 *info;
+	const char *name, *dir;
+	ip_set_id_t index;
+
+	if (!match || !match->set || !match->ptr)
+		return;
+
+	set = match->ptr;
+	name = set->external ? set->external : set->name;
+
+	if (get_set_index(name, &index))
+	{
+		info = xt_add_match(r, "set", 1, sizeof(*info), sizeof(*info));
+		info->match_set.index = index;
+
+		list_for_each_entry(type, &set->datatypes, list)
+		{
+			if (i >= 3)
+				break;
+
+			dir = match->dir[i] ? match->dir[i] : type->dir;
+
+			if (!strncmp(dir, "src", 3))
+				info->match_set.flags |= (1 << (i + 1));
+
+			info->match_set.dim = ++i;
+		}
+
+		if (match->invert)
+			info->match_set.flags |= IPSET_INV_MATCH;
+
+		return;
+	}
+
+	list_for_each_entry(type, &set->datatypes, list)
+	{
+		if (i >= 3)
+			break;
+
+		if (p > buf) {
+			if (rem <= 1)
+				break;
+
+			*p++ = ',';
+			*p = 0;
+			rem--;
+		}
+
+		len = snprintf(p, rem, "%s", match->dir[i] ? match->dir[i] : type->dir);
+
+		if (len < 0 || len >= rem)
+			break;
+
+		rem -= len;
+		p += len;
+
+		i++;
+	}
+
+	fw3_ipt_rule_addarg(r, false, "-m", "set");
+
+	fw3_ipt_rule_addarg(r, match->invert, "--match-set", name);
+
+	fw3_ipt_rule_addarg(r, false, buf, NULL);
+}
+
+void
+fw3_ipt_rule_helper(struct fw3_ipt_rule *r, struct fw3_cthelpermatch *match)
+{
+	if (!match || !match->set || !match->ptr)
+		return;
+
+	fw3_ipt_rule_addarg(r, false, "-m", "helper");
+	fw3_ipt_rule_addarg(r, match->invert, "--helper", match->ptr->name);
+}
+
+void
+fw3_ipt_rule_time(struct fw3_ipt_rule *r, struct fw3_time *time)
+{
+	int i, len;
+	struct tm empty = { 0 };
+
+	char buf[84]; /* sizeof("1,2,3,...,30,31") */
+	char *p;
+
+	bool d1 = memcmp(&time->datestart, &empty, sizeof(empty));
+	bool d2 = memcmp(&time->datestop, &empty, sizeof(empty));
+
+	size_t rem;
+
+	if (!d1 && !d2 && !time->timestart && !time->timestop &&
+	    !(time->monthdays & 0xFFFFFFFE) && !(time->weekdays & 0xFE))
+	{
+		return;
+	}
+
+	fw3_ipt_rule_addarg(r, false, "-m", "time");
+
+	if (!time->utc)
+		fw3_ipt_rule_addarg(r, false, "--kerneltz", NULL);
+
+	if (d1)
+	{
+		strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &time->datestart);
+		fw3_ipt_rule_addarg(r, false, "--datestart", buf);
+	}
+
+	if (d2)
+	{
+		strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &time->datestop);
+		fw3_ipt_rule_addarg(r, false, "--datestop", buf);
+	}
+
+	if (time->timestart)
+	{
+		snprintf(buf, sizeof(buf), "%02d:%02d:%02d",
+		        time->timestart / 3600,
+		        time->timestart % 3600 / 60,
+		        time->timestart % 60);
+
+		fw3_ipt_rule_addarg(r, false, "--timestart", buf);
+	}
+
+	if (time->timestop)
+	{
+		snprintf(buf, sizeof(buf), "%02d:%02d:%02d",
+		        time->timestop / 3600,
+		        time->timestop % 3600 / 60,
+		        time->timestop % 60);
+
+		fw3_ipt_rule_addarg(r, false, "--timestop", buf);
+	}
+
+	if (time->monthdays & 0xFFFFFFFE)
+	{
+		for (i = 1, p = buf, rem = sizeof(buf); i < 32; i++)
+		{
+			if (fw3_hasbit(time->monthdays, i))
+			{
+				if (p > buf) {
+					if (rem <= 1)
+						break;
+
+					*p++ = ',';
+					*p = 0;
+					rem--;
+				}
+
+				len = snprintf(p, rem, "%u", i);
+
+				if (len < 0 || len >= rem)
+					break;
+
+				rem -= len;
+				p += len;
+			}
+		}
+
+		fw3_ipt_rule_addarg(r, fw3_hasbit(time->monthdays, 0), "--monthdays", buf);
+	}
+
+	if (time->weekdays & 0xFE)
+	{
+		for (i = 1, p = buf, rem = sizeof(buf); i < 8; i++)
+		{
+			if (fw3_hasbit(time->weekdays, i))
+			{
+				if (p > buf) {
+					if (rem <= 1)
+						break;
+
+					*p++ = ',';
+					*p = 0;
+					rem--;
+				}
+
+				len = snprintf(p, rem, "%u", i);
+
+				if (len < 0 || len >= rem)
+					break;
+
+				rem -= len;
+				p += len;
+			}
+		}
+
+		fw3_ipt_rule_addarg(r, fw3_hasbit(time->weekdays, 0), "--weekdays", buf);
+	}
+}
+
+void
+fw3_ipt_rule_mark(struct fw3_ipt_rule *r, struct fw3_mark *mark)
+{
+	struct xt_mark_mtinfo1 *info;
+
+	if (!mark || !mark->set)
+		return;
+
+	info = xt_add_match(r, "mark", 1, sizeof(*info), sizeof(*info));
+	info->mark = mark->mark;
+	info->mask = mark->mask;
+	info->invert = mark->invert;
+}
+
+void
+fw3_ipt_rule_dscp(struct fw3_ipt_rule *r, struct fw3_dscp *dscp)
+{
+	char buf[sizeof("0xFF")];
+
+	if (!dscp || !dscp->set)
+		return;
+
+	snprintf(buf, sizeof(buf), "0x%x", dscp->dscp);
+
+	fw3_ipt_rule_addarg(r, false, "-m", "dscp");
+	fw3_ipt_rule_addarg(r, dscp->invert, "--dscp", buf);
+}
+
+void
+fw3_ipt_rule_comment(struct fw3_ipt_rule *r, const char *fmt, ...)
+{
+	va_list ap;
+	struct xt_comment_info *info;
+
+	if (!fmt || !*fmt)
+		return;
+
+	info = xt_add_match(r, "comment", 0, sizeof(*info), sizeof(*info));
+
+	va_start(ap, fmt);
+	vsnprintf(info->comment, sizeof(info->comment), fmt, ap);
+	va_end(ap);
+
+	if (!r->comment)
+		r->comment = info;
+}
+
+static void
+multiport_add(struct fw3_ipt_rule *r, struct list_head *ports, uint8_t flags)
+{
+	int n = 0;
+	struct fw3_port *p;
+	struct xt_multiport_v1 *info;
+
+	if (!ports || list_empty(ports))
+		return;
+
+	info = xt_add_match(r, "multiport", 1, sizeof(*info), sizeof(*info));
+	info->flags = flags;
+
+	list_for_each_entry(p, ports, list)
+	{
+		if (n + (p->port_min != p->port_max) >= XT_MULTI_PORTS)
+		{
+			warn("fw3_ipt_rule_multiport(): too many ports, truncating list");
+			break;
+		}
+
+		info->invert |= p->invert;
+		info->ports[n++] = p->port_min;
+
+		if (p->port_min != p->port_max)
+		{
+			info->pflags[n - 1] = 1;
+			info->ports[n++] = p->port_max;
+		}
+	}
+
+	info->count = n;
+}
+
+void
+fw3_ipt_rule_multiport(struct fw3_ipt_rule *r,
+                       struct list_head *sports, struct list_head *dports)
+{
+	if (!has_port_proto(r))
+		return;
+
+	multiport_add(r, sports, XT_MULTIPORT_SOURCE);
+	multiport_add(r, dports, XT_MULTIPORT_DESTINATION);
+}
+
+/* Non-inverted port lists are packed into groups filling at most one
+ * multiport match, other lists yield one group per port. */
+struct list_head *
+fw3_ipt_port_groups(struct list_head *ports)
+{
+	int n = 0, slots;
+	bool fold = true;
+	struct list_head *groups;
+	struct fw3_port *p, *tmp;
+	struct fw3_port_group *g = NULL;
+
+	groups = fw3_alloc(sizeof(*groups));
+	INIT_LIST_HEAD(groups);
+
+	list_for_each_entry(p, ports, list)
+		if (p->invert)
+			fold = false;
+
+	list_for_each_entry(p, ports, list)
+	{
+		slots = 1 + (p->port_min != p->port_max);
+
+		if (!g || !fold || n + slots > XT_MULTI_PORTS)
+		{
+			g = fw3_alloc(sizeof(*g));
+			INIT_LIST_HEAD(&g->ports);
+			list_add_tail(&g->list, groups);
+			n = 0;
+		}
+
+		tmp = fw3_alloc(sizeof(*tmp));
+		memcpy(tmp, p, sizeof(*tmp));
+		list_add_tail(&tmp->list, &g->ports);
+		g->count++;
+		n += slots;
+	}
+
+	return groups;
+}
+
+void
+fw3_ipt_free_port_groups(struct list_head *groups)
+{
+	struct fw3_port_group *g, *tmp;
+	struct fw3_port *p, *ptmp;
+
+	list_for_each_entry_safe(g, tmp, groups, list)
+	{
+		list_for_each_entry_safe(p, ptmp, &g->ports, list)
+			free(p);
+
+		free(g);
+	}
+
+	free(groups);
+}
+
+void
+fw3_ipt_rule_port_groups(struct fw3_ipt_rule *r,
+                         struct fw3_port_group *sg, struct fw3_port_group *dg)
+{
+	struct fw3_port *sp = NULL, *dp = NULL;
+	struct list_head *sports = NULL, *dports = NULL;
+
+	if (sg && sg->count == 1)
+		sp = list_first_entry(&sg->ports, struct fw3_port, list);
+	else if (sg)
+		sports = &sg->ports;
+
+	if (dg && dg->count == 1)
+		dp = list_first_entry(&dg->ports, struct fw3_port, list);
+	else if (dg)
+		dports = &dg->ports;
+
+	fw3_ipt_rule_sport_dport(r, sp, dp);
+	fw3_ipt_rule_multiport(r, sports, dports);
+}
+
+void
+fw3_ipt_rule_ctstate(struct fw3_ipt_rule *r, bool inv, uint32_t states)
+{
+	struct xt_conntrack_mtinfo3 *info;
+
+	if (!states)
+		return;
+
+	info = xt_add_match(r, "conntrack", 3, sizeof(*info), sizeof(*info));
+	info->match_flags = XT_CONNTRACK_STATE;
+
+	if (inv)
+		info->invert_flags = XT_CONNTRACK_STATE;
+
+	if (states & FW3_CTSTATE_INVALID)
+		info->state_mask |= XT_CONNTRACK_STATE_INVALID;
+
+	if (states & FW3_CTSTATE_ESTABLISHED)
+		info->state_mask |= XT_CONNTRACK_STATE_BIT(IP_CT_ESTABLISHED);
+
+	if (states & FW3_CTSTATE_RELATED)
+		info->state_mask |= XT_CONNTRACK_STATE_BIT(IP_CT_RELATED);
+
+	if (states & FW3_CTSTATE_NEW)
+		info->state_mask |= XT_CONNTRACK_STATE_BIT(IP_CT_NEW);
+
+	if (states & FW3_CTSTATE_UNTRACKED)
+		info->state_mask |= XT_CONNTRACK_STATE_UNTRACKED;
+
+	if (states & FW3_CTSTATE_SNAT)
+		info->state_mask |= XT_CONNTRACK_STATE_SNAT;
+
+	if (states & FW3_CTSTATE_DNAT)
+		info->state_mask |= XT_CONNTRACK_STATE_DNAT;
+}
+
+void
+fw3_ipt_rule_target(struct fw3_ipt_rule *r, const char *fmt, ...)
+{
+	va_list ap;
+	char buf[32];
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+
+	/* verdicts and jumps to existing chains need no extension */
+	if (!strcmp(buf, "ACCEPT") || !strcmp(buf, "DROP") ||
+	    !strcmp(buf, "RETURN") || is_chain(r->h, buf))
+	{
+		xt_set_target(r, buf, 0, sizeof(int), XT_ALIGN(sizeof(int)));
+		return;
+	}
+
+	fw3_ipt_rule_addarg(r, false, "-j", buf);
+}
+
+void
+fw3_ipt_rule_log(struct fw3_ipt_rule *r, const char *fmt, ...)
+{
+	va_list ap;
+	struct xt_log_info *info;
+
+	info = xt_set_target(r, "LOG", 0, sizeof(*info), sizeof(*info));
+	info->level = LOG_WARNING;
+
+	va_start(ap, fmt);
+	vsnprintf(info->prefix, sizeof(info->prefix), fmt, ap);
+	va_end(ap);
+}
+
+void
+fw3_ipt_rule_reject(struct fw3_ipt_rule *r, enum fw3_reject_code code)
+{
+#ifndef DISABLE_IPV6
+	if (r->h->family == FW3_FAMILY_V6)
+	{
+		struct ip6t_reject_info *info6;
+
+		info6 = xt_set_target(r, "REJECT", 0, sizeof(*info6), sizeof(*info6));
+
+		switch (code)
+		{
+		case FW3_REJECT_CODE_TCP_RESET:
+			info6->with = IP6T_TCP_RESET;
+			break;
+
+		case FW3_REJECT_CODE_ADM_PROHIBITED:
+			info6->with = IP6T_ICMP6_ADM_PROHIBITED;
+			break;
+
+		default:
+			info6->with = IP6T_ICMP6_PORT_UNREACH;
+			break;
+		}
+	}
+	else
+#endif
+	{
+		struct ipt_reject_info *info;
+
+		info = xt_set_target(r, "REJECT", 0, sizeof(*info), sizeof(*info));
+
+		switch (code)
+		{
+		case FW3_REJECT_CODE_TCP_RESET:
+			info->with = IPT_TCP_RESET;
+			break;
+
+		case FW3_REJECT_CODE_ADM_PROHIBITED:
+			info->with = IPT_ICMP_ADMIN_PROHIBITED;
+			break;
+
+		default:
+			info->with = IPT_ICMP_PORT_UNREACHABLE;
+			break;
+		}
+	}
+}
+
+void
+fw3_ipt_rule_nat(struct fw3_ipt_rule *r, enum fw3_flag target,
+                 struct fw3_address *addr, struct fw3_port *port)
+{
+	char buf[sizeof("255.255.255.255:65535-65535")] = {};
+	char ip[INET_ADDRSTRLEN], *p = buf;
+	size_t rem = sizeof(buf);
+	int len;
+
+	struct nf_nat_ipv4_multi_range_compat *mr;
+	bool has_addr = (addr && addr->set);
+	bool has_port = (port && port->set);
+
+	/* anything the rev0 nat targets cannot express takes the parser path
+	 * so that it still gets rejected with the usual diagnostics */
+	if (r->h->family == FW3_FAMILY_V4 && (has_addr || has_port) &&
+	    (!has_port || has_port_proto(r) ||
+	     (r->protocol == 1 && !(r->e.ip.invflags & XT_INV_PROTO))))
+	{
+		mr = xt_set_target(r, (target == FW3_FLAG_DNAT) ? "DNAT" : "SNAT", 0,
+		                   sizeof(*mr), sizeof(*mr));
+
+		mr->rangesize = 1;
+
+		if (has_addr)
+		{
+			mr->range[0].flags |= NF_NAT_RANGE_MAP_IPS;
+			mr->range[0].min_ip = addr->address.v4.s_addr;
+			mr->range[0].max_ip = addr->address.v4.s_addr;
+		}
+
+		if (has_port)
+		{
+			mr->range[0].flags |= NF_NAT_RANGE_PROTO_SPECIFIED;
+			mr->range[0].min.all = htons(port->port_min);
+			mr->range[0].max.all = htons(port->port_max);
+		}
+
+		return;
+	}
+
+	if (has_addr)
+	{
+		inet_ntop(AF_INET, &addr->address.v4, ip, sizeof(ip));
+
+		len = snprintf(p, rem, "%s", ip);
+
+		if (len < 0 || len >= rem)
+			return;
+
+		rem -= len;
+		p += len;
+	}
+
+	if (has_port)
+	{
+		if (port->port_min == port->port_max)
+			snprintf(p, rem, ":%u", port->port_min);
+		else
+			snprintf(p, rem, ":%u-%u", port->port_min, port->port_max);
+	}
+
+	if (target == FW3_FLAG_DNAT)
+	{
+		fw3_ipt_rule_addarg(r, false, "-j", "DNAT");
+		fw3_ipt_rule_addarg(r, false, "--to-destination", buf);
+	}
+	else
+	{
+		fw3_ipt_rule_addarg(r, false, "-j", "SNAT");
+		fw3_ipt_rule_addarg(r, false, "--to-source", buf);
+	}
+}
+
+void
+fw3_ipt_rule_extra(struct fw3_ipt_rule *r, const char *extra)
+{
+	char *p, **tmp, *s;
+
+	if (!extra || !*extra)
+		return;
+
+	s = fw3_strdup(extra);
+
+	for (p = strtok(s, " \t"); p; p = strtok(NULL, " \t"))
+	{
+		tmp = realloc(r->argv, (r->argc + 1) * sizeof(*r->argv));
+
+		if (!tmp)
+			break;
+
+		r->argv = tmp;
+		r->argv[r->argc++] = fw3_strdup(p);
+	}
+
+	free(s);
+}
+
+#ifndef DISABLE_IPV6
+static void
+rule_print6(struct ip6t_entry *e)
+{
+	char buf1[INET6_ADDRSTRLEN], buf2[INET6_ADDRSTRLEN];
+	char *pname;
+
+	if (e->ipv6.flags & IP6T_F_PROTO)
+	{
+		if (e->ipv6.invflags & XT_INV_PROTO)
+			printf(" !");
+
+		pname = get_protoname(container_of(e, struct fw3_ipt_rule, e6));
+
+		if (pname)
+			printf(" -p %s", pname);
+		else
+			printf(" -p %u", e->ipv6.proto);
+	}
+
+	if (e->ipv6.iniface[0])
+	{
+		if (e->ipv6.invflags & IP6T_INV_VIA_IN)
+			printf(" !");
+
+		printf(" -i %s", e->ipv6.iniface);
+	}
+
+	if (e->ipv6.outiface[0])
+	{
+		if (e->ipv6.invflags & IP6T_INV_VIA_OUT)
+			printf(" !");
+
+		printf(" -o %s", e->ipv6.outiface);
+	}
+
+	if (memcmp(&e->ipv6.src, &in6addr_any, sizeof(struct in6_addr)))
+	{
+		if (e->ipv6.invflags & IP6T_INV_SRCIP)
+			printf(" !");
+
+		printf(" -s %s/%s",
+		       inet_ntop(AF_INET6, &e->ipv6.src, buf1, sizeof(buf1)),
+		       inet_ntop(AF_INET6, &e->ipv6.smsk, buf2, sizeof(buf2)));
+	}
+
+	if (memcmp(&e->ipv6.dst, &in6addr_any, sizeof(struct in6_addr)))
+	{
+		if (e->ipv6.invflags & IP6T_INV_DSTIP)
+			printf(" !");
+
+		printf(" -d %s/%s",
+		       inet_ntop(AF_INET6, &e->ipv6.dst, buf1, sizeof(buf1)),
+		       inet_ntop(AF_INET6, &e->ipv6.dmsk, buf2, sizeof(buf2)));
+	}
+}
+#endif
+
+static void
+rule_print4(struct ipt_entry *e)
+{
+	struct in_addr in_zero = { 0 };
+	char buf1[sizeof("255.255.255.255")], buf2[sizeof("255.255.255.255")];
+	char *pname;
+
+	if (e->ip.proto)
+	{
+		if (e->ip.invflags & XT_INV_PROTO)
+			printf(" !");
+
+		pname = get_protoname(container_of(e, struct fw3_ipt_rule, e));
+
+		if (pname)
+			printf(" -p %s", pname);
+		else
+			printf(" -p %u", e->ip.proto);
+	}
+
+	if (e->ip.iniface[0])
+	{
+		if (e->ip.invflags & IPT_INV_VIA_IN)
+			printf(" !");
+
+		printf(" -i %s", e->ip.iniface);
+	}
+
+	if (e->ip.outiface[0])
+	{
+		if (e->ip.invflags & IPT_INV_VIA_OUT)
+			printf(" !");
+
+		printf(" -o %s", e->ip.outiface);
+	}
+
+	if (memcmp(&e->ip.src, &in_zero, sizeof(struct in_addr)))
+	{
+		if (e->ip.invflags & IPT_INV_SRCIP)
+			printf(" !");
+
+		printf(" -s %s/%s",
+		       inet_ntop(AF_INET, &e->ip.src, buf1, sizeof(buf1)),
+		       inet_ntop(AF_INET, &e->ip.smsk, buf2, sizeof(buf2)));
+	}
+
+	if (memcmp(&e->ip.dst, &in_zero, sizeof(struct in_addr)))
+	{
+		if (e->ip.invflags & IPT_INV_DSTIP)
+			printf(" !");
+
+		printf(" -d %s/%s",
+		       inet_ntop(AF_INET, &e->ip.dst, buf1, sizeof(buf1)),
+		       inet_ntop(AF_INET, &e->ip.dmsk, buf2, sizeof(buf2)));
+	}
+}
+
+struct fw3_ipt_match_ref {
+	const struct xt_entry_match *m;
+	size_t userspacesize;
+};
+
+/* compiled and parsed matches of a rule in the order they were added */
+static unsigned int
+rule_matches(struct fw3_ipt_rule *r, struct fw3_ipt_match_ref **refs)
+{
+	unsigned int i = 0, n = 0;
+	struct fw3_ipt_xt *x;
+	struct xtables_rule_match *m;
+
+	for (x = r->xt_matches; x; x = x->next)
+		n++;
+
+	for (m = r->matches; m; m = m->next)
+		n++;
+
+	*refs = fw3_alloc((n + 1) * sizeof(**refs));
+
+	for (x = r->xt_matches, m = r->matches, n = 0; x || m; n++)
+	{
+		if (x && (!m || i >= r->nmatch_pos || x->pos <= r->match_pos[i]))
+		{
+			(*refs)[n].m = x->m;
+			(*refs)[n].userspacesize = x->userspacesize;
+			x = x->next;
+		}
+		else
+		{
+			(*refs)[n].m = m->match->m;
+			(*refs)[n].userspacesize = m->match->userspacesize;
+			m = m->next;
+			i++;
+		}
+	}
+
+	return n;
+}
+
+static void
+rule_print(struct fw3_ipt_rule *r, const char *prefix, const char *chain)
+{
+	unsigned int i, n;
+	struct fw3_ipt_match_ref *refs;
+
+	debug(r->h, "%s %s", prefix, chain);
+
+#ifndef DISABLE_IPV6
+	if (r->h->family == FW3_FAMILY_V6)
+		rule_print6(&r->e6);
+	else
+#endif
+		rule_print4(&r->e);
+
+	n = rule_matches(r, &refs);
+
+	for (i = 0; i < n; i++)
+		fw3_xt_print_entry_match(&r->e.ip, refs[i].m, i == 0);
+
+	free(refs);
+
+	if (r->target)
+		fw3_xt_print_target(&r->e.ip, r->target, n == 0);
+	else if (r->xt_target)
+		fw3_xt_print_entry_target(&r->e.ip, r->xt_target->t, n == 0);
+
+	printf("\n");
+}
+
+static bool
+parse_option(struct fw3_ipt_rule *r, int optc, bool inv)
+{
+	struct xtables_rule_match *m;
+	struct xtables_match *em;
+
+	/* is a target option */
+	if (r->target && fw3_xt_has_target_parse(r->target) &&
+		optc >= r->target->option_offset &&
+		optc < (r->target->option_offset + 256))
+	{
+		xtables_option_tpcall(optc, r->argv, inv, r->target, &r->e);
+		return false;
+	}
+
+	/* try to dispatch argument to one of the match parsers */
+	for (m = r->matches; m; m = m->next)
+	{
+		em = m->match;
 
-	fw3_ipt_rule_addarg(r, false, buf, NULL);
+		if (m->completed || !fw3_xt_has_match_parse(em))
+			continue;
+
+		if (optc < em->option_offset ||
+			optc >= (em->option_offset + 256))
+			continue;
+
+		xtables_option_mpcall(optc, r->argv, inv, em, &r->e);
+		return false;
+	}
+
+	/* unhandled option, might belong to a protocol match */
+	if ((em = load_protomatch(r)) != NULL)
+	{
+		init_match(r, em, false);
+
+		r->protocol_loaded = true;
+		optind--;
+
+		return true;
+	}
+
+	if (optc == ':')
+		warn("parse_option(): option '%s' needs argument", r->argv[optind-1]);
+
+	if (optc == '?')
+		warn("parse_option(): unknown option '%s'", r->argv[optind-1]);
+
+	return false;
 }
 
 void
-fw3_ipt_rule_helper(struct fw3_ipt_rule *r, struct fw3_cthelpermatch *match)
+fw3_ipt_rule_addarg(struct fw3_ipt_rule *r, bool inv,
+                    const char *k, const char *v)
 {
-	if (!match || !match->set || !match->ptr)
+	int n;
+	char **tmp;
+
+	if (!k)
 		return;
 
-	fw3_ipt_rule_addarg(r, false, "-m", "helper");
-	fw3_ipt_rule_addarg(r, match->invert, "--helper", match->ptr->name);
+	n = inv + !!k + !!v;
+	tmp = realloc(r->argv, (r->argc + n) * sizeof(*tmp));
+
+	if (!tmp)
+		return;
+
+	r->argv = tmp;
+
+	if (inv)
+		r->argv[r->argc++] = fw3_strdup("!");
+
+	r->argv[r->argc++] = fw3_strdup(k);
+
+	if (v)
+		r->argv[r->argc++] = fw3_strdup(v);
 }
 
-void
-fw3_ipt_rule_time(struct fw3_ipt_rule *r, struct fw3_time *time)
+#define SZ(x) XT_ALIGN(sizeof(struct x))
+
+static size_t
+rule_size(struct fw3_ipt_rule *r, size_t *target_offset)
 {
-	int i, len;
-	struct tm empty = { 0 };
+	size_t s, us;
+	struct xtables_rule_match *m;
+	struct xt_entry_target *t;
+	struct fw3_ipt_xt *x;
 
-	char buf[84]; /* sizeof("1,2,3,...,30,31") */
-	char *p;
+#ifndef DISABLE_IPV6
+	if (r->h->family == FW3_FAMILY_V6)
+		s = SZ(ip6t_entry);
+	else
+#endif
+		s = SZ(ipt_entry);
 
-	bool d1 = memcmp(&time->datestart, &empty, sizeof(empty));
-	bool d2 = memcmp(&time->datestop, &empty, sizeof(empty));
+	/* order does not matter for the size */
+	for (x = r->xt_matches; x; x = x->next)
+		s += x->m->u.match_size;
 
-	size_t rem;
+	for (m = r->matches; m; m = m->next)
+		s += m->match->m->u.match_size;
 
-	if (!d1 && !d2 && !time->timestart && !time->timestop &&
-	    !(time->monthdays & 0xFFFFFFFE) && !(time->weekdays & 0xFE))
-	{
-		return;
-	}
+	*target_offset = s;
 
-	fw3_ipt_rule_addarg(r, false, "-m", "time");
+	t = rule_target(r, &us);
 
-	if (!time->utc)
-		fw3_ipt_rule_addarg(r, false, "--kerneltz", NULL);
+	return s + (t ? t->u.target_size : SZ(xt_entry_target));
+}
 
-	if (d1)
-	{
-		strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &time->datestart);
-		fw3_ipt_rule_addarg(r, false, "--datestart", buf);
-	}
+static unsigned char *
+rule_mask(struct fw3_ipt_rule *r)
+{
+	size_t s, us;
+	unsigned char *p, *mask = NULL;
+	unsigned int i, n;
+	struct fw3_ipt_match_ref *refs;
 
-	if (d2)
+	mask = fw3_alloc(rule_size(r, &s));
+
+#ifndef DISABLE_IPV6
+	if (r->h->family == FW3_FAMILY_V6)
+		s = SZ(ip6t_entry);
+	else
+#endif
+		s = SZ(ipt_entry);
+
+	memset(mask, 0xFF, s);
+	p = mask + s;
+
+	n = rule_matches(r, &refs);
+
+	for (i = 0; i < n; i++)
 	{
-		strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &time->datestop);
-		fw3_ipt_rule_addarg(r, false, "--datestop", buf);
+		memset(p, 0xFF, SZ(xt_entry_match) + refs[i].userspacesize);
+		p += refs[i].m->u.match_size;
 	}
 
-	if (time->timestart)
-	{
-		snprintf(buf, sizeof(buf), "%02d:%02d:%02d",
-		        time->timestart / 3600,
-		        time->timestart % 3600 / 60,
-		        time->timestart % 60);
+	free(refs);
 
-		fw3_ipt_rule_addarg(r, false, "--timestart", buf);
-	}
+	rule_target(r, &us);
+	memset(p, 0xFF, SZ(xt_entry_target) + us);
 
-	if (time->timestop)
-	{
-		snprintf(buf, sizeof(buf), "%02d:%02d:%02d",
-		        time->timestop / 3600,
-		        time->timestop % 3600 / 60,
-		        time->timestop % 60);
+	return mask;
+}
 
-		fw3_ipt_rule_addarg(r, false, "--timestop", buf);
-	}
+static void *
+rule_build(struct fw3_ipt_rule *r)
+{
+	size_t us, target_offset, target_size;
+	unsigned char *p, *e;
+	unsigned int i, n;
+	struct fw3_ipt_match_ref *refs;
+	struct xt_entry_target *t;
 
-	if (time->monthdays & 0xFFFFFFFE)
-	{
-		for (i = 1, p = buf, rem = sizeof(buf); i < 32; i++)
-		{
-			if (fw3_hasbit(time->monthdays, i))
-			{
-				if (p > buf) {
-					if (rem <= 1)
-						break;
+	rule_size(r, &target_offset);
+	t = rule_target(r, &us);
+	target_size = t ? t->u.target_size : 0;
 
-					*p++ = ',';
-					*p = 0;
-					rem--;
-				}
+	e = fw3_alloc(target_offset + target_size);
 
-				len = snprintf(p, rem, "%u", i);
+#ifndef DISABLE_IPV6
+	if (r->h->family == FW3_FAMILY_V6)
+	{
+		struct ip6t_entry *e6 = (struct ip6t_entry *)e;
 
-				if (len < 0 || len >= rem)
-					break;
+		memcpy(e6, &r->e6, sizeof(struct ip6t_entry));
 
-				rem -= len;
-				p += len;
-			}
-		}
+		e6->target_offset = target_offset;
+		e6->next_offset = target_offset + target_size;
 
-		fw3_ipt_rule_addarg(r, fw3_hasbit(time->monthdays, 0), "--monthdays", buf);
+		p = e + SZ(ip6t_entry);
 	}
-
-	if (time->weekdays & 0xFE)
+	else
+#endif
 	{
-		for (i = 1, p = buf, rem = sizeof(buf); i < 8; i++)
-		{
-			if (fw3_hasbit(time->weekdays, i))
-			{
-				if (p > buf) {
-					if (rem <= 1)
-						break;
+		struct ipt_entry *e4 = (struct ipt_entry *)e;
 
-					*p++ = ',';
-					*p = 0;
-					rem--;
-				}
+		memcpy(e4, &r->e, sizeof(struct ipt_entry));
 
-				len = snprintf(p, rem, "%u", i);
+		e4->target_offset = target_offset;
+		e4->next_offset = target_offset + target_size;
 
-				if (len < 0 || len >= rem)
-					break;
+		p = e + SZ(ipt_entry);
+	}
 
-				rem -= len;
-				p += len;
-			}
-		}
+	n = rule_matches(r, &refs);
 
-		fw3_ipt_rule_addarg(r, fw3_hasbit(time->weekdays, 0), "--weekdays", buf);
+	for (i = 0; i < n; i++)
+	{
+		memcpy(p, refs[i].m, refs[i].m->u.match_size);
+		p += refs[i].m->u.match_size;
 	}
+
+	free(refs);
+
+	if (target_size)
+		memcpy(p, t, target_size);
+
+	return e;
 }
 
-void
-fw3_ipt_rule_mark(struct fw3_ipt_rule *r, struct fw3_mark *mark)
+static void
+set_rule_tag(struct fw3_ipt_rule *r)
 {
-	char buf[sizeof("0xFFFFFFFF/0xFFFFFFFF")];
+	int i;
+	char *p;
+	const char *tag = "!fw3";
+	struct xt_comment_info *info;
+
+	if (r->comment)
+	{
+		if (asprintf(&p, "%s: %s", tag, r->comment->comment) > 0)
+		{
+			snprintf(r->comment->comment, sizeof(r->comment->comment), "%s", p);
+			free(p);
+		}
 
-	if (!mark || !mark->set)
 		return;
+	}
 
-	if (mark->mask < 0xFFFFFFFF)
-		snprintf(buf, sizeof(buf), "0x%x/0x%x", mark->mark, mark->mask);
-	else
-		snprintf(buf, sizeof(buf), "0x%x", mark->mark);
+	for (i = 0; i < r->argc; i++)
+		if (!strcmp(r->argv[i], "--comment") && (i + 1) < r->argc)
+			if (asprintf(&p, "%s: %s", tag, r->argv[i + 1]) > 0)
+			{
+				free(r->argv[i + 1]);
+				r->argv[i + 1] = p;
+				return;
+			}
 
-	fw3_ipt_rule_addarg(r, false, "-m", "mark");
-	fw3_ipt_rule_addarg(r, mark->invert, "--mark", buf);
+	info = xt_add_match(r, "comment", 0, sizeof(*info), sizeof(*info));
+	snprintf(info->comment, sizeof(info->comment), "%s", tag);
 }
 
-void
-fw3_ipt_rule_dscp(struct fw3_ipt_rule *r, struct fw3_dscp *dscp)
+static bool
+rule_parse(struct fw3_ipt_rule *r)
 {
-	char buf[sizeof("0xFF")];
+	struct xtables_rule_match *m;
+	struct xtables_match *em;
+	struct xtables_target *et;
+	struct xtables_globals *g;
 
-	if (!dscp || !dscp->set)
-		return;
+	struct fw3_device dev;
+	struct fw3_address addr;
 
-	snprintf(buf, sizeof(buf), "0x%x", dscp->dscp);
+	enum xtables_exittype status;
 
-	fw3_ipt_rule_addarg(r, false, "-m", "dscp");
-	fw3_ipt_rule_addarg(r, dscp->invert, "--dscp", buf);
-}
+	int optc;
+	bool inv = false;
+
+	g = (r->h->family == FW3_FAMILY_V6) ? &xtg6 : &xtg;
+	g->opts = g->orig_opts;
+
+	optind = 0;
+	opterr = 0;
+
+	status = setjmp(fw3_ipt_error_jmp);
+
+	if (status > 0)
+	{
+		info("     ! Skipping due to previous exception (code %u)", status);
+		return false;
+	}
+
+	while ((optc = getopt_long(r->argc, r->argv, "-:m:j:i:o:s:d:", g->opts,
+	                           NULL)) != -1)
+	{
+		switch (optc)
+		{
+		case 'm':
+			em = find_match(r, optarg);
+
+			if (!em)
+			{
+				warn("fw3_ipt_rule_append(): Can't find match '%s'", optarg);
+				return false;
+			}
+
+			init_match(r, em, true);
+			break;
+
+		case 'j':
+			et = get_target(r, optarg);
 
-void
-fw3_ipt_rule_comment(struct fw3_ipt_rule *r, const char *fmt, ...)
-{
-	va_list ap;
-	char buf[256];
+			if (!et)
+			{
+				warn("fw3_ipt_rule_append(): Can't find target '%s'", optarg);
+				return false;
+			}
 
-	if (!fmt || !*fmt)
-		return;
+			break;
 
-	va_start(ap, fmt);
-	vsnprintf(buf, sizeof(buf), fmt, ap);
-	va_end(ap);
+		case 'i':
+		case 'o':
+			if (!fw3_parse_device(&dev, optarg, false) ||
+			    dev.any || dev.invert || *dev.network)
+			{
+				warn("fw3_ipt_rule_append(): Bad argument '%s'", optarg);
+				return false;
+			}
 
-	fw3_ipt_rule_addarg(r, false, "-m", "comment");
-	fw3_ipt_rule_addarg(r, false, "--comment", buf);
-}
+			dev.invert = inv;
+			fw3_ipt_rule_in_out(r, (optc == 'i') ? &dev : NULL,
+			                       (optc == 'o') ? &dev : NULL);
+			break;
 
-void
-fw3_ipt_rule_extra(struct fw3_ipt_rule *r, const char *extra)
-{
-	char *p, **tmp, *s;
+		case 's':
+		case 'd':
+			if (!fw3_parse_address(&addr, optarg, false) ||
+			    addr.range || addr.invert)
+			{
+				warn("fw3_ipt_rule_append(): Bad argument '%s'", optarg);
+				return false;
+			}
 
-	if (!extra || !*extra)
-		return;
+			addr.invert = inv;
+			fw3_ipt_rule_src_dest(r, (optc == 's') ? &addr : NULL,
+			                         (optc == 'd') ? &addr : NULL);
+			break;
 
-	s = fw3_strdup(extra);
+		case 1:
+			if ((optarg[0] == '!') && (optarg[1] == '\0'))
+			{
+				optarg[0] = '\0';
+				inv = true;
+				continue;
+			}
 
-	for (p = strtok(s, " \t"); p; p = strtok(NULL, " \t"))
-	{
-		tmp = realloc(r->argv, (r->argc + 1) * sizeof(*r->argv));
+			warn("fw3_ipt_rule_append(): Bad argument '%s'", optarg);
+			return false;
 
-		if (!tmp)
+		default:
+			if (parse_option(r, optc, inv))
+				continue;
 			break;
+		}
 
-		r->argv = tmp;
-		r->argv[r->argc++] = fw3_strdup(p);
+		inv = false;
 	}
 
-	free(s);
+	for (m = r->matches; m; m = m->next)
+		xtables_option_mfcall(m->match);
+
+	if (r->target)
+		xtables_option_tfcall(r->target);
+
+	return true;
 }
 
-#ifndef DISABLE_IPV6
 static void
-rule_print6(struct ip6t_entry *e)
+rule_free(struct fw3_ipt_rule *r, bool parsed)
 {
-	char buf1[INET6_ADDRSTRLEN], buf2[INET6_ADDRSTRLEN];
-	char *pname;
+	int i;
+	struct xtables_match *em;
+	struct xtables_target *et;
 
-	if (e->ipv6.flags & IP6T_F_PROTO)
-	{
-		if (e->ipv6.invflags & XT_INV_PROTO)
-			printf(" !");
+	for (i = 1; i < r->argc; i++)
+		free(r->argv[i]);
 
-		pname = get_protoname(container_of(e, struct fw3_ipt_rule, e6));
+	free(r->argv);
 
-		if (pname)
-			printf(" -p %s", pname);
-		else
-			printf(" -p %u", e->ipv6.proto);
-	}
+	xtables_rule_matches_free(&r->matches);
+	free(r->match_pos);
 
-	if (e->ipv6.iniface[0])
-	{
-		if (e->ipv6.invflags & IP6T_INV_VIA_IN)
-			printf(" !");
+	if (r->target)
+		free(r->target->t);
 
-		printf(" -i %s", e->ipv6.iniface);
-	}
+	xt_free(r);
+	free(r);
 
-	if (e->ipv6.outiface[0])
-	{
-		if (e->ipv6.invflags & IP6T_INV_VIA_OUT)
-			printf(" !");
+	if (!parsed)
+		return;
 
-		printf(" -o %s", e->ipv6.outiface);
-	}
+	/* reset all targets and matches */
+	for (em = xtables_matches; em; em = em->next)
+		em->mflags = 0;
 
-	if (memcmp(&e->ipv6.src, &in6addr_any, sizeof(struct in6_addr)))
+	for (et = xtables_targets; et; et = et->next)
 	{
-		if (e->ipv6.invflags & IP6T_INV_SRCIP)
-			printf(" !");
-
-		printf(" -s %s/%s",
-		       inet_ntop(AF_INET6, &e->ipv6.src, buf1, sizeof(buf1)),
-		       inet_ntop(AF_INET6, &e->ipv6.smsk, buf2, sizeof(buf2)));
+		et->tflags = 0;
+		et->used = 0;
 	}
 
-	if (memcmp(&e->ipv6.dst, &in6addr_any, sizeof(struct in6_addr)))
-	{
-		if (e->ipv6.invflags & IP6T_INV_DSTIP)
-			printf(" !");
-
-		printf(" -d %s/%s",
-		       inet_ntop(AF_INET6, &e->ipv6.dst, buf1, sizeof(buf1)),
-		       inet_ntop(AF_INET6, &e->ipv6.dmsk, buf2, sizeof(buf2)));
-	}
+	xtables_free_opts(1);
 }
-#endif
 
-static void
-rule_print4(struct ipt_entry *e)
+
+static int
+base_option(const char *s)
 {
-	struct in_addr in_zero = { 0 };
-	char buf1[sizeof("255.255.255.255")], buf2[sizeof("255.255.255.255")];
-	char *pname;
+	size_t len;
+	struct option *o;
 
-	if (e->ip.proto)
-	{
-		if (e->ip.invflags & XT_INV_PROTO)
-			printf(" !");
+	if (s[0] != '-' || !s[1])
+		return 0;
 
-		pname = get_protoname(container_of(e, struct fw3_ipt_rule, e));
+	if (s[1] != '-')
+		return strchr("mjiosd", s[1]) ? s[1] : 0;
 
-		if (pname)
-			printf(" -p %s", pname);
-		else
-			printf(" -p %u", e->ip.proto);
-	}
+	len = strlen(s + 2);
 
-	if (e->ip.iniface[0])
-	{
-		if (e->ip.invflags & IPT_INV_VIA_IN)
-			printf(" !");
+	for (o = base_opts; len && o->name; o++)
+		if (!strncmp(o->name, s + 2, len))
+			return o->val;
 
-		printf(" -i %s", e->ip.iniface);
-	}
+	return 0;
+}
 
-	if (e->ip.outiface[0])
-	{
-		if (e->ip.invflags & IPT_INV_VIA_OUT)
-			printf(" !");
+static bool
+rule_proto_inv(struct fw3_ipt_rule *r)
+{
+#ifndef DISABLE_IPV6
+	if (r->h->family == FW3_FAMILY_V6)
+		return !!(r->e6.ipv6.invflags & XT_INV_PROTO);
+#endif
 
-		printf(" -o %s", e->ip.outiface);
-	}
+	return !!(r->e.ip.invflags & XT_INV_PROTO);
+}
 
-	if (memcmp(&e->ip.src, &in_zero, sizeof(struct in_addr)))
-	{
-		if (e->ip.invflags & IPT_INV_SRCIP)
-			printf(" !");
+static char *
+cache_key(struct fw3_ipt_rule *r, int start, int end)
+{
+	int i;
+	char *key, *p;
+	size_t len = sizeof("6:mangle:4294967295!:");
 
-		printf(" -s %s/%s",
-		       inet_ntop(AF_INET, &e->ip.src, buf1, sizeof(buf1)),
-		       inet_ntop(AF_INET, &e->ip.smsk, buf2, sizeof(buf2)));
-	}
+	for (i = start; i < end; i++)
+		len += strlen(r->argv[i]) + 1;
 
-	if (memcmp(&e->ip.dst, &in_zero, sizeof(struct in_addr)))
-	{
-		if (e->ip.invflags & IPT_INV_DSTIP)
-			printf(" !");
+	key = fw3_alloc(len);
+	p = key + sprintf(key, "%u:%s:%u%s:", r->h->family,
+	                  fw3_flag_names[r->h->table], r->protocol,
+	                  rule_proto_inv(r) ? "!" : "");
 
-		printf(" -d %s/%s",
-		       inet_ntop(AF_INET, &e->ip.dst, buf1, sizeof(buf1)),
-		       inet_ntop(AF_INET, &e->ip.dmsk, buf2, sizeof(buf2)));
-	}
+	for (i = start; i < end; i++)
+		p += sprintf(p, "%s\x01", r->argv[i]);
+
+	return key;
 }
 
-static void
-rule_print(struct fw3_ipt_rule *r, const char *prefix, const char *chain)
+static struct fw3_ipt_xt *
+xt_copy(const void *blob, size_t size, size_t userspacesize)
 {
-	debug(r->h, "%s %s", prefix, chain);
+	struct fw3_ipt_xt *x;
 
-#ifndef DISABLE_IPV6
-	if (r->h->family == FW3_FAMILY_V6)
-		rule_print6(&r->e6);
-	else
-#endif
-		rule_print4(&r->e);
+	x = fw3_alloc(sizeof(*x));
+	x->m = fw3_alloc(size);
+	x->userspacesize = userspacesize;
 
-	fw3_xt_print_matches(&r->e.ip, r->matches);
-	fw3_xt_print_target(&r->e.ip, r->target);
+	memcpy(x->m, blob, size);
 
-	printf("\n");
+	return x;
 }
 
-static bool
-parse_option(struct fw3_ipt_rule *r, int optc, bool inv)
+static struct fw3_ipt_cache_entry *
+cache_parse(struct fw3_ipt_rule *r, const char *key, int start, int end)
 {
+	int i;
+	bool ok;
+	struct fw3_ipt_rule *t;
+	struct fw3_ipt_cache_entry *c = NULL;
 	struct xtables_rule_match *m;
-	struct xtables_match *em;
+	struct fw3_ipt_xt **tail;
 
-	/* is a target option */
-	if (r->target && fw3_xt_has_target_parse(r->target) &&
-		optc >= r->target->option_offset &&
-		optc < (r->target->option_offset + 256))
-	{
-		xtables_option_tpcall(optc, r->argv, inv, r->target, &r->e);
-		return false;
-	}
+	t = fw3_ipt_rule_new(r->h);
 
-	/* try to dispatch argument to one of the match parsers */
-	for (m = r->matches; m; m = m->next)
-	{
-		em = m->match;
+#ifndef DISABLE_IPV6
+	if (r->h->family == FW3_FAMILY_V6)
+		t->e6 = r->e6;
+	else
+#endif
+		t->e = r->e;
 
-		if (m->completed || !fw3_xt_has_match_parse(em))
-			continue;
+	t->protocol = r->protocol;
 
-		if (optc < em->option_offset ||
-			optc >= (em->option_offset + 256))
-			continue;
+	for (i = start; i < end; i++)
+		fw3_ipt_rule_addarg(t, false, r->argv[i], NULL);
 
-		xtables_option_mpcall(optc, r->argv, inv, em, &r->e);
-		return false;
-	}
+	ok = rule_parse(t);
 
-	/* unhandled option, might belong to a protocol match */
-	if ((em = load_protomatch(r)) != NULL)
+	if (ok)
 	{
-		init_match(r, em, false);
+		c = fw3_alloc(sizeof(*c) + strlen(key) + 1);
+		strcpy(c->key, key);
+		c->node.key = c->key;
 
-		r->protocol_loaded = true;
-		optind--;
+		for (tail = &c->matches, m = t->matches; m; m = m->next)
+		{
+			*tail = xt_copy(m->match->m, m->match->m->u.match_size,
+			                m->match->userspacesize);
+			tail = &(*tail)->next;
+		}
 
-		return true;
-	}
+		if (t->target)
+			c->target = xt_copy(t->target->t, t->target->t->u.target_size,
+			                    t->target->userspacesize);
 
-	if (optc == ':')
-		warn("parse_option(): option '%s' needs argument", r->argv[optind-1]);
+		avl_insert(&xt_cache, &c->node);
+	}
 
-	if (optc == '?')
-		warn("parse_option(): unknown option '%s'", r->argv[optind-1]);
+	rule_free(t, true);
 
-	return false;
+	return c;
 }
 
 void
-fw3_ipt_rule_addarg(struct fw3_ipt_rule *r, bool inv,
-                    const char *k, const char *v)
+fw3_ipt_flush_cache(void)
 {
-	int n;
-	char **tmp;
+	struct fw3_ipt_xt *x, *next;
+	struct fw3_ipt_cache_entry *c, *tmp;
 
-	if (!k)
-		return;
+	avl_remove_all_elements(&xt_cache, c, node, tmp)
+	{
+		for (x = c->matches; x; x = next)
+		{
+			next = x->next;
+			free(x->m);
+			free(x);
+		}
 
-	n = inv + !!k + !!v;
-	tmp = realloc(r->argv, (r->argc + n) * sizeof(*tmp));
+		if (c->target)
+		{
+			free(c->target->t);
+			free(c->target);
+		}
 
-	if (!tmp)
-		return;
+		free(c);
+	}
+}
 
-	r->argv = tmp;
+static void
+cache_replay(struct fw3_ipt_rule *r, struct fw3_ipt_cache_entry *c, int pos)
+{
+	struct fw3_ipt_xt *x;
 
-	if (inv)
-		r->argv[r->argc++] = fw3_strdup("!");
+	for (x = c->matches; x; x = x->next)
+		xt_insert(r, xt_copy(x->m, x->m->u.match_size, x->userspacesize),
+		          pos);
 
-	r->argv[r->argc++] = fw3_strdup(k);
+	if (c->target)
+	{
+		if (r->xt_target)
+		{
+			free(r->xt_target->t);
+			free(r->xt_target);
+		}
 
-	if (v)
-		r->argv[r->argc++] = fw3_strdup(v);
+		r->xt_target = xt_copy(c->target->t, c->target->t->u.target_size,
+		                       c->target->userspacesize);
+	}
 }
 
-static unsigned char *
-rule_mask(struct fw3_ipt_rule *r)
+/* Returns 1 if all argv segments were served from the cache, 0 if the
+ * argv vector needs to go through the parser as a whole and -1 if one
+ * of the segments failed to parse. */
+static int
+cache_apply(struct fw3_ipt_rule *r)
 {
-	size_t s;
-	unsigned char *p, *mask = NULL;
-	struct xtables_rule_match *m;
+	int i, next, opt;
+	char *key;
+	const char *name;
+	struct fw3_ipt_cache_entry *c;
 
-#define SZ(x) XT_ALIGN(sizeof(struct x))
-
-#ifndef DISABLE_IPV6
-	if (r->h->family == FW3_FAMILY_V6)
+	/* only handle vectors made up entirely of match and target segments */
+	for (i = 1; i < r->argc; i = next)
 	{
-		s = SZ(ip6t_entry);
+		opt = base_option(r->argv[i]);
 
-		for (m = r->matches; m; m = m->next)
-			s += SZ(ip6t_entry_match) + m->match->size;
+		if ((opt != 'm' && opt != 'j') || (i + 1) >= r->argc ||
+		    (r->argv[i][1] != '-' && r->argv[i][2]))
+			return 0;
 
-		s += SZ(ip6t_entry_target);
-		if (r->target)
-			s += r->target->size;
+		/* jumps to chains and builtin verdicts depend on the table */
+		name = r->argv[i + 1];
 
-		mask = fw3_alloc(s);
-		memset(mask, 0xFF, SZ(ip6t_entry));
-		p = mask + SZ(ip6t_entry);
+		if (opt == 'j' &&
+		    (!strcmp(name, "ACCEPT") || !strcmp(name, "DROP") ||
+		     !strcmp(name, "RETURN") || !strcmp(name, "QUEUE") ||
+		     is_chain(r->h, name)))
+			return 0;
 
-		for (m = r->matches; m; m = m->next)
+		for (next = i + 2; next < r->argc; next++)
 		{
-			memset(p, 0xFF, SZ(ip6t_entry_match) + m->match->userspacesize);
-			p += SZ(ip6t_entry_match) + m->match->size;
-		}
+			opt = base_option(r->argv[next]);
+
+			if (opt == 'm' || opt == 'j')
+				break;
 
-		memset(p, 0xFF, SZ(ip6t_entry_target) + (r->target ? r->target->userspacesize : 0));
+			if (opt)
+				return 0;
+		}
 	}
-	else
-#endif
-	{
-		s = SZ(ipt_entry);
 
-		for (m = r->matches; m; m = m->next)
-			s += SZ(ipt_entry_match) + m->match->size;
+	for (i = 1; i < r->argc; i = next)
+	{
+		for (next = i + 2; next < r->argc; next++)
+		{
+			opt = base_option(r->argv[next]);
 
-		s += SZ(ipt_entry_target);
-		if (r->target)
-			s += r->target->size;
+			if (opt == 'm' || opt == 'j')
+				break;
+		}
 
-		mask = fw3_alloc(s);
-		memset(mask, 0xFF, SZ(ipt_entry));
-		p = mask + SZ(ipt_entry);
+		key = cache_key(r, i, next);
+		c = avl_find_element(&xt_cache, key, c, node);
 
-		for (m = r->matches; m; m = m->next)
+		if (c)
+		{
+			xt_cache_stats.hits++;
+		}
+		else
 		{
-			memset(p, 0xFF, SZ(ipt_entry_match) + m->match->userspacesize);
-			p += SZ(ipt_entry_match) + m->match->size;
+			xt_cache_stats.misses++;
+			c = cache_parse(r, key, i, next);
 		}
 
-		memset(p, 0xFF, SZ(ipt_entry_target) + (r->target ? r->target->userspacesize : 0));
+		free(key);
+
+		if (!c)
+			return -1;
+
+		cache_replay(r, c, i);
 	}
 
-	return mask;
+	return 1;
 }
 
-static void *
-rule_build(struct fw3_ipt_rule *r)
+static const char *
+entry_target(const void *entry, unsigned int target_offset,
+             unsigned int next_offset)
 {
-	size_t s, target_size = (r->target) ? r->target->t->u.target_size : 0;
-	struct xtables_rule_match *m;
+	const struct xt_entry_target *t = entry + target_offset;
+
+	return (next_offset > target_offset) ? t->u.user.name : "";
+}
+
+/* libiptc is_same() and target_same() on the masked entry bytes; the target
+ * names are compared by the caller through the index */
+static bool
+entry_same(struct fw3_ipt_handle *h, const void *a, const void *b,
+           const unsigned char *mask)
+{
+	unsigned int i, j, start, end, next;
+	const struct xt_entry_match *ma, *mb;
+	const struct xt_entry_target *ta, *tb;
 
 #ifndef DISABLE_IPV6
-	if (r->h->family == FW3_FAMILY_V6)
+	if (h->family == FW3_FAMILY_V6)
+	{
+		const struct ip6t_ip6 *ia = &((const struct ip6t_entry *)a)->ipv6;
+		const struct ip6t_ip6 *ib = &((const struct ip6t_entry *)b)->ipv6;
+
+		if (memcmp(&ia->src, &ib->src, sizeof(ia->src)) ||
+		    memcmp(&ia->dst, &ib->dst, sizeof(ia->dst)) ||
+		    memcmp(&ia->smsk, &ib->smsk, sizeof(ia->smsk)) ||
+		    memcmp(&ia->dmsk, &ib->dmsk, sizeof(ia->dmsk)) ||
+		    ia->proto != ib->proto || ia->tos != ib->tos ||
+		    ia->flags != ib->flags || ia->invflags != ib->invflags)
+			return false;
+
+		for (i = 0; i < IFNAMSIZ; i++)
+			if (ia->iniface_mask[i] != ib->iniface_mask[i] ||
+			    ia->outiface_mask[i] != ib->outiface_mask[i] ||
+			    ((ia->iniface[i] ^ ib->iniface[i]) & ia->iniface_mask[i]) ||
+			    ((ia->outiface[i] ^ ib->outiface[i]) & ia->outiface_mask[i]))
+				return false;
+
+		start = sizeof(struct ip6t_entry);
+		end = ((const struct ip6t_entry *)a)->target_offset;
+		next = ((const struct ip6t_entry *)a)->next_offset;
+
+		if (end != ((const struct ip6t_entry *)b)->target_offset ||
+		    next != ((const struct ip6t_entry *)b)->next_offset)
+			return false;
+	}
+	else
+#endif
 	{
-		struct ip6t_entry *e6;
+		const struct ipt_ip *ia = &((const struct ipt_entry *)a)->ip;
+		const struct ipt_ip *ib = &((const struct ipt_entry *)b)->ip;
+
+		if (ia->src.s_addr != ib->src.s_addr ||
+		    ia->dst.s_addr != ib->dst.s_addr ||
+		    ia->smsk.s_addr != ib->smsk.s_addr ||
+		    ia->dmsk.s_addr != ib->dmsk.s_addr ||
+		    ia->proto != ib->proto ||
+		    ia->flags != ib->flags || ia->invflags != ib->invflags)
+			return false;
+
+		for (i = 0; i < IFNAMSIZ; i++)
+			if (ia->iniface_mask[i] != ib->iniface_mask[i] ||
+			    ia->outiface_mask[i] != ib->outiface_mask[i] ||
+			    ((ia->iniface[i] ^ ib->iniface[i]) & ia->iniface_mask[i]) ||
+			    ((ia->outiface[i] ^ ib->outiface[i]) & ia->outiface_mask[i]))
+				return false;
+
+		start = sizeof(struct ipt_entry);
+		end = ((const struct ipt_entry *)a)->target_offset;
+		next = ((const struct ipt_entry *)a)->next_offset;
+
+		if (end != ((const struct ipt_entry *)b)->target_offset ||
+		    next != ((const struct ipt_entry *)b)->next_offset)
+			return false;
+	}
 
-		s = XT_ALIGN(sizeof(struct ip6t_entry));
+	for (i = start; i < end; i += ma->u.match_size)
+	{
+		ma = a + i;
+		mb = b + i;
 
-		for (m = r->matches; m; m = m->next)
-			s += m->match->m->u.match_size;
+		if (ma->u.match_size != mb->u.match_size ||
+		    strcmp(ma->u.user.name, mb->u.user.name))
+			return false;
 
-		e6 = fw3_alloc(s + target_size);
+		for (j = sizeof(*ma); j < ma->u.match_size; j++)
+			if ((((const unsigned char *)ma)[j] ^ ((const unsigned char *)mb)[j]) &
+			    mask[i + j])
+				return false;
+	}
 
-		memcpy(e6, &r->e6, sizeof(struct ip6t_entry));
+	if (next <= end)
+		return true;
 
-		e6->target_offset = s;
-		e6->next_offset = s + target_size;
+	ta = a + end;
+	tb = b + end;
 
-		s = 0;
+	/* standard targets are unnamed within libiptc, their verdict or jump
+	 * is fully described by the target name */
+	if (!ta->u.user.name[0] || !tb->u.user.name[0])
+		return true;
 
-		for (m = r->matches; m; m = m->next)
-		{
-			memcpy(e6->elems + s, m->match->m, m->match->m->u.match_size);
-			s += m->match->m->u.match_size;
-		}
+	if (ta->u.target_size != tb->u.target_size)
+		return false;
 
-		if (target_size)
-			memcpy(e6->elems + s, r->target->t, target_size);
+	for (j = sizeof(*ta); j < ta->u.target_size; j++)
+		if ((((const unsigned char *)ta)[j] ^ ((const unsigned char *)tb)[j]) &
+		    mask[end + j])
+			return false;
 
-		return e6;
-	}
-	else
-#endif
-	{
-		struct ipt_entry *e;
+	return true;
+}
+
+/* hand a freshly appended entry over to the rule index */
+static bool
+index_append(struct fw3_ipt_handle *h, const char *chain, void *entry)
+{
+	struct fw3_ipt_chain *c;
+	const char *target;
 
-		s = XT_ALIGN(sizeof(struct ipt_entry));
+	if (!h->index)
+		return false;
 
-		for (m = r->matches; m; m = m->next)
-			s += m->match->m->u.match_size;
+	if (!(c = index_chain(h, chain, false)))
+	{
+		index_free(h);
+		return false;
+	}
 
-		e = fw3_alloc(s + target_size);
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		target = entry_target(entry,
+		                      ((struct ip6t_entry *)entry)->target_offset,
+		                      ((struct ip6t_entry *)entry)->next_offset);
+	else
+#endif
+		target = entry_target(entry,
+		                      ((struct ipt_entry *)entry)->target_offset,
+		                      ((struct ipt_entry *)entry)->next_offset);
 
-		memcpy(e, &r->e, sizeof(struct ipt_entry));
+	index_add_rule(h, c, target, entry, entry);
+	return true;
+}
 
-		e->target_offset = s;
-		e->next_offset = s + target_size;
+static void
+replace_entries(struct fw3_ipt_rule *r, const char *chain, void *rule,
+                unsigned char *mask)
+{
+	uint32_t hv;
+	const char *target;
+	unsigned int n = 0, *nums = NULL;
+	struct fw3_ipt_handle *h = r->h;
+	struct fw3_ipt_chain *c;
+	struct fw3_ipt_ref *ref;
 
-		s = 0;
+	index_build(h);
 
-		for (m = r->matches; m; m = m->next)
+	if (!(c = index_chain(h, chain, false)))
+	{
+#ifndef DISABLE_IPV6
+		if (h->family == FW3_FAMILY_V6)
 		{
-			memcpy(e->elems + s, m->match->m, m->match->m->u.match_size);
-			s += m->match->m->u.match_size;
+			while (ip6tc_delete_entry(chain, rule, mask, h->handle))
+				if (fw3_pr_debug)
+					rule_print(r, "-D", chain);
+		}
+		else
+#endif
+		{
+			while (iptc_delete_entry(chain, rule, mask, h->handle))
+				if (fw3_pr_debug)
+					rule_print(r, "-D", chain);
 		}
 
-		if (target_size)
-			memcpy(e->elems + s, r->target->t, target_size);
-
-		return e;
+		return;
 	}
-}
 
-static void
-set_rule_tag(struct fw3_ipt_rule *r)
-{
-	int i;
-	char *p, **tmp;
-	const char *tag = "!fw3";
+	index_hash_chain(c);
 
-	for (i = 0; i < r->argc; i++)
-		if (!strcmp(r->argv[i], "--comment") && (i + 1) < r->argc)
-			if (asprintf(&p, "%s: %s", tag, r->argv[i + 1]) > 0)
-			{
-				free(r->argv[i + 1]);
-				r->argv[i + 1] = p;
-				return;
-			}
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		target = entry_target(rule,
+		                      ((struct ip6t_entry *)rule)->target_offset,
+		                      ((struct ip6t_entry *)rule)->next_offset);
+	else
+#endif
+		target = entry_target(rule,
+		                      ((struct ipt_entry *)rule)->target_offset,
+		                      ((struct ipt_entry *)rule)->next_offset);
 
-	tmp = realloc(r->argv, (r->argc + 4) * sizeof(*r->argv));
+	hv = entry_hash(h, rule, target);
 
-	if (tmp)
+	list_for_each_entry(ref, &c->buckets[hv & (c->nbuckets - 1)], hlist)
 	{
-		r->argv = tmp;
-		r->argv[r->argc++] = fw3_strdup("-m");
-		r->argv[r->argc++] = fw3_strdup("comment");
-		r->argv[r->argc++] = fw3_strdup("--comment");
-		r->argv[r->argc++] = fw3_strdup(tag);
+		if (ref->hash != hv ||
+		    strcmp(target, ref->target ? ref->target->name : "") ||
+		    !entry_same(h, rule, ref->entry, mask))
+			continue;
+
+		if (fw3_pr_debug)
+			rule_print(r, "-D", chain);
+
+		push_num(&nums, &n, ref->num);
+	}
+
+	if (n)
+	{
+		qsort(nums, n, sizeof(*nums), cmp_num);
+		delete_nums(h, chain, nums, n, false);
 	}
+
+	free(nums);
 }
 
 void
@@ -1668,18 +4240,7 @@ __fw3_ipt_rule_append(struct fw3_ipt_rule *r, bool repl, const char *fmt, ...)
 	void *rule;
 	unsigned char *mask;
 
-	struct xtables_rule_match *m;
-	struct xtables_match *em;
-	struct xtables_target *et;
-	struct xtables_globals *g;
-
-	struct fw3_device dev;
-	struct fw3_address addr;
-
-	enum xtables_exittype status;
-
-	int i, optc;
-	bool inv = false;
+	bool ok, parse = false;
 	char buf[32];
 	va_list ap;
 
@@ -1687,173 +4248,60 @@ __fw3_ipt_rule_append(struct fw3_ipt_rule *r, bool repl, const char *fmt, ...)
 	vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
 	va_end(ap);
 
-	g = (r->h->family == FW3_FAMILY_V6) ? &xtg6 : &xtg;
-	g->opts = g->orig_opts;
-
-	optind = 0;
-	opterr = 0;
-
-	status = setjmp(fw3_ipt_error_jmp);
-
-	if (status > 0)
-	{
-		info("     ! Skipping due to previous exception (code %u)", status);
+	if (is_kept(r->h, buf))
 		goto free;
-	}
 
 	set_rule_tag(r);
 
-	while ((optc = getopt_long(r->argc, r->argv, "-:m:j:i:o:s:d:", g->opts,
-	                           NULL)) != -1)
+	/* rules built entirely by the structured helpers skip the parser */
+	if (r->argc > 1)
 	{
-		switch (optc)
+		switch (cache_apply(r))
 		{
-		case 'm':
-			em = find_match(r, optarg);
-
-			if (!em)
-			{
-				warn("fw3_ipt_rule_append(): Can't find match '%s'", optarg);
-				goto free;
-			}
-
-			init_match(r, em, true);
-			break;
-
-		case 'j':
-			et = get_target(r, optarg);
-
-			if (!et)
-			{
-				warn("fw3_ipt_rule_append(): Can't find target '%s'", optarg);
-				goto free;
-			}
-
-			break;
-
-		case 'i':
-		case 'o':
-			if (!fw3_parse_device(&dev, optarg, false) ||
-			    dev.any || dev.invert || *dev.network)
-			{
-				warn("fw3_ipt_rule_append(): Bad argument '%s'", optarg);
-				goto free;
-			}
+		case -1:
+			goto free;
 
-			dev.invert = inv;
-			fw3_ipt_rule_in_out(r, (optc == 'i') ? &dev : NULL,
-			                       (optc == 'o') ? &dev : NULL);
-			break;
+		case 0:
+			parse = true;
 
-		case 's':
-		case 'd':
-			if (!fw3_parse_address(&addr, optarg, false) ||
-			    addr.range || addr.invert)
-			{
-				warn("fw3_ipt_rule_append(): Bad argument '%s'", optarg);
+			if (!rule_parse(r))
 				goto free;
-			}
-
-			addr.invert = inv;
-			fw3_ipt_rule_src_dest(r, (optc == 's') ? &addr : NULL,
-			                         (optc == 'd') ? &addr : NULL);
-			break;
 
-		case 1:
-			if ((optarg[0] == '!') && (optarg[1] == '\0'))
-			{
-				optarg[0] = '\0';
-				inv = true;
-				continue;
-			}
-
-			warn("fw3_ipt_rule_append(): Bad argument '%s'", optarg);
-			goto free;
-
-		default:
-			if (parse_option(r, optc, inv))
-				continue;
 			break;
 		}
-
-		inv = false;
 	}
 
-	for (m = r->matches; m; m = m->next)
-		xtables_option_mfcall(m->match);
+	rule = rule_build(r);
 
-	if (r->target)
-		xtables_option_tfcall(r->target);
+	if (repl)
+	{
+		mask = rule_mask(r);
+		replace_entries(r, buf, rule, mask);
+		free(mask);
+	}
 
-	rule = rule_build(r);
+	if (fw3_pr_debug)
+		rule_print(r, "-A", buf);
 
 #ifndef DISABLE_IPV6
 	if (r->h->family == FW3_FAMILY_V6)
 	{
-		if (repl)
-		{
-			mask = rule_mask(r);
-
-			while (ip6tc_delete_entry(buf, rule, mask, r->h->handle))
-				if (fw3_pr_debug)
-					rule_print(r, "-D", buf);
-
-			free(mask);
-		}
-
-		if (fw3_pr_debug)
-			rule_print(r, "-A", buf);
-
-		if (!ip6tc_append_entry(buf, rule, r->h->handle))
+		if (!(ok = ip6tc_append_entry(buf, rule, r->h->handle)))
 			warn("ip6tc_append_entry(): %s", ip6tc_strerror(errno));
 	}
 	else
 #endif
 	{
-		if (repl)
-		{
-			mask = rule_mask(r);
-
-			while (iptc_delete_entry(buf, rule, mask, r->h->handle))
-				if (fw3_pr_debug)
-					rule_print(r, "-D", buf);
-
-			free(mask);
-		}
-
-		if (fw3_pr_debug)
-			rule_print(r, "-A", buf);
-
-		if (!iptc_append_entry(buf, rule, r->h->handle))
+		if (!(ok = iptc_append_entry(buf, rule, r->h->handle)))
 			warn("iptc_append_entry(): %s\n", iptc_strerror(errno));
 	}
 
-	free(rule);
+	/* libiptc copies the entry, the index keeps ours for later replaces */
+	if (!ok || !index_append(r->h, buf, rule))
+		free(rule);
 
 free:
-	for (i = 1; i < r->argc; i++)
-		free(r->argv[i]);
-
-	free(r->argv);
-
-	xtables_rule_matches_free(&r->matches);
-
-	if (r->target)
-		free(r->target->t);
-
-	free(r);
-
-	/* reset all targets and matches */
-	for (em = xtables_matches; em; em = em->next)
-		em->mflags = 0;
-
-	for (et = xtables_targets; et; et = et->next)
-	{
-		et->tflags = 0;
-		et->used = 0;
-	}
-
-	xtables_free_opts(1);
+	rule_free(r, parse);
 }
 
 struct fw3_ipt_rule *
@@ -34,17 +34,47 @@ static inline void init_extensions6(void) { }
 extern int kernel_version;
 void get_kernel_version(void);
 
+struct fw3_ipt_index;
+struct fw3_ipt_snapshot;
+
+/* ports matched together by a single rule */
+struct fw3_port_group {
+	struct list_head list;
+	struct list_head ports;
+	int count;
+};
+
 struct fw3_ipt_handle {
 	enum fw3_family family;
 	enum fw3_table table;
 	void *handle;
+	struct fw3_ipt_index *index;
+	struct fw3_ipt_snapshot *snapshot;
+	struct avl_tree *kept;
+	struct avl_tree *created;
 };
 
 struct fw3_ipt_rule;
 
+enum fw3_ipt_ctstate
+{
+	FW3_CTSTATE_INVALID     = (1 << 0),
+	FW3_CTSTATE_ESTABLISHED = (1 << 1),
+	FW3_CTSTATE_RELATED     = (1 << 2),
+	FW3_CTSTATE_NEW         = (1 << 3),
+	FW3_CTSTATE_UNTRACKED   = (1 << 4),
+	FW3_CTSTATE_SNAT        = (1 << 5),
+	FW3_CTSTATE_DNAT        = (1 << 6),
+};
+
+bool fw3_ipt_lock(void);
+void fw3_ipt_unlock(void);
+
 struct fw3_ipt_handle *fw3_ipt_open(enum fw3_family family,
                                     enum fw3_table table);
 
+void fw3_ipt_keep_chain(struct fw3_ipt_handle *h, const char *chain);
+
 void fw3_ipt_set_policy(struct fw3_ipt_handle *h, const char *chain,
                         enum fw3_flag policy);
 
@@ -53,19 +83,32 @@ void fw3_ipt_flush_chain(struct fw3_ipt_handle *h, const char *chain);
 void fw3_ipt_delete_chain(struct fw3_ipt_handle *h, bool if_unused,
                           const char *chain);
 
+/* prefix of the chains rules are factored into, see expand_rule() */
+#define FW3_RULE_CHAIN_PREFIX	"fw3r_"
+
+void fw3_ipt_delete_chains(struct fw3_ipt_handle *h, const char *prefix);
+
 void fw3_ipt_delete_id_rules(struct fw3_ipt_handle *h, const char *chain);
 
 void fw3_ipt_create_chain(struct fw3_ipt_handle *h, bool ignore_existing,
                           const char *chain);
+void fw3_ipt_create_custom_chain(struct fw3_ipt_handle *h,
+                                 bool ignore_existing, const char *chain);
 
 void fw3_ipt_flush(struct fw3_ipt_handle *h);
 
 void fw3_ipt_gc(struct fw3_ipt_handle *h);
 
+void fw3_ipt_snapshot(struct fw3_ipt_handle *h);
+
+void fw3_ipt_optimize(struct fw3_ipt_handle *h);
+
 void fw3_ipt_commit(struct fw3_ipt_handle *h);
 
 void fw3_ipt_close(struct fw3_ipt_handle *h);
 
+void fw3_ipt_flush_cache(void);
+
 struct fw3_ipt_rule *fw3_ipt_rule_new(struct fw3_ipt_handle *h);
 
 void fw3_ipt_rule_proto(struct fw3_ipt_rule *r, struct fw3_protocol *proto);
@@ -99,6 +142,28 @@ void fw3_ipt_rule_dscp(struct fw3_ipt_rule *r, struct fw3_dscp *dscp);
 
 void fw3_ipt_rule_comment(struct fw3_ipt_rule *r, const char *fmt, ...);
 
+void fw3_ipt_rule_multiport(struct fw3_ipt_rule *r,
+                            struct list_head *sports, struct list_head *dports);
+
+struct list_head * fw3_ipt_port_groups(struct list_head *ports);
+
+void fw3_ipt_free_port_groups(struct list_head *groups);
+
+void fw3_ipt_rule_port_groups(struct fw3_ipt_rule *r,
+                              struct fw3_port_group *sg,
+                              struct fw3_port_group *dg);
+
+void fw3_ipt_rule_ctstate(struct fw3_ipt_rule *r, bool inv, uint32_t states);
+
+void fw3_ipt_rule_target(struct fw3_ipt_rule *r, const char *fmt, ...);
+
+void fw3_ipt_rule_log(struct fw3_ipt_rule *r, const char *fmt, ...);
+
+void fw3_ipt_rule_reject(struct fw3_ipt_rule *r, enum fw3_reject_code code);
+
+void fw3_ipt_rule_nat(struct fw3_ipt_rule *r, enum fw3_flag target,
+                      struct fw3_address *addr, struct fw3_port *port);
+
 void fw3_ipt_rule_extra(struct fw3_ipt_rule *r, const char *extra);
 
 void fw3_ipt_rule_addarg(struct fw3_ipt_rule *r, bool inv,
@@ -120,17 +185,4 @@ void __fw3_ipt_rule_append(struct fw3_ipt_rule *r, bool repl,
 #define fw3_ipt_rule_replace(rule, ...) \
 	__fw3_ipt_rule_append(rule, true, __VA_ARGS__)
 
-static inline void
-fw3_ipt_rule_target(struct fw3_ipt_rule *r, const char *fmt, ...)
-{
-	va_list ap;
-	char buf[32];
-
-	va_start(ap, fmt);
-	vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
-	va_end(ap);
-
-	fw3_ipt_rule_addarg(r, false, "-j", buf);
-}
-
 #endif
@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "options.h"
 #include "defaults.h"
@@ -31,6 +32,8 @@
 #include "ubus.h"
 #include "iptables.h"
 #include "helpers.h"
+#include "statefile.h"
+#include "cache.h"
 
 
 static enum fw3_family print_family = FW3_FAMILY_ANY;
@@ -39,11 +42,22 @@ static struct fw3_state *run_state = NULL;
 static struct fw3_state *cfg_state = NULL;
 
 
+static int64_t
+monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static bool
 build_state(bool runtime)
 {
 	struct fw3_state *state = NULL;
 	struct uci_package *p = NULL;
+	struct fw3_cache_key key;
 	FILE *sf;
 
 	state = calloc(1, sizeof(*state));
@@ -57,6 +71,13 @@ build_state(bool runtime)
 
 	if (runtime)
 	{
+		if (fw3_read_statefile(state))
+		{
+			run_state = state;
+			return true;
+		}
+
+		/* fall back to the UCI state written by former versions */
 		sf = fopen(FW3_STATEFILE, "r");
 
 		if (sf)
@@ -82,12 +103,6 @@ build_state(bool runtime)
 		if (!fw3_ubus_connect())
 			warn("Failed to connect to ubus");
 
-		if (uci_load(state->uci, "firewall", &p))
-		{
-			uci_perror(state->uci, NULL);
-			error("Failed to load /etc/config/firewall");
-		}
-
 		if (!fw3_find_command("ipset"))
 		{
 			warn("Unable to locate ipset utility, disabling ipset support");
@@ -95,6 +110,21 @@ build_state(bool runtime)
 		}
 
 		cfg_state = state;
+
+		/* unchanged inputs yield the very same validated state */
+		fw3_cache_key(state, &key);
+
+		if (fw3_cache_load(state, &key))
+		{
+			fw3_auto_ipsets(state);
+			return true;
+		}
+
+		if (uci_load(state->uci, "firewall", &p))
+		{
+			uci_perror(state->uci, NULL);
+			error("Failed to load /etc/config/firewall");
+		}
 	}
 
 
@@ -111,9 +141,56 @@ build_state(bool runtime)
 	fw3_load_forwards(state, p, b.head);
 	fw3_load_includes(state, p, b.head);
 
+	if (!runtime)
+	{
+		fw3_digest_zones(state);
+		fw3_cache_save(state, &key);
+		fw3_auto_ipsets(state);
+	}
+
 	return true;
 }
 
+/* Lookups only need the zone sections, the ubus interface dump is only
+ * required to resolve zone networks to devices. */
+static void
+build_zone_state(bool devices)
+{
+	struct fw3_state *state;
+	struct uci_package *p = NULL;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		error("Out of memory");
+
+	state->uci = uci_alloc_context();
+
+	if (!state->uci)
+		error("Out of memory");
+
+	if (devices && !fw3_ubus_connect())
+		warn("Failed to connect to ubus");
+
+	if (uci_load(state->uci, "firewall", &p))
+	{
+		uci_perror(state->uci, NULL);
+		error("Failed to load /etc/config/firewall");
+	}
+
+	INIT_LIST_HEAD(&state->rules);
+	INIT_LIST_HEAD(&state->redirects);
+	INIT_LIST_HEAD(&state->snats);
+	INIT_LIST_HEAD(&state->forwards);
+	INIT_LIST_HEAD(&state->ipsets);
+	INIT_LIST_HEAD(&state->includes);
+	INIT_LIST_HEAD(&state->cthelpers);
+
+	fw3_load_defaults(state, p);
+	fw3_load_zones(state, p);
+
+	cfg_state = state;
+}
+
 static void
 free_state(struct fw3_state *state)
 {
@@ -144,10 +221,13 @@ free_state(struct fw3_state *state)
 		fw3_free_cthelper((struct fw3_cthelper *)cur);
 
 	uci_free_context(state->uci);
+	fw3_unmap_statefile(state);
 
-	free(state);
+	/* ubus data belongs to the configuration state */
+	if (!state->statefile)
+		fw3_ubus_disconnect();
 
-	fw3_ubus_disconnect();
+	free(state);
 }
 
 
@@ -188,6 +268,8 @@ stop(bool complete)
 	if (!print_family && run_state)
 		fw3_hotplug_zones(run_state, false);
 
+	fw3_ipt_lock();
+
 	for (family = FW3_FAMILY_V4; family <= FW3_FAMILY_V6; family++)
 	{
 		if (!complete && !family_running(family))
@@ -221,6 +303,8 @@ stop(bool complete)
 		rv = 0;
 	}
 
+	fw3_ipt_unlock();
+
 	if (run_state) {
 		for (family = FW3_FAMILY_V4; family <= FW3_FAMILY_V6; family++)
 			fw3_destroy_ipsets(run_state, family, false);
@@ -243,6 +327,8 @@ start(void)
 	enum fw3_table table;
 	struct fw3_ipt_handle *handle;
 
+	fw3_ipt_lock();
+
 	for (family = FW3_FAMILY_V4; family <= FW3_FAMILY_V6; family++)
 	{
 		if (!print_family)
@@ -282,13 +368,23 @@ start(void)
 			fw3_print_default_tail_rules(handle, cfg_state, false);
 
 			if (!print_family)
+			{
+				if (cfg_state->defaults.optimize_rules)
+					fw3_ipt_optimize(handle);
+
 				fw3_ipt_commit(handle);
+			}
 
 			fw3_ipt_close(handle);
 		}
 
+		/* iptables-restore includes take the xtables lock themselves */
 		if (!print_family)
+		{
+			fw3_ipt_unlock();
 			fw3_print_includes(cfg_state, family, false);
+			fw3_ipt_lock();
+		}
 
 		family_set(run_state, family, true);
 		family_set(cfg_state, family, true);
@@ -296,6 +392,8 @@ start(void)
 		rv = 0;
 	}
 
+	fw3_ipt_unlock();
+
 	if (!rv)
 	{
 		fw3_flush_conntrack(run_state);
@@ -313,10 +411,41 @@ start(void)
 }
 
 
+static void
+clear_family(enum fw3_family family)
+{
+	enum fw3_table table;
+	struct fw3_ipt_handle *handle;
+
+	for (table = FW3_TABLE_FILTER; table <= FW3_TABLE_RAW; table++)
+	{
+		if (!(handle = fw3_ipt_open(family, table)))
+			continue;
+
+		info(" * Clearing %s %s table",
+		     fw3_flag_names[family], fw3_flag_names[table]);
+
+		fw3_flush_rules(handle, run_state, true);
+		fw3_flush_zones(handle, run_state, true);
+		fw3_ipt_commit(handle);
+		fw3_ipt_close(handle);
+	}
+
+	fw3_destroy_ipsets(run_state, family, true);
+
+	family_set(run_state, family, false);
+	family_set(cfg_state, family, false);
+}
+
+/* Every table is cleared and repopulated through the same handle and
+ * committed once, so the kernel never sees the flushed ruleset. The commit
+ * replaces the whole table in one step and leaves conntrack alone, packets
+ * see either the complete old or the complete new ruleset. */
 static int
 reload(void)
 {
 	int rv = 1;
+	bool running, enabled;
 	enum fw3_family family;
 	enum fw3_table table;
 	struct fw3_ipt_handle *handle;
@@ -326,60 +455,84 @@ reload(void)
 
 	fw3_hotplug_zones(run_state, false);
 
+	fw3_compare_zones(cfg_state, run_state);
+
+	fw3_ipt_lock();
+
 	for (family = FW3_FAMILY_V4; family <= FW3_FAMILY_V6; family++)
 	{
-		if (!family_running(family))
-			goto start;
-
-		for (table = FW3_TABLE_FILTER; table <= FW3_TABLE_RAW; table++)
-		{
-			if (!(handle = fw3_ipt_open(family, table)))
-				continue;
+		running = family_running(family);
+		enabled = !(family == FW3_FAMILY_V6 && cfg_state->defaults.disable_ipv6);
 
-			info(" * Clearing %s %s table",
-			     fw3_flag_names[family], fw3_flag_names[table]);
+		if (!running && !enabled)
+			continue;
 
-			fw3_flush_rules(handle, run_state, true);
-			fw3_flush_zones(handle, run_state, true);
-			fw3_ipt_commit(handle);
-			fw3_ipt_close(handle);
+		/* sets whose definition changed cannot be replaced while the
+		 * live rules use them, clear the tables before as stop did */
+		if (running &&
+		    fw3_ipsets_update_run_state(family, run_state, cfg_state))
+		{
+			clear_family(family);
+			running = false;
 		}
 
-		fw3_ipsets_update_run_state(family, run_state, cfg_state);
-		fw3_destroy_ipsets(run_state, family, true);
-
-		family_set(run_state, family, false);
-		family_set(cfg_state, family, false);
-
-start:
-		if (family == FW3_FAMILY_V6 && cfg_state->defaults.disable_ipv6)
-			continue;
-
-		fw3_create_ipsets(cfg_state, family, true);
+		if (enabled)
+			fw3_create_ipsets(cfg_state, family, true);
 
 		for (table = FW3_TABLE_FILTER; table <= FW3_TABLE_RAW; table++)
 		{
 			if (!(handle = fw3_ipt_open(family, table)))
 				continue;
 
-			info(" * Populating %s %s table",
+			info(" * %s %s %s table",
+			     !running ? "Populating" : enabled ? "Reloading" : "Clearing",
 			     fw3_flag_names[family], fw3_flag_names[table]);
 
-			fw3_print_default_chains(handle, cfg_state, true);
-			fw3_print_zone_chains(handle, cfg_state, true);
-			fw3_print_default_head_rules(handle, cfg_state, true);
-			fw3_print_rules(handle, cfg_state);
-			fw3_print_redirects(handle, cfg_state);
-			fw3_print_snats(handle, cfg_state);
-			fw3_print_forwards(handle, cfg_state);
-			fw3_print_zone_rules(handle, cfg_state, true);
-			fw3_print_default_tail_rules(handle, cfg_state, true);
+			if (running)
+			{
+				if (enabled)
+					fw3_keep_zone_chains(handle, cfg_state);
+
+				fw3_ipt_snapshot(handle);
+				fw3_flush_rules(handle, run_state, true);
+				fw3_flush_zones(handle, run_state, true);
+			}
+
+			if (enabled)
+			{
+				fw3_print_default_chains(handle, cfg_state, true);
+				fw3_print_zone_chains(handle, cfg_state, true);
+				fw3_print_default_head_rules(handle, cfg_state, true);
+				fw3_print_rules(handle, cfg_state);
+				fw3_print_redirects(handle, cfg_state);
+				fw3_print_snats(handle, cfg_state);
+				fw3_print_forwards(handle, cfg_state);
+				fw3_print_zone_rules(handle, cfg_state, true);
+				fw3_print_default_tail_rules(handle, cfg_state, true);
+
+				if (cfg_state->defaults.optimize_rules)
+					fw3_ipt_optimize(handle);
+			}
 
 			fw3_ipt_commit(handle);
 			fw3_ipt_close(handle);
 		}
 
+		/* stale sets are only unreferenced after the commit */
+		if (running)
+		{
+			fw3_destroy_ipsets(run_state, family, true);
+
+			family_set(run_state, family, false);
+			family_set(cfg_state, family, false);
+		}
+
+		if (!enabled)
+			continue;
+
+		fw3_ipt_unlock();
 		fw3_print_includes(cfg_state, family, true);
+		fw3_ipt_lock();
 
 		family_set(run_state, family, true);
 		family_set(cfg_state, family, true);
@@ -387,6 +540,8 @@ start:
 		rv = 0;
 	}
 
+	fw3_ipt_unlock();
+
 	if (!rv)
 	{
 		fw3_flush_conntrack(run_state);
@@ -407,6 +562,8 @@ gc(void)
 	enum fw3_table table;
 	struct fw3_ipt_handle *handle;
 
+	fw3_ipt_lock();
+
 	for (family = FW3_FAMILY_V4; family <= FW3_FAMILY_V6; family++)
 	{
 		if (family == FW3_FAMILY_V6 && cfg_state->defaults.disable_ipv6)
@@ -423,6 +580,8 @@ gc(void)
 		}
 	}
 
+	fw3_ipt_unlock();
+
 	return 0;
 }
 
@@ -497,11 +656,265 @@ lookup_zone(const char *zone, const char *device)
 	return 1;
 }
 
+#define FW3_DAEMON_DELAY	250
+#define FW3_COALESCE_QUIET	200
+
+static int coalesce_max_delay = 2000;
+
+static void
+refresh_state(bool runtime)
+{
+	struct fw3_state **state = runtime ? &run_state : &cfg_state;
+
+	if (*state)
+		free_state(*state);
+
+	*state = NULL;
+	build_state(runtime);
+}
+
+/* Wait until no further reload requests arrive for a quiet period, but
+ * no longer than the configured maximum delay. */
+static void
+coalesce_wait(void)
+{
+	int waited = 0;
+	off_t last = -1, cur;
+
+	while (waited < coalesce_max_delay &&
+	       (cur = fw3_reload_requests()) != last)
+	{
+		last = cur;
+		usleep(FW3_COALESCE_QUIET * 1000);
+		waited += FW3_COALESCE_QUIET;
+	}
+}
+
+/* Record a reload request and wait for the lock. Coalesced runs clear the
+ * recorded requests before they read the state, so an empty request file
+ * means whoever held the lock has served us meanwhile. Having to wait means
+ * a burst is going on, so let it settle before running again. */
+static int
+reload_coalesced(void)
+{
+	int rv;
+	bool waited = false;
+
+	fw3_request_reload();
+
+	if (!fw3_trylock())
+	{
+		if (!fw3_lock())
+			return 1;
+
+		waited = true;
+	}
+
+	if (!fw3_reload_requests())
+	{
+		info(" * Reload request served by a concurrent run");
+		fw3_unlock();
+		return 0;
+	}
+
+	if (waited)
+		coalesce_wait();
+
+	/* requests recorded from now on need another run */
+	fw3_clear_reload_requests();
+
+	refresh_state(false);
+	refresh_state(true);
+
+	rv = reload();
+
+	fw3_unlock();
+
+	return rv;
+}
+
+struct daemon_request {
+	struct list_head list;
+	struct ubus_request_data req;
+};
+
+static struct ubus_context *daemon_ctx;
+static struct uloop_timeout daemon_timer;
+static LIST_HEAD(daemon_requests);
+
+/* Rebuild the configuration state, apply it against the resident runtime
+ * state and keep the result resident for the next run. */
+static int
+daemon_reload(void)
+{
+	int rv = 1;
+
+	uloop_timeout_cancel(&daemon_timer);
+
+	if (!fw3_lock())
+		return rv;
+
+	refresh_state(false);
+
+	rv = reload();
+
+	/* parsed fragments of the old configuration are unlikely to recur */
+	fw3_ipt_flush_cache();
+
+	refresh_state(true);
+
+	fw3_unlock();
+
+	return rv;
+}
+
+/* Answer the reload calls waiting for this run with its result. */
+static void
+daemon_timer_cb(struct uloop_timeout *t)
+{
+	struct daemon_request *dr, *tmp;
+	int rv = daemon_reload();
+
+	list_for_each_entry_safe(dr, tmp, &daemon_requests, list)
+	{
+		ubus_complete_deferred_request(daemon_ctx, &dr->req,
+			rv ? UBUS_STATUS_UNKNOWN_ERROR : UBUS_STATUS_OK);
+
+		list_del(&dr->list);
+		free(dr);
+	}
+}
+
+/* Push the reload back with every request, up to the maximum delay. */
+static void
+daemon_schedule(void)
+{
+	static int64_t deadline;
+	int64_t now = monotonic_us() / 1000;
+
+	if (!daemon_timer.pending)
+		deadline = now + coalesce_max_delay;
+
+	if (deadline - now > FW3_DAEMON_DELAY)
+		uloop_timeout_set(&daemon_timer, FW3_DAEMON_DELAY);
+	else
+		uloop_timeout_set(&daemon_timer, deadline > now ? deadline - now : 0);
+}
+
+static void
+daemon_event_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+                const char *type, struct blob_attr *msg)
+{
+	static const struct blobmsg_policy policy = { "package", BLOBMSG_TYPE_STRING };
+	struct blob_attr *pkg;
+
+	if (!strcmp(type, "config.change"))
+	{
+		blobmsg_parse(&policy, 1, &pkg, blob_data(msg), blob_len(msg));
+
+		if (!pkg || strcmp(blobmsg_get_string(pkg), "firewall"))
+			return;
+	}
+
+	daemon_schedule();
+}
+
+static int
+daemon_rpc_reload(struct ubus_context *ctx, struct ubus_object *obj,
+                  struct ubus_request_data *req, const char *method,
+                  struct blob_attr *msg)
+{
+	struct daemon_request *dr = calloc(1, sizeof(*dr));
+
+	if (!dr)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	/* answered from the timer, so bursts of calls share one run */
+	ubus_defer_request(ctx, req, &dr->req);
+	list_add_tail(&dr->list, &daemon_requests);
+
+	daemon_schedule();
+
+	return UBUS_STATUS_OK;
+}
+
+static const struct ubus_method daemon_methods[] = {
+	UBUS_METHOD_NOARG("reload", daemon_rpc_reload),
+};
+
+static struct ubus_object_type daemon_type =
+	UBUS_OBJECT_TYPE(FW3_UBUS_OBJECT, daemon_methods);
+
+static struct ubus_object daemon_obj = {
+	.name = FW3_UBUS_OBJECT,
+	.type = &daemon_type,
+	.methods = daemon_methods,
+	.n_methods = ARRAY_SIZE(daemon_methods),
+};
+
+static struct ubus_event_handler daemon_iface_ev = { .cb = daemon_event_cb };
+static struct ubus_event_handler daemon_config_ev = { .cb = daemon_event_cb };
+
+static int
+daemon_run(void)
+{
+	struct ubus_context *ctx;
+
+	uloop_init();
+
+	if (!(daemon_ctx = ctx = ubus_connect(NULL)))
+	{
+		warn("Failed to connect to ubus");
+		return 1;
+	}
+
+	ubus_add_uloop(ctx);
+
+	if (ubus_add_object(ctx, &daemon_obj) ||
+	    ubus_register_event_handler(ctx, &daemon_iface_ev, "network.interface") ||
+	    ubus_register_event_handler(ctx, &daemon_config_ev, "config.change"))
+	{
+		warn("Failed to register ubus object");
+		ubus_free(ctx);
+		return 1;
+	}
+
+	if (fw3_lock())
+	{
+		build_state(true);
+		fw3_unlock();
+	}
+
+	/* apply the current configuration first */
+	daemon_timer.cb = daemon_timer_cb;
+	uloop_timeout_set(&daemon_timer, 0);
+
+	uloop_run();
+
+	ubus_free(ctx);
+	uloop_done();
+
+	return 0;
+}
+
+static void
+print_elapsed(const char *what, int64_t t0)
+{
+	int64_t us = monotonic_us() - t0;
+
+	info(" * Loaded %s state in %u.%03u ms", what,
+	     (unsigned int)(us / 1000), (unsigned int)(us % 1000));
+}
+
 static int
 usage(void)
 {
 	fprintf(stderr, "fw3 [-4] [-6] [-q] print\n");
 	fprintf(stderr, "fw3 [-q] {start|stop|flush|reload|restart}\n");
+	fprintf(stderr, "fw3 [-q] -c {max-delay-ms} reload\n");
+	fprintf(stderr, "fw3 [-q] -t {ubus-timeout} {start|reload|restart|daemon}\n");
+	fprintf(stderr, "fw3 [-q] daemon\n");
+	fprintf(stderr, "fw3 [-q] state\n");
 	fprintf(stderr, "fw3 [-q] network {net}\n");
 	fprintf(stderr, "fw3 [-q] device {dev}\n");
 	fprintf(stderr, "fw3 [-q] zone {zone} [dev]\n");
@@ -513,23 +926,50 @@ usage(void)
 int main(int argc, char **argv)
 {
 	int ch, rv = 1;
+	char *end;
+	bool coalesce = false, forward = true;
+	int64_t t0;
 	enum fw3_family family = FW3_FAMILY_ANY;
 	struct fw3_defaults *defs = NULL;
 
-	while ((ch = getopt(argc, argv, "46dqh")) != -1)
+	while ((ch = getopt(argc, argv, "46c:dqt:h")) != -1)
 	{
 		switch (ch)
 		{
 		case '4':
 			family = FW3_FAMILY_V4;
+			forward = false;
 			break;
 
 		case '6':
 			family = FW3_FAMILY_V6;
+			forward = false;
+			break;
+
+		case 'c':
+			coalesce = true;
+			forward = false;
+			coalesce_max_delay = strtol(optarg, &end, 10);
+
+			if (*end || coalesce_max_delay <= 0)
+			{
+				warn("Invalid coalesce delay '%s'", optarg);
+				rv = usage();
+				goto out;
+			}
 			break;
 
 		case 'd':
 			fw3_pr_debug = true;
+			forward = false;
+			break;
+
+		case 't':
+			forward = false;
+			fw3_ubus_timeout = strtol(optarg, NULL, 10);
+
+			if (fw3_ubus_timeout <= 0)
+				fw3_ubus_timeout = FW3_UBUS_TIMEOUT;
 			break;
 
 		case 'q':
@@ -542,7 +982,46 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* let a resident daemon do the work if there is one, it knows nothing
+	 * of the options though */
+	if (forward && optind < argc && !strcmp(argv[optind], "reload") &&
+	    fw3_ubus_daemon_call("reload", &rv))
+		goto out;
+
+	/* waiting requests do not even need to look at the configuration */
+	if (coalesce && optind < argc && !strcmp(argv[optind], "reload"))
+	{
+		rv = reload_coalesced();
+		goto out;
+	}
+
+	/* lookups are frequently called from hotplug, keep them lean */
+	if ((optind + 1) < argc &&
+	    (!strcmp(argv[optind], "network") || !strcmp(argv[optind], "device") ||
+	     !strcmp(argv[optind], "zone")))
+	{
+		t0 = monotonic_us();
+		build_zone_state(strcmp(argv[optind], "network"));
+
+		if (fw3_pr_debug)
+			print_elapsed("zone", t0);
+
+		if (!strcmp(argv[optind], "network"))
+			rv = lookup_network(argv[optind + 1]);
+		else if (!strcmp(argv[optind], "device"))
+			rv = lookup_device(argv[optind + 1]);
+		else
+			rv = lookup_zone(argv[optind + 1], argv[optind + 2]);
+
+		goto out;
+	}
+
+	t0 = monotonic_us();
 	build_state(false);
+
+	if (fw3_pr_debug)
+		print_elapsed("configuration", t0);
+
 	defs = &cfg_state->defaults;
 
 	if (optind >= argc)
@@ -626,25 +1105,25 @@ int main(int argc, char **argv)
 			fw3_unlock();
 		}
 	}
-	else if (!strcmp(argv[optind], "gc"))
+	else if (!strcmp(argv[optind], "state"))
 	{
-		if (fw3_lock())
+		if (build_state(true))
 		{
-			rv = gc();
-			fw3_unlock();
+			fw3_export_statefile(run_state, stdout);
+			rv = 0;
 		}
 	}
-	else if (!strcmp(argv[optind], "network") && (optind + 1) < argc)
+	else if (!strcmp(argv[optind], "daemon"))
 	{
-		rv = lookup_network(argv[optind + 1]);
+		rv = daemon_run();
 	}
-	else if (!strcmp(argv[optind], "device") && (optind + 1) < argc)
-	{
-		rv = lookup_device(argv[optind + 1]);
-	}
-	else if (!strcmp(argv[optind], "zone") && (optind + 1) < argc)
+	else if (!strcmp(argv[optind], "gc"))
 	{
-		rv = lookup_zone(argv[optind + 1], argv[optind + 2]);
+		if (fw3_lock())
+		{
+			rv = gc();
+			fw3_unlock();
+		}
 	}
 	else
 	{
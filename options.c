@@ -1240,6 +1240,39 @@ fw3_parse_blob_options(void *s, const struct fw3_option *opts,
 	return valid;
 }
 
+/* content hashes used to detect unchanged sections across reloads */
+uint32_t
+fw3_hash_section(struct uci_section *s)
+{
+	uint32_t hv = FW3_HASH_INIT;
+	struct uci_element *e, *l;
+	struct uci_option *o;
+
+	uci_foreach_element(&s->options, e)
+	{
+		o = uci_to_option(e);
+		hv = fw3_hash(hv, e->name, strlen(e->name) + 1);
+
+		if (o->type == UCI_TYPE_LIST)
+		{
+			uci_foreach_element(&o->v.list, l)
+				hv = fw3_hash(hv, l->name, strlen(l->name) + 1);
+		}
+		else
+		{
+			hv = fw3_hash(hv, o->v.string, strlen(o->v.string) + 1);
+		}
+	}
+
+	return hv;
+}
+
+uint32_t
+fw3_hash_blob(struct blob_attr *a)
+{
+	return fw3_hash(FW3_HASH_INIT, blob_data(a), blob_len(a));
+}
+
 
 const char *
 fw3_address_to_string(struct fw3_address *address, bool allow_invert, bool as_cidr)
@@ -42,6 +42,7 @@
 #include <uci.h>
 
 #include <libubox/list.h>
+#include <libubox/avl.h>
 #include <libubox/utils.h>
 #include <libubox/blobmsg.h>
 
@@ -310,15 +311,24 @@ struct fw3_defaults
 	bool auto_helper;
 	bool flow_offloading;
 	bool flow_offloading_hw;
+	int auto_ipset_threshold;
+	int subchain_threshold;
+	int expansion_limit;
+	bool optimize_rules;
+	int dispatch_threshold;
 
 	bool disable_ipv6;
 
 	uint32_t flags[2];
+
+	uint32_t hash;
+	uint32_t digest;
 };
 
 struct fw3_zone
 {
 	struct list_head list;
+	struct avl_node index;
 
 	bool enabled;
 	const char *name;
@@ -354,6 +364,10 @@ struct fw3_zone
 	uint32_t flags[2];
 
 	struct list_head old_addrs;
+
+	uint32_t hash;
+	uint32_t digest;
+	bool unchanged;
 };
 
 struct fw3_rule
@@ -362,6 +376,7 @@ struct fw3_rule
 
 	bool enabled;
 	const char *name;
+	uint32_t hash;
 
 	enum fw3_family family;
 
@@ -399,6 +414,11 @@ struct fw3_rule
 	struct fw3_cthelpermatch set_helper;
 
 	const char *extra;
+
+	/* generated sets matching long address and mac lists, per family */
+	struct fw3_ipset *auto_src[2];
+	struct fw3_ipset *auto_dest[2];
+	struct fw3_ipset *auto_mac[2];
 };
 
 struct fw3_redirect
@@ -407,6 +427,7 @@ struct fw3_redirect
 
 	bool enabled;
 	const char *name;
+	uint32_t hash;
 
 	enum fw3_family family;
 
@@ -450,6 +471,7 @@ struct fw3_snat
 
 	bool enabled;
 	const char *name;
+	uint32_t hash;
 
 	enum fw3_family family;
 
@@ -487,6 +509,7 @@ struct fw3_forward
 
 	bool enabled;
 	const char *name;
+	uint32_t hash;
 
 	enum fw3_family family;
 
@@ -500,6 +523,7 @@ struct fw3_forward
 struct fw3_ipset
 {
 	struct list_head list;
+	struct avl_node index;
 
 	bool enabled;
 	bool reload_set;
@@ -527,6 +551,8 @@ struct fw3_ipset
 	const char *loadfile;
 
 	uint32_t flags[2];
+
+	uint32_t hash;
 };
 
 struct fw3_include
@@ -546,6 +572,7 @@ struct fw3_include
 struct fw3_cthelper
 {
 	struct list_head list;
+	struct avl_node index;
 
 	bool enabled;
 	const char *name;
@@ -575,8 +602,17 @@ struct fw3_state
 	struct list_head includes;
 	struct list_head cthelpers;
 
+	/* name indexes of the zone, ipset and cthelper lists */
+	struct avl_tree zone_index;
+	struct avl_tree ipset_index;
+	struct avl_tree cthelper_index;
+
 	bool disable_ipsets;
 	bool statefile;
+
+	/* mapped file the state was loaded from, if any */
+	void *statemap;
+	size_t statemap_size;
 };
 
 struct fw3_chain_spec {
@@ -639,6 +675,9 @@ bool fw3_parse_options(void *s, const struct fw3_option *opts,
 bool fw3_parse_blob_options(void *s, const struct fw3_option *opts,
                             struct blob_attr *a, const char *name);
 
+uint32_t fw3_hash_section(struct uci_section *s);
+uint32_t fw3_hash_blob(struct blob_attr *a);
+
 const char * fw3_address_to_string(struct fw3_address *address,
                                    bool allow_invert, bool as_cidr);
 
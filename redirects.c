@@ -404,6 +404,8 @@ fw3_load_redirects(struct fw3_state *state, struct uci_package *p,
 		if (!redir)
 			continue;
 
+		redir->hash = fw3_hash_blob(entry);
+
 		if (!fw3_parse_blob_options(redir, fw3_redirect_opts, entry, name))
 		{
 			warn_section("redirect", redir, NULL, "skipped due to invalid options");
@@ -430,6 +432,8 @@ fw3_load_redirects(struct fw3_state *state, struct uci_package *p,
 		if (!redir)
 			continue;
 
+		redir->hash = fw3_hash_section(s);
+
 		if (!fw3_parse_options(redir, fw3_redirect_opts, s))
 		{
 			warn_elem(e, "skipped due to invalid options");
@@ -473,57 +477,15 @@ set_redirect(struct fw3_ipt_rule *r, struct fw3_port *port)
 	}
 }
 
-static void
-set_snat_dnat(struct fw3_ipt_rule *r, enum fw3_flag target,
-              struct fw3_address *addr, struct fw3_port *port)
-{
-	char buf[sizeof("255.255.255.255:65535-65535")] = {};
-	char ip[INET_ADDRSTRLEN], *p = buf;
-	size_t rem = sizeof(buf);
-	int len;
-
-	if (addr && addr->set)
-	{
-		inet_ntop(AF_INET, &addr->address.v4, ip, sizeof(ip));
-
-		len = snprintf(p, rem, "%s", ip);
-
-		if (len < 0 || len >= rem)
-			return;
-
-		rem -= len;
-		p += len;
-	}
-
-	if (port && port->set)
-	{
-		if (port->port_min == port->port_max)
-			snprintf(p, rem, ":%u", port->port_min);
-		else
-			snprintf(p, rem, ":%u-%u", port->port_min, port->port_max);
-	}
-
-	if (target == FW3_FLAG_DNAT)
-	{
-		fw3_ipt_rule_target(r, "DNAT");
-		fw3_ipt_rule_addarg(r, false, "--to-destination", buf);
-	}
-	else
-	{
-		fw3_ipt_rule_target(r, "SNAT");
-		fw3_ipt_rule_addarg(r, false, "--to-source", buf);
-	}
-}
-
 static void
 set_target_nat(struct fw3_ipt_rule *r, struct fw3_redirect *redir)
 {
 	if (redir->local)
 		set_redirect(r, &redir->port_redir);
 	else if (redir->target == FW3_FLAG_DNAT)
-		set_snat_dnat(r, redir->target, &redir->ip_redir, &redir->port_redir);
+		fw3_ipt_rule_nat(r, redir->target, &redir->ip_redir, &redir->port_redir);
 	else
-		set_snat_dnat(r, redir->target, &redir->ip_dest, &redir->port_dest);
+		fw3_ipt_rule_nat(r, redir->target, &redir->ip_dest, &redir->port_dest);
 }
 
 static void
@@ -603,8 +565,7 @@ print_redirect(struct fw3_ipt_handle *h, struct fw3_state *state,
 			fw3_ipt_rule_limit(r, &redir->limit);
 			fw3_ipt_rule_time(r, &redir->time);
 			fw3_ipt_rule_mark(r, &redir->mark);
-			fw3_ipt_rule_addarg(r, false, "-m", "conntrack");
-			fw3_ipt_rule_addarg(r, false, "--ctstate", "DNAT");
+			fw3_ipt_rule_ctstate(r, false, FW3_CTSTATE_DNAT);
 			fw3_ipt_rule_target(r, "CT");
 			fw3_ipt_rule_addarg(r, false, "--helper", redir->helper.ptr->name);
 			set_comment(r, redir->name, num, "CT helper");
@@ -633,7 +594,7 @@ print_reflection(struct fw3_ipt_handle *h, struct fw3_state *state,
 		fw3_ipt_rule_limit(r, &redir->limit);
 		fw3_ipt_rule_time(r, &redir->time);
 		set_comment(r, redir->name, num, "reflection");
-		set_snat_dnat(r, FW3_FLAG_DNAT, &redir->ip_redir, &redir->port_redir);
+		fw3_ipt_rule_nat(r, FW3_FLAG_DNAT, &redir->ip_redir, &redir->port_redir);
 		fw3_ipt_rule_replace(r, "zone_%s_prerouting", rz->name);
 
 		r = fw3_ipt_rule_create(h, proto, NULL, NULL, ia, &redir->ip_redir);
@@ -641,7 +602,7 @@ print_reflection(struct fw3_ipt_handle *h, struct fw3_state *state,
 		fw3_ipt_rule_limit(r, &redir->limit);
 		fw3_ipt_rule_time(r, &redir->time);
 		set_comment(r, redir->name, num, "reflection");
-		set_snat_dnat(r, FW3_FLAG_SNAT, ra, NULL);
+		fw3_ipt_rule_nat(r, FW3_FLAG_SNAT, ra, NULL);
 		fw3_ipt_rule_replace(r, "zone_%s_postrouting", rz->name);
 		break;
 
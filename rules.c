@@ -253,6 +253,8 @@ fw3_load_rules(struct fw3_state *state, struct uci_package *p,
 		if (!(rule = alloc_rule(state)))
 			continue;
 
+		rule->hash = fw3_hash_blob(entry);
+
 		if (!fw3_parse_blob_options(rule, fw3_rule_opts, entry, name))
 		{
 			warn_section("rule", rule, NULL, "skipped due to invalid options");
@@ -274,6 +276,8 @@ fw3_load_rules(struct fw3_state *state, struct uci_package *p,
 		if (!(rule = alloc_rule(state)))
 			continue;
 
+		rule->hash = fw3_hash_section(s);
+
 		if (!fw3_parse_options(rule, fw3_rule_opts, s))
 		{
 			warn_elem(e, "skipped due to invalid options");
@@ -287,6 +291,130 @@ fw3_load_rules(struct fw3_state *state, struct uci_package *p,
 }
 
 
+/* value of a list entry for a set of the given family, "" for entries of
+ * another family and NULL for entries a set cannot stand in for */
+static const char *
+auto_ipset_value(struct list_head *cur, enum fw3_family family, bool mac)
+{
+	struct fw3_address *addr = (struct fw3_address *)cur;
+	struct fw3_mac *m = (struct fw3_mac *)cur;
+	union { struct in_addr v4; struct in6_addr v6; } mask;
+	static char buf[sizeof("00:00:00:00:00:00")];
+	uint8_t *b = m->mac.ether_addr_octet;
+	int bits;
+
+	/* ipset insists on two digits per octet, unlike ether_ntoa() */
+	if (mac)
+	{
+		if (!m->set || m->invert)
+			return NULL;
+
+		snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x",
+		         b[0], b[1], b[2], b[3], b[4], b[5]);
+
+		return buf;
+	}
+
+	if (!addr->set || addr->invert)
+		return NULL;
+
+	if (addr->family != family)
+		return "";
+
+	/* hash:net neither takes IPv6 ranges nor /0 or non-contiguous masks */
+	if (addr->range)
+		return (family == FW3_FAMILY_V4)
+			? fw3_address_to_string(addr, false, true) : NULL;
+
+	bits = fw3_netmask2bitlen(family, &addr->mask.v6);
+
+	if (bits <= 0 || !fw3_bitlen2netmask(family, bits, &mask) ||
+	    memcmp(&mask, &addr->mask, (family == FW3_FAMILY_V4)
+	                               ? sizeof(mask.v4) : sizeof(mask.v6)))
+		return NULL;
+
+	return fw3_address_to_string(addr, false, true);
+}
+
+static struct fw3_ipset *
+auto_ipset(struct fw3_state *state, struct list_head *list,
+           enum fw3_family family, bool mac)
+{
+	int n = 0;
+	uint32_t hv;
+	const char *v;
+	char name[sizeof(FW3_AUTO_IPSET_PREFIX "00000000")];
+	struct list_head *cur;
+	struct fw3_ipset *ipset;
+	enum fw3_ipset_type type = mac ? FW3_IPSET_TYPE_MAC : FW3_IPSET_TYPE_NET;
+
+	hv = fw3_hash(FW3_HASH_INIT, &family, sizeof(family));
+	hv = fw3_hash(hv, &type, sizeof(type));
+
+	list_for_each(cur, list)
+	{
+		if (!(v = auto_ipset_value(cur, family, mac)))
+			return NULL;
+
+		if (!*v)
+			continue;
+
+		hv = fw3_hash(hv, v, strlen(v) + 1);
+		n++;
+	}
+
+	if (n <= state->defaults.auto_ipset_threshold)
+		return NULL;
+
+	snprintf(name, sizeof(name), FW3_AUTO_IPSET_PREFIX "%08x", hv);
+
+	if (!(ipset = fw3_lookup_ipset(state, name)))
+	{
+		ipset = fw3_alloc_auto_ipset(state, family, type, hv);
+
+		list_for_each(cur, list)
+		{
+			v = auto_ipset_value(cur, family, mac);
+
+			if (*v)
+				fw3_add_auto_ipset_entry(ipset, v);
+		}
+	}
+
+	return ipset;
+}
+
+/* Replace address and mac lists longer than the configured threshold by
+ * generated sets, which are created, recorded and destroyed along with the
+ * configured ones. */
+void
+fw3_auto_ipsets(struct fw3_state *state)
+{
+	int i;
+	struct fw3_rule *rule;
+	enum fw3_family family;
+
+	if (state->disable_ipsets || state->defaults.auto_ipset_threshold <= 0)
+		return;
+
+	list_for_each_entry(rule, &state->rules, list)
+	{
+		for (family = FW3_FAMILY_V4; family <= FW3_FAMILY_V6; family++)
+		{
+			i = (family == FW3_FAMILY_V6);
+
+			rule->auto_src[i] = rule->auto_dest[i] = rule->auto_mac[i] = NULL;
+
+			if (!fw3_is_family(rule, family))
+				continue;
+
+			rule->auto_src[i] = auto_ipset(state, &rule->ip_src, family, false);
+			rule->auto_dest[i] = auto_ipset(state, &rule->ip_dest, family, false);
+			rule->auto_mac[i] = auto_ipset(state, &rule->mac_src, family, true);
+		}
+	}
+}
+
 static void
 append_chain(struct fw3_ipt_rule *r, struct fw3_rule *rule)
 {
@@ -418,8 +546,9 @@ static void
 print_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
            struct fw3_rule *rule, int num, struct fw3_protocol *proto,
            struct fw3_address *sip, struct fw3_address *dip,
-           struct fw3_port *sport, struct fw3_port *dport,
-           struct fw3_mac *mac, struct fw3_icmptype *icmptype)
+           struct fw3_port_group *sports, struct fw3_port_group *dports,
+           struct fw3_mac *mac, struct fw3_icmptype *icmptype,
+           struct fw3_setmatch *sets, const char *chain)
 {
 	struct fw3_ipt_rule *r;
 	struct fw3_device *idev, *odev;
@@ -489,11 +618,14 @@ print_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 	fw3_foreach(odev, odevices)
 	{
 		r = fw3_ipt_rule_create(handle, proto, idev, odev, sip, dip);
-		fw3_ipt_rule_sport_dport(r, sport, dport);
+		fw3_ipt_rule_port_groups(r, sports, dports);
 		fw3_ipt_rule_device(r, rule->device, rule->direction_out);
 		fw3_ipt_rule_icmptype(r, icmptype);
 		fw3_ipt_rule_mac(r, mac);
 		fw3_ipt_rule_ipset(r, &rule->ipset);
+		fw3_ipt_rule_ipset(r, &sets[0]);
+		fw3_ipt_rule_ipset(r, &sets[1]);
+		fw3_ipt_rule_ipset(r, &sets[2]);
 		fw3_ipt_rule_helper(r, &rule->helper);
 		fw3_ipt_rule_limit(r, &rule->limit);
 		fw3_ipt_rule_time(r, &rule->time);
@@ -502,6 +634,85 @@ print_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		set_target(r, rule);
 		fw3_ipt_rule_extra(r, rule->extra);
 		set_comment(r, rule->name, num);
+
+		if (chain)
+			fw3_ipt_rule_append(r, "%s", chain);
+		else
+			append_chain(r, rule);
+	}
+}
+
+/* match a generated set instead of the list it stands in for, as long as
+ * the set could be created */
+static struct list_head *
+auto_match(struct fw3_setmatch *m, struct fw3_ipset *ipset, const char *dir,
+           struct list_head *list, struct list_head *empty)
+{
+	struct list_head *cur;
+	int n = 0;
+
+	if (!ipset || !fw3_check_ipset(ipset))
+		return list;
+
+	list_for_each(cur, &ipset->entries)
+		n++;
+
+	info("     - Matching %d %s entries through ipset %s", n, dir, ipset->name);
+
+	set(ipset->flags, ipset->family, ipset->family);
+
+	m->set = true;
+	m->ptr = ipset;
+	m->dir[0] = dir;
+
+	return empty;
+}
+
+/* number of iterations fw3_foreach() makes over a list */
+static int
+foreach_count(struct list_head *list)
+{
+	int n = 0;
+	struct list_head *cur;
+
+	list_for_each(cur, list)
+		n++;
+
+	return n ? n : 1;
+}
+
+/* number of list entries of the handle family */
+static int
+family_count(struct fw3_ipt_handle *handle, struct list_head *list)
+{
+	int n = 0;
+	struct fw3_address *addr;
+
+	list_for_each_entry(addr, list, list)
+		if (fw3_is_family(addr, handle->family))
+			n++;
+
+	return n;
+}
+
+/* Jump to the sub-chain of a rule once per source address. The sub-chain
+ * holds the remaining matches, so |src| + |dest| rules are emitted instead
+ * of |src| * |dest|. */
+static void
+print_jumps(struct fw3_ipt_handle *handle, struct fw3_rule *rule, int num,
+            struct list_head *ip_src, const char *chain)
+{
+	struct fw3_ipt_rule *r;
+	struct fw3_address *sip;
+
+	list_for_each_entry(sip, ip_src, list)
+	{
+		if (!fw3_is_family(sip, handle->family))
+			continue;
+
+		r = fw3_ipt_rule_create(handle, NULL, NULL, NULL, sip, NULL);
+		fw3_ipt_rule_target(r, "%s", chain);
+		set_comment(r, rule->name, num);
 		append_chain(r, rule);
 	}
 }
@@ -513,14 +724,21 @@ expand_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 	struct fw3_protocol *proto;
 	struct fw3_address *sip;
 	struct fw3_address *dip;
-	struct fw3_port *sport;
-	struct fw3_port *dport;
+	struct fw3_port_group *sport;
+	struct fw3_port_group *dport;
 	struct fw3_mac *mac;
 	struct fw3_icmptype *icmptype;
 
 	struct list_head *sports = NULL;
 	struct list_head *dports = NULL;
 	struct list_head *icmptypes = NULL;
+	struct list_head *sgroups, *dgroups;
+	struct list_head *ip_src, *ip_dest, *mac_src;
+	struct fw3_setmatch sets[3] = { };
+	int i, before, after, nsrc, ndest, total;
+	char buf[32];
+	const char *chain = NULL;
+	uint32_t hash;
 
 	struct list_head empty;
 	INIT_LIST_HEAD(&empty);
@@ -578,6 +796,53 @@ expand_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		return;
 	}
 
+	i = (handle->family == FW3_FAMILY_V6);
+
+	ip_src = auto_match(&sets[0], rule->auto_src[i], "src", &rule->ip_src, &empty);
+	ip_dest = auto_match(&sets[1], rule->auto_dest[i], "dst", &rule->ip_dest, &empty);
+	mac_src = auto_match(&sets[2], rule->auto_mac[i], "src", &rule->mac_src, &empty);
+
+	/* port lists are matched in multiport groups rather than one by one */
+	sgroups = fw3_ipt_port_groups(&rule->port_src);
+	dgroups = fw3_ipt_port_groups(&rule->port_dest);
+
+	before = foreach_count(&rule->port_src) * foreach_count(&rule->port_dest);
+	after = foreach_count(sgroups) * foreach_count(dgroups);
+
+	if (after < before)
+		info("     - Folded %d port combinations into %d", before, after);
+
+	nsrc = family_count(handle, ip_src);
+	ndest = family_count(handle, ip_dest);
+	total = foreach_count(&rule->proto) * (nsrc ? nsrc : 1) *
+	        (ndest ? ndest : 1) * after * foreach_count(mac_src);
+
+	if (state->defaults.subchain_threshold > 0 && nsrc > 1 && ndest > 1 &&
+	    nsrc * ndest > state->defaults.subchain_threshold)
+	{
+		hash = fw3_hash(rule->hash, &num, sizeof(num));
+		snprintf(buf, sizeof(buf), FW3_RULE_CHAIN_PREFIX "%08x", hash);
+		chain = buf;
+
+		info("     - Factoring %d x %d addresses into chain %s",
+		     nsrc, ndest, chain);
+
+		fw3_ipt_create_chain(handle, true, chain);
+
+		total = total / nsrc + nsrc;
+	}
+
+	if (state->defaults.expansion_limit > 0 &&
+	    total > state->defaults.expansion_limit)
+	{
+		if (rule->name)
+			warn("Rule '%s' expands to %d iptables rules, more than %d",
+			     rule->name, total, state->defaults.expansion_limit);
+		else
+			warn("Rule #%u expands to %d iptables rules, more than %d",
+			     num, total, state->defaults.expansion_limit);
+	}
+
 	list_for_each_entry(proto, &rule->proto, list)
 	{
 		/* icmp / ipv6-icmp */
@@ -589,20 +854,39 @@ expand_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		}
 		else
 		{
-			sports = &rule->port_src;
-			dports = &rule->port_dest;
+			sports = sgroups;
+			dports = dgroups;
 			icmptypes = &empty;
 		}
 
-		fw3_foreach(sip, &rule->ip_src)
-		fw3_foreach(dip, &rule->ip_dest)
+		if (chain)
+		{
+			fw3_foreach(dip, ip_dest)
+			fw3_foreach(sport, sports)
+			fw3_foreach(dport, dports)
+			fw3_foreach(mac, mac_src)
+			fw3_foreach(icmptype, icmptypes)
+				print_rule(handle, state, rule, num, proto, NULL, dip,
+				           sport, dport, mac, icmptype, sets, chain);
+
+			continue;
+		}
+
+		fw3_foreach(sip, ip_src)
+		fw3_foreach(dip, ip_dest)
 		fw3_foreach(sport, sports)
 		fw3_foreach(dport, dports)
-		fw3_foreach(mac, &rule->mac_src)
+		fw3_foreach(mac, mac_src)
 		fw3_foreach(icmptype, icmptypes)
 			print_rule(handle, state, rule, num, proto, sip, dip,
-			           sport, dport, mac, icmptype);
+			           sport, dport, mac, icmptype, sets, NULL);
 	}
+
+	if (chain)
+		print_jumps(handle, rule, num, ip_src, chain);
+
+	fw3_ipt_free_port_groups(sgroups);
+	fw3_ipt_free_port_groups(dgroups);
 }
 
 void
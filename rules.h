@@ -29,6 +29,7 @@
 extern const struct fw3_option fw3_rule_opts[];
 
 void fw3_load_rules(struct fw3_state *state, struct uci_package *p, struct blob_attr *a);
+void fw3_auto_ipsets(struct fw3_state *state);
 void fw3_print_rules(struct fw3_ipt_handle *handle, struct fw3_state *state);
 
 static inline void fw3_free_rule(struct fw3_rule *rule)
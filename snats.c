@@ -218,6 +218,8 @@ fw3_load_snats(struct fw3_state *state, struct uci_package *p, struct blob_attr
 		if (!snat)
 			continue;
 
+		snat->hash = fw3_hash_blob(entry);
+
 		if (!fw3_parse_blob_options(snat, fw3_snat_opts, entry, name))
 		{
 			warn_section("nat", snat, NULL, "skipped due to invalid options");
@@ -240,6 +242,8 @@ fw3_load_snats(struct fw3_state *state, struct uci_package *p, struct blob_attr
 		if (!snat)
 			continue;
 
+		snat->hash = fw3_hash_section(s);
+
 		if (!fw3_parse_options(snat, fw3_snat_opts, s))
 		{
 			warn_elem(e, "skipped due to invalid options");
@@ -265,34 +269,15 @@ static void
 set_target(struct fw3_ipt_rule *r, struct fw3_snat *snat,
            struct fw3_protocol *proto)
 {
-	char buf[sizeof("255.255.255.255:65535-65535")] = {};
-	char ip[INET_ADDRSTRLEN], portcntbuf[6], *p = buf;
-	size_t rem = sizeof(buf);
-	int len;
+	char portcntbuf[6];
+	struct fw3_port *port = NULL;
 
 	if (snat->target == FW3_FLAG_SNAT)
 	{
-		if (snat->ip_snat.set)
-		{
-			inet_ntop(AF_INET, &snat->ip_snat.address.v4, ip, sizeof(ip));
-
-			len = snprintf(p, rem, "%s", ip);
-
-			if (len < 0 || len >= rem)
-				return;
-
-			rem -= len;
-			p += len;
-		}
-
 		if (snat->port_snat.set && proto && !proto->any &&
 		    (proto->protocol == 6 || proto->protocol == 17 || proto->protocol == 1))
 		{
-			if (snat->port_snat.port_min == snat->port_snat.port_max)
-				snprintf(p, rem, ":%u", snat->port_snat.port_min);
-			else
-				snprintf(p, rem, ":%u-%u",
-						 snat->port_snat.port_min, snat->port_snat.port_max);
+			port = &snat->port_snat;
 
 			if (snat->connlimit_ports) {
 				snprintf(portcntbuf, sizeof(portcntbuf), "%u",
@@ -304,8 +289,7 @@ set_target(struct fw3_ipt_rule *r, struct fw3_snat *snat,
 			}
 		}
 
-		fw3_ipt_rule_target(r, "SNAT");
-		fw3_ipt_rule_addarg(r, false, "--to-source", buf);
+		fw3_ipt_rule_nat(r, FW3_FLAG_SNAT, &snat->ip_snat, port);
 	}
 	else if (snat->target == FW3_FLAG_ACCEPT)
 	{
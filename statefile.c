@@ -0,0 +1,777 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
+
+#include "statefile.h"
+#include "zones.h"
+#include "ipsets.h"
+
+
+/*
+ * The state file consists of a header followed by the zone, ipset, device,
+ * address and datatype records and finally the string table. All records
+ * have a fixed size, lists are stored as index ranges into the record
+ * tables and strings as offsets into the string table, offset 0 being the
+ * NULL string. The checksum covers everything after the header.
+ */
+
+struct fw3_sf_address {
+	uint8_t family;
+	uint8_t range;
+	uint8_t invert;
+	uint8_t pad;
+	uint8_t address[16];
+	uint8_t mask[16];
+};
+
+struct fw3_sf_device {
+	uint32_t name;
+	uint32_t network;
+	uint8_t invert;
+	uint8_t any;
+	uint8_t pad[2];
+};
+
+struct fw3_sf_datatype {
+	uint8_t type;
+	uint8_t dst;
+	uint8_t pad[2];
+};
+
+struct fw3_sf_zone {
+	uint32_t name;
+	uint32_t extra_src;
+	uint32_t extra_dest;
+	uint8_t policy_input;
+	uint8_t policy_output;
+	uint8_t policy_forward;
+	uint8_t family;
+	uint8_t masq;
+	uint8_t mtu_fix;
+	uint8_t custom_chains;
+	uint8_t pad;
+	uint32_t flags[2];
+	uint32_t digest;
+	uint32_t devices, n_devices;
+	uint32_t subnets, n_subnets;
+	uint32_t addrs, n_addrs;
+};
+
+struct fw3_sf_ipset {
+	uint32_t name;
+	uint8_t family;
+	uint8_t method;
+	uint8_t has_iprange;
+	uint8_t has_portrange;
+	uint16_t port_min;
+	uint16_t port_max;
+	uint32_t datatypes, n_datatypes;
+	struct fw3_sf_address iprange;
+	uint8_t counters;
+	uint8_t comment;
+	uint8_t pad[2];
+	int32_t timeout;
+	int32_t netmask;
+	int32_t maxelem;
+	int32_t hashsize;
+};
+
+struct fw3_sf_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t hdrlen;
+	uint32_t size;
+	uint32_t crc;
+
+	uint8_t policy_input;
+	uint8_t policy_output;
+	uint8_t policy_forward;
+	uint8_t pad;
+	uint32_t flags[2];
+	uint32_t digest;
+
+	uint32_t n_zones;
+	uint32_t n_ipsets;
+	uint32_t n_devices;
+	uint32_t n_addrs;
+	uint32_t n_datatypes;
+	uint32_t n_strings;
+};
+
+struct fw3_sf_table {
+	char *data;
+	uint32_t n;
+	uint32_t size;
+	uint32_t alloc;
+};
+
+struct fw3_sf_string {
+	struct avl_node node;
+	uint32_t offset;
+	char str[];
+};
+
+struct fw3_sf_writer {
+	struct fw3_sf_table zones;
+	struct fw3_sf_table ipsets;
+	struct fw3_sf_table devices;
+	struct fw3_sf_table addrs;
+	struct fw3_sf_table datatypes;
+	struct fw3_sf_table strings;
+	struct avl_tree interned;
+};
+
+
+static uint32_t
+crc32(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t crc = ~0u;
+	int i;
+
+	while (len--)
+	{
+		crc ^= *p++;
+
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+static void *
+table_add(struct fw3_sf_table *t, const void *data, uint32_t n)
+{
+	void *p;
+
+	if (t->n + n > t->alloc)
+	{
+		while (t->n + n > t->alloc)
+			t->alloc = t->alloc ? t->alloc * 2 : 16;
+
+		t->data = realloc(t->data, (size_t)t->alloc * t->size);
+
+		if (!t->data)
+			error("Out of memory");
+	}
+
+	p = t->data + (size_t)t->n * t->size;
+
+	if (data)
+		memcpy(p, data, (size_t)n * t->size);
+	else
+		memset(p, 0, (size_t)n * t->size);
+
+	t->n += n;
+
+	return p;
+}
+
+static uint32_t
+intern(struct fw3_sf_writer *w, const char *s)
+{
+	struct fw3_sf_string *e;
+
+	if (!s)
+		return 0;
+
+	e = avl_find_element(&w->interned, s, e, node);
+
+	if (e)
+		return e->offset;
+
+	e = fw3_alloc(sizeof(*e) + strlen(s) + 1);
+	strcpy(e->str, s);
+	e->node.key = e->str;
+	e->offset = w->strings.n;
+
+	avl_insert(&w->interned, &e->node);
+	table_add(&w->strings, s, strlen(s) + 1);
+
+	return e->offset;
+}
+
+static void
+put_address(struct fw3_sf_address *a, struct fw3_address *addr)
+{
+	a->family = addr->family;
+	a->range  = addr->range;
+	a->invert = addr->invert;
+
+	memcpy(a->address, &addr->address.v6, sizeof(a->address));
+	memcpy(a->mask, &addr->mask.v6, sizeof(a->mask));
+}
+
+static void
+put_ifaddrs(struct fw3_sf_writer *w, struct fw3_sf_zone *z,
+            struct fw3_device *dev, struct ifaddrs *ifaddr)
+{
+	struct ifaddrs *ifa;
+	struct fw3_address addr = { .set = true };
+
+	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next)
+	{
+		if (!ifa->ifa_addr || strcmp(dev->name, ifa->ifa_name))
+			continue;
+
+		memset(&addr.address, 0, sizeof(addr.address));
+		memset(&addr.mask, 0xff, sizeof(addr.mask));
+
+		if (ifa->ifa_addr->sa_family == AF_INET)
+		{
+			addr.family = FW3_FAMILY_V4;
+			addr.address.v4 = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+		}
+		else if (ifa->ifa_addr->sa_family == AF_INET6)
+		{
+			addr.family = FW3_FAMILY_V6;
+			addr.address.v6 = ((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+		}
+		else
+		{
+			continue;
+		}
+
+		put_address(table_add(&w->addrs, NULL, 1), &addr);
+		z->n_addrs++;
+	}
+}
+
+static void
+put_zone(struct fw3_sf_writer *w, struct fw3_zone *zone,
+         struct ifaddrs *ifaddr)
+{
+	struct fw3_sf_zone z = { };
+	struct fw3_sf_device *d;
+	struct fw3_device *dev;
+	struct fw3_address *sub;
+
+	if (!zone->enabled)
+		return;
+
+	if (fw3_no_table(zone->flags[0]) && !fw3_no_table(zone->flags[1]))
+		z.family = FW3_FAMILY_V6;
+	else if (!fw3_no_table(zone->flags[0]) && fw3_no_table(zone->flags[1]))
+		z.family = FW3_FAMILY_V4;
+	else if (fw3_no_table(zone->flags[0]) && fw3_no_table(zone->flags[1]))
+		return;
+
+	z.name           = intern(w, zone->name);
+	z.extra_src      = intern(w, zone->extra_src);
+	z.extra_dest     = intern(w, zone->extra_dest);
+	z.policy_input   = zone->policy_input;
+	z.policy_output  = zone->policy_output;
+	z.policy_forward = zone->policy_forward;
+	z.masq           = zone->masq;
+	z.mtu_fix        = zone->mtu_fix;
+	z.custom_chains  = zone->custom_chains;
+	z.flags[0]       = zone->flags[0];
+	z.flags[1]       = zone->flags[1];
+	z.digest         = zone->digest;
+
+	z.devices = w->devices.n;
+
+	list_for_each_entry(dev, &zone->devices, list)
+	{
+		d = table_add(&w->devices, NULL, 1);
+		d->name    = intern(w, dev->name);
+		d->network = intern(w, dev->network);
+		d->invert  = dev->invert;
+		d->any     = dev->any;
+		z.n_devices++;
+	}
+
+	z.subnets = w->addrs.n;
+
+	list_for_each_entry(sub, &zone->subnets, list)
+	{
+		put_address(table_add(&w->addrs, NULL, 1), sub);
+		z.n_subnets++;
+	}
+
+	z.addrs = w->addrs.n;
+
+	list_for_each_entry(dev, &zone->devices, list)
+		put_ifaddrs(w, &z, dev, ifaddr);
+
+	table_add(&w->zones, &z, 1);
+}
+
+static void
+put_ipset(struct fw3_sf_writer *w, struct fw3_ipset *ipset)
+{
+	struct fw3_sf_ipset s = { };
+	struct fw3_sf_datatype *t;
+	struct fw3_ipset_datatype *type;
+
+	if (!ipset->enabled || ipset->external)
+		return;
+
+	s.name   = intern(w, ipset->name);
+	s.family = ipset->family;
+	s.method = ipset->method;
+
+	s.datatypes = w->datatypes.n;
+
+	list_for_each_entry(type, &ipset->datatypes, list)
+	{
+		t = table_add(&w->datatypes, NULL, 1);
+		t->type = type->type;
+		t->dst  = !strcmp(type->dir, "dst");
+		s.n_datatypes++;
+	}
+
+	if (ipset->iprange.set)
+	{
+		s.has_iprange = true;
+		put_address(&s.iprange, &ipset->iprange);
+	}
+
+	if (ipset->portrange.set)
+	{
+		s.has_portrange = true;
+		s.port_min = ipset->portrange.port_min;
+		s.port_max = ipset->portrange.port_max;
+	}
+
+	s.counters = ipset->counters;
+	s.comment  = ipset->comment;
+	s.timeout  = ipset->timeout;
+	s.netmask  = ipset->netmask;
+	s.maxelem  = ipset->maxelem;
+	s.hashsize = ipset->hashsize;
+
+	table_add(&w->ipsets, &s, 1);
+}
+
+static void
+table_free(struct fw3_sf_table *t)
+{
+	free(t->data);
+}
+
+void
+fw3_write_statefile(struct fw3_state *state)
+{
+	int fd;
+	char *buf, *p;
+	size_t len;
+	unsigned int n;
+	struct fw3_zone *z;
+	struct fw3_ipset *i;
+	struct ifaddrs *ifaddr;
+	struct fw3_sf_string *e, *tmp;
+	struct fw3_sf_header *hdr;
+	struct fw3_sf_writer w = {
+		.zones     = { .size = sizeof(struct fw3_sf_zone) },
+		.ipsets    = { .size = sizeof(struct fw3_sf_ipset) },
+		.devices   = { .size = sizeof(struct fw3_sf_device) },
+		.addrs     = { .size = sizeof(struct fw3_sf_address) },
+		.datatypes = { .size = sizeof(struct fw3_sf_datatype) },
+		.strings   = { .size = 1 },
+	};
+	struct fw3_sf_table *tables[] = {
+		&w.zones, &w.ipsets, &w.devices, &w.addrs, &w.datatypes, &w.strings
+	};
+
+	if (fw3_no_family(state->defaults.flags[0]) &&
+	    fw3_no_family(state->defaults.flags[1]))
+	{
+		unlink(FW3_STATEFILE);
+		return;
+	}
+
+	if (getifaddrs(&ifaddr))
+	{
+		warn("Cannot get interface addresses: %s", strerror(errno));
+		ifaddr = NULL;
+	}
+
+	avl_init(&w.interned, avl_strcmp, false, NULL);
+	table_add(&w.strings, "", 1);
+
+	list_for_each_entry(z, &state->zones, list)
+		put_zone(&w, z, ifaddr);
+
+	list_for_each_entry(i, &state->ipsets, list)
+		put_ipset(&w, i);
+
+	if (ifaddr)
+		freeifaddrs(ifaddr);
+
+	avl_remove_all_elements(&w.interned, e, node, tmp)
+		free(e);
+
+	/* keep the file size a multiple of the record alignment */
+	while (w.strings.n % 4)
+		table_add(&w.strings, NULL, 1);
+
+	for (len = sizeof(*hdr), n = 0; n < ARRAY_SIZE(tables); n++)
+		len += (size_t)tables[n]->n * tables[n]->size;
+
+	buf = fw3_alloc(len);
+	hdr = (struct fw3_sf_header *)buf;
+
+	for (p = buf + sizeof(*hdr), n = 0; n < ARRAY_SIZE(tables); n++)
+	{
+		if (tables[n]->n)
+			memcpy(p, tables[n]->data, (size_t)tables[n]->n * tables[n]->size);
+
+		p += (size_t)tables[n]->n * tables[n]->size;
+		table_free(tables[n]);
+	}
+
+	hdr->magic          = FW3_STATE_MAGIC;
+	hdr->version        = FW3_STATE_VERSION;
+	hdr->hdrlen         = sizeof(*hdr);
+	hdr->size           = len;
+	hdr->policy_input   = state->defaults.policy_input;
+	hdr->policy_output  = state->defaults.policy_output;
+	hdr->policy_forward = state->defaults.policy_forward;
+	hdr->flags[0]       = state->defaults.flags[0];
+	hdr->flags[1]       = state->defaults.flags[1];
+	hdr->digest         = state->defaults.digest;
+	hdr->n_zones        = w.zones.n;
+	hdr->n_ipsets       = w.ipsets.n;
+	hdr->n_devices      = w.devices.n;
+	hdr->n_addrs        = w.addrs.n;
+	hdr->n_datatypes    = w.datatypes.n;
+	hdr->n_strings      = w.strings.n;
+	hdr->crc            = crc32(buf + sizeof(*hdr), len - sizeof(*hdr));
+
+	/* replace the old state atomically */
+	fd = open(FW3_STATEFILE ".new", O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR);
+
+	if (fd < 0)
+	{
+		warn("Cannot create state %s: %s", FW3_STATEFILE, strerror(errno));
+		free(buf);
+		return;
+	}
+
+	if (write(fd, buf, len) != len || fsync(fd))
+	{
+		warn("Cannot write state %s: %s", FW3_STATEFILE, strerror(errno));
+		close(fd);
+		unlink(FW3_STATEFILE ".new");
+		free(buf);
+		return;
+	}
+
+	close(fd);
+	free(buf);
+
+	if (rename(FW3_STATEFILE ".new", FW3_STATEFILE))
+	{
+		warn("Cannot replace state %s: %s", FW3_STATEFILE, strerror(errno));
+		unlink(FW3_STATEFILE ".new");
+	}
+}
+
+static const char *
+get_string(const char *strings, uint32_t n, uint32_t off, bool *ok)
+{
+	if (!off)
+		return NULL;
+
+	if (off >= n)
+	{
+		*ok = false;
+		return NULL;
+	}
+
+	return strings + off;
+}
+
+static void
+get_address(struct fw3_address *addr, const struct fw3_sf_address *a)
+{
+	addr->set    = true;
+	addr->family = a->family;
+	addr->range  = a->range;
+	addr->invert = a->invert;
+
+	memcpy(&addr->address.v6, a->address, sizeof(a->address));
+	memcpy(&addr->mask.v6, a->mask, sizeof(a->mask));
+}
+
+static bool
+get_addresses(struct list_head *list, const struct fw3_sf_address *addrs,
+              uint32_t n_addrs, uint32_t first, uint32_t n)
+{
+	struct fw3_address *addr;
+
+	if (first > n_addrs || n > n_addrs - first)
+		return false;
+
+	while (n--)
+	{
+		addr = fw3_alloc(sizeof(*addr));
+		get_address(addr, &addrs[first++]);
+		list_add_tail(&addr->list, list);
+	}
+
+	return true;
+}
+
+static bool
+get_zone(struct fw3_state *state, const struct fw3_sf_header *hdr,
+         const struct fw3_sf_zone *z, const struct fw3_sf_device *devices,
+         const struct fw3_sf_address *addrs, const char *strings)
+{
+	bool ok = true;
+	uint32_t n;
+	const char *s;
+	struct fw3_zone *zone;
+	struct fw3_device *dev;
+
+	if (!(zone = fw3_alloc_zone()))
+		return false;
+
+	list_add_tail(&zone->list, &state->zones);
+
+	zone->name           = get_string(strings, hdr->n_strings, z->name, &ok);
+	zone->extra_src      = get_string(strings, hdr->n_strings, z->extra_src, &ok);
+	zone->extra_dest     = get_string(strings, hdr->n_strings, z->extra_dest, &ok);
+	zone->family         = z->family;
+	zone->policy_input   = z->policy_input;
+	zone->policy_output  = z->policy_output;
+	zone->policy_forward = z->policy_forward;
+	zone->masq           = z->masq;
+	zone->mtu_fix        = z->mtu_fix;
+	zone->custom_chains  = z->custom_chains;
+	zone->flags[0]       = z->flags[0];
+	zone->flags[1]       = z->flags[1];
+	zone->digest         = z->digest;
+
+	if (!zone->name || z->devices > hdr->n_devices ||
+	    z->n_devices > hdr->n_devices - z->devices)
+		return false;
+
+	for (n = z->devices; n < z->devices + z->n_devices; n++)
+	{
+		dev = fw3_alloc(sizeof(*dev));
+		list_add_tail(&dev->list, &zone->devices);
+
+		dev->set    = true;
+		dev->invert = devices[n].invert;
+		dev->any    = devices[n].any;
+
+		if ((s = get_string(strings, hdr->n_strings, devices[n].name, &ok)))
+			snprintf(dev->name, sizeof(dev->name), "%s", s);
+
+		if ((s = get_string(strings, hdr->n_strings, devices[n].network, &ok)))
+			snprintf(dev->network, sizeof(dev->network), "%s", s);
+	}
+
+	return ok &&
+	       get_addresses(&zone->subnets, addrs, hdr->n_addrs,
+	                     z->subnets, z->n_subnets) &&
+	       get_addresses(&zone->old_addrs, addrs, hdr->n_addrs,
+	                     z->addrs, z->n_addrs);
+}
+
+static bool
+get_ipset(struct fw3_state *state, const struct fw3_sf_header *hdr,
+          const struct fw3_sf_ipset *s, const struct fw3_sf_datatype *types,
+          const char *strings)
+{
+	bool ok = true;
+	uint32_t n;
+	struct fw3_ipset *ipset;
+	struct fw3_ipset_datatype *type;
+
+	if (!(ipset = fw3_alloc_ipset(state)))
+		return false;
+
+	ipset->name   = get_string(strings, hdr->n_strings, s->name, &ok);
+	ipset->family = s->family;
+	ipset->method = s->method;
+
+	if (!ipset->name || s->datatypes > hdr->n_datatypes ||
+	    s->n_datatypes > hdr->n_datatypes - s->datatypes)
+		return false;
+
+	for (n = s->datatypes; n < s->datatypes + s->n_datatypes; n++)
+	{
+		type = fw3_alloc(sizeof(*type));
+		type->type = types[n].type;
+		type->dir  = types[n].dst ? "dst" : "src";
+		list_add_tail(&type->list, &ipset->datatypes);
+	}
+
+	if (s->has_iprange)
+		get_address(&ipset->iprange, &s->iprange);
+
+	if (s->has_portrange)
+	{
+		ipset->portrange.set      = true;
+		ipset->portrange.port_min = s->port_min;
+		ipset->portrange.port_max = s->port_max;
+	}
+
+	ipset->counters = s->counters;
+	ipset->comment  = s->comment;
+	ipset->timeout  = s->timeout;
+	ipset->netmask  = s->netmask;
+	ipset->maxelem  = s->maxelem;
+	ipset->hashsize = s->hashsize;
+
+	return ok;
+}
+
+/* Map the binary state read-only, strings of the loaded objects point into
+ * the mapping which stays around until fw3_unmap_statefile() is called. */
+bool
+fw3_read_statefile(struct fw3_state *state)
+{
+	int fd;
+	uint32_t n;
+	size_t len;
+	struct stat st;
+	const char *p;
+	const struct fw3_sf_header *hdr;
+	const struct fw3_sf_zone *zones;
+	const struct fw3_sf_ipset *ipsets;
+	const struct fw3_sf_device *devices;
+	const struct fw3_sf_address *addrs;
+	const struct fw3_sf_datatype *types;
+	const char *strings;
+	struct fw3_zone *zone, *ztmp;
+	struct fw3_ipset *ipset, *itmp;
+	void *map;
+
+	if ((fd = open(FW3_STATEFILE, O_RDONLY)) < 0)
+		return false;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*hdr))
+	{
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	hdr = map;
+
+	/* not ours, possibly the UCI state of an older version */
+	if (hdr->magic != FW3_STATE_MAGIC)
+	{
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	len = sizeof(*hdr) +
+	      (size_t)hdr->n_zones * sizeof(*zones) +
+	      (size_t)hdr->n_ipsets * sizeof(*ipsets) +
+	      (size_t)hdr->n_devices * sizeof(*devices) +
+	      (size_t)hdr->n_addrs * sizeof(*addrs) +
+	      (size_t)hdr->n_datatypes * sizeof(*types) +
+	      hdr->n_strings;
+
+	if (hdr->version != FW3_STATE_VERSION || hdr->hdrlen != sizeof(*hdr) ||
+	    hdr->size != st.st_size || len != st.st_size || !hdr->n_strings ||
+	    hdr->crc != crc32((char *)map + sizeof(*hdr), len - sizeof(*hdr)))
+	{
+		warn("Ignoring invalid state file %s", FW3_STATEFILE);
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	p = (const char *)map + sizeof(*hdr);
+	zones   = (const void *)p; p += hdr->n_zones * sizeof(*zones);
+	ipsets  = (const void *)p; p += hdr->n_ipsets * sizeof(*ipsets);
+	devices = (const void *)p; p += hdr->n_devices * sizeof(*devices);
+	addrs   = (const void *)p; p += hdr->n_addrs * sizeof(*addrs);
+	types   = (const void *)p; p += hdr->n_datatypes * sizeof(*types);
+	strings = p;
+
+	state->statemap = map;
+	state->statemap_size = st.st_size;
+	state->statefile = true;
+
+	state->defaults.policy_input   = hdr->policy_input;
+	state->defaults.policy_output  = hdr->policy_output;
+	state->defaults.policy_forward = hdr->policy_forward;
+	state->defaults.flags[0]       = hdr->flags[0];
+	state->defaults.flags[1]       = hdr->flags[1];
+	state->defaults.digest         = hdr->digest;
+
+	INIT_LIST_HEAD(&state->zones);
+	INIT_LIST_HEAD(&state->rules);
+	INIT_LIST_HEAD(&state->redirects);
+	INIT_LIST_HEAD(&state->snats);
+	INIT_LIST_HEAD(&state->forwards);
+	INIT_LIST_HEAD(&state->ipsets);
+	INIT_LIST_HEAD(&state->includes);
+	INIT_LIST_HEAD(&state->cthelpers);
+
+	/* the string table must be terminated, so strings can't overrun it */
+	if (strings[hdr->n_strings - 1])
+		goto invalid;
+
+	for (n = 0; n < hdr->n_zones; n++)
+		if (!get_zone(state, hdr, &zones[n], devices, addrs, strings))
+			goto invalid;
+
+	if (!state->disable_ipsets)
+		for (n = 0; n < hdr->n_ipsets; n++)
+			if (!get_ipset(state, hdr, &ipsets[n], types, strings))
+				goto invalid;
+
+	fw3_index_zones(state);
+	fw3_index_ipsets(state);
+
+	return true;
+
+invalid:
+	warn("Ignoring corrupt state file %s", FW3_STATEFILE);
+
+	list_for_each_entry_safe(zone, ztmp, &state->zones, list)
+	{
+		list_del(&zone->list);
+		fw3_free_zone(zone);
+	}
+
+	list_for_each_entry_safe(ipset, itmp, &state->ipsets, list)
+		fw3_free_ipset(ipset);
+
+	fw3_unmap_statefile(state);
+	state->statefile = false;
+
+	return false;
+}
+
+void
+fw3_unmap_statefile(struct fw3_state *state)
+{
+	if (!state->statemap)
+		return;
+
+	munmap(state->statemap, state->statemap_size);
+	state->statemap = NULL;
+}
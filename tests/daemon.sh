@@ -0,0 +1,136 @@
+#!/bin/sh
+# Check that "fw3 daemon" reloads on network.interface events and that a
+# plain "fw3 reload" is answered by the daemon while one with options
+# still runs locally.
+#
+# Runs as root in private network and mount namespaces with its own ubusd
+# and a Lua stub (libubus-lua) answering network.interface dump with the
+# device currently listed in a file, the host tables are not touched.
+#
+# usage: tests/daemon.sh [path/to/firewall3]
+
+FW3="$(readlink -f "${1:-./firewall3}")"
+SELF="$(readlink -f "$0")"
+
+[ -x "$FW3" ] || { echo "$FW3 is not executable" >&2; exit 1; }
+
+if [ -z "$FW3_TEST_NS" ]; then
+	FW3_TEST_NS=1 exec unshare -n -m "$SELF" "$FW3"
+fi
+
+for cmd in ubusd ubus lua; do
+	command -v $cmd >/dev/null || { echo "$cmd not found" >&2; exit 1; }
+done
+
+TMP="$(mktemp -d)"
+mount --make-rprivate / 2>/dev/null
+mount -t tmpfs none /var/run
+mkdir -p /var/run/ubus
+mkdir -p "$TMP/config"
+mount --bind "$TMP/config" /etc/config
+
+cat > /etc/config/firewall <<EOT
+config defaults
+	option input ACCEPT
+	option output ACCEPT
+	option forward REJECT
+
+config zone
+	option name lan
+	list network lan
+	option input ACCEPT
+	option output ACCEPT
+	option forward ACCEPT
+EOT
+
+cat > "$TMP/stub.lua" <<'EOT'
+require "ubus"
+require "uloop"
+
+local devfile = arg[1]
+
+local function device()
+	local f = io.open(devfile)
+	local dev = f:read("*l")
+	f:close()
+	return dev
+end
+
+uloop.init()
+
+local conn = ubus.connect()
+conn:add({
+	["network.interface"] = { dump = { function(req, msg)
+		local dev = device()
+		conn:reply(req, { interface = { {
+			interface = "lan", up = true,
+			device = dev, l3_device = dev,
+			["ipv4-address"] = { { address = "192.168.1.1", mask = 24 } }
+		} } })
+	end, { } } },
+	service = { get_data = { function(req, msg)
+		conn:reply(req, { })
+	end, { } } }
+})
+
+uloop.run()
+EOT
+
+echo br-lan > "$TMP/dev"
+
+ubusd & UBUSD=$!
+sleep 1
+lua "$TMP/stub.lua" "$TMP/dev" & STUB=$!
+sleep 1
+"$FW3" daemon > "$TMP/daemon" 2>&1 & DAEMON=$!
+
+cleanup() {
+	kill $DAEMON $STUB $UBUSD 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+failed=0
+
+fail() {
+	echo "FAIL: $*"
+	failed=1
+}
+
+# wait_rules <pattern>, gives the daemon up to five seconds
+wait_rules() {
+	local i=0
+
+	while [ $i -lt 5 ]; do
+		iptables-save -t filter | grep -q -- "$1" && return 0
+		sleep 1
+		i=$((i + 1))
+	done
+
+	return 1
+}
+
+has_rules() {
+	iptables-save -t filter | grep -q -- "$1"
+}
+
+wait_rules "-i br-lan" || fail "daemon: initial configuration not applied"
+
+echo br-wan > "$TMP/dev"
+ubus send network.interface '{ "action": "ifup", "interface": "lan" }'
+wait_rules "-i br-wan" || fail "interface event: no rules for br-wan"
+has_rules "-i br-lan" && fail "interface event: rules for br-lan kept"
+
+# no event this time, only the forwarded reload picks the device up
+echo br-fwd > "$TMP/dev"
+"$FW3" reload > "$TMP/out" 2>&1 || fail "forwarded reload: failed"
+[ -s "$TMP/out" ] && fail "forwarded reload: ran locally"
+has_rules "-i br-fwd" || fail "forwarded reload: returned before the rules"
+
+"$FW3" -4 reload > "$TMP/out" 2>&1
+grep -q "IPv4 filter table" "$TMP/out" || fail "reload with -4: forwarded to the daemon"
+
+kill -0 $DAEMON 2>/dev/null || fail "daemon: exited"
+
+[ $failed = 0 ] && echo "PASS"
+exit $failed
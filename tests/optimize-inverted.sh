@@ -0,0 +1,76 @@
+#!/bin/sh
+# Check that optimize_rules keeps a rule with an inverted selector that
+# follows a broader rule, e.g. "! -d 10.1.0.0/16 -j REJECT" after
+# "-d 10.0.0.0/8 -j ACCEPT", which only look alike.
+#
+# Runs as root in private network and mount namespaces, the host tables
+# are not touched.
+#
+# usage: tests/optimize-inverted.sh [path/to/firewall3]
+
+FW3="$(readlink -f "${1:-./firewall3}")"
+SELF="$(readlink -f "$0")"
+
+[ -x "$FW3" ] || { echo "$FW3 is not executable" >&2; exit 1; }
+
+if [ -z "$FW3_TEST_NS" ]; then
+	FW3_TEST_NS=1 exec unshare -n -m "$SELF" "$FW3"
+fi
+
+TMP="$(mktemp -d)"
+trap 'rm -rf "$TMP"' EXIT
+
+mount --make-rprivate / 2>/dev/null
+mount -t tmpfs none /var/run
+mkdir -p "$TMP/config"
+mount --bind "$TMP/config" /etc/config
+
+cat > /etc/config/firewall <<EOT
+config defaults
+	option input ACCEPT
+	option output ACCEPT
+	option forward REJECT
+	option optimize_rules 1
+
+config rule
+	option proto all
+	option dest_ip 10.0.0.0/8
+	option target ACCEPT
+
+config rule
+	option proto all
+	option dest_ip !10.1.0.0/16
+	option target REJECT
+
+config rule
+	option proto all
+	option family ipv6
+	option dest_ip fd00::/8
+	option target ACCEPT
+
+config rule
+	option proto all
+	option family ipv6
+	option dest_ip !fd00:1::/64
+	option target REJECT
+EOT
+
+failed=0
+
+fail() {
+	echo "FAIL: $*"
+	failed=1
+}
+
+"$FW3" -q start
+
+iptables-save -t filter | grep -qi -- "! -d 10.1.0.0/16 .*REJECT" || \
+	fail "IPv4 rule with inverted destination was dropped"
+
+if command -v ip6tables-save >/dev/null; then
+	ip6tables-save -t filter | grep -qi -- "! -d fd00:1::/64 .*REJECT" || \
+		fail "IPv6 rule with inverted destination was dropped"
+fi
+
+[ $failed = 0 ] && echo "PASS"
+exit $failed
@@ -0,0 +1,132 @@
+#!/bin/sh
+# Check that fw3 honours the ubus timeout given with -t and carries on
+# with the interface dump alone when the service data arrives late.
+#
+# Runs as root in a private mount namespace with its own ubusd and a Lua
+# stub (libubus-lua) answering network.interface dump and service
+# get_data after a configurable delay.
+#
+# usage: tests/ubus-timeout.sh [path/to/firewall3]
+
+FW3="$(readlink -f "${1:-./firewall3}")"
+SELF="$(readlink -f "$0")"
+
+[ -x "$FW3" ] || { echo "$FW3 is not executable" >&2; exit 1; }
+
+if [ -z "$FW3_TEST_NS" ]; then
+	FW3_TEST_NS=1 exec unshare -m "$SELF" "$FW3"
+fi
+
+for cmd in ubusd lua; do
+	command -v $cmd >/dev/null || { echo "$cmd not found" >&2; exit 1; }
+done
+
+TMP="$(mktemp -d)"
+mount --make-rprivate / 2>/dev/null
+mount -t tmpfs none /var/run
+mkdir -p /var/run/ubus
+mkdir -p "$TMP/config"
+mount --bind "$TMP/config" /etc/config
+
+cat > /etc/config/firewall <<EOT
+config defaults
+	option input ACCEPT
+	option output ACCEPT
+	option forward REJECT
+
+config zone
+	option name lan
+	list network lan
+	option input ACCEPT
+	option output ACCEPT
+	option forward ACCEPT
+EOT
+
+cat > "$TMP/stub.lua" <<'EOT'
+require "ubus"
+require "uloop"
+
+local object, method, delay = arg[1], arg[2], tonumber(arg[3])
+local reply = {}
+
+if object == "network.interface" then
+	reply = { interface = { {
+		interface = "lan", up = true,
+		device = "br-lan", l3_device = "br-lan",
+		["ipv4-address"] = { { address = "192.168.1.1", mask = 24 } }
+	} } }
+end
+
+uloop.init()
+
+local conn = ubus.connect()
+conn:add({ [object] = { [method] = { function(req, msg)
+	if delay > 0 then
+		os.execute("sleep " .. delay)
+	end
+	conn:reply(req, reply)
+end, { } } } })
+
+uloop.run()
+EOT
+
+ubusd & UBUSD=$!
+STUBS=
+
+cleanup() {
+	kill $STUBS $UBUSD 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+sleep 1
+
+failed=0
+
+fail() {
+	echo "FAIL: $*"
+	failed=1
+}
+
+# start_stubs <dump delay> <get_data delay>, delays in seconds
+start_stubs() {
+	kill $STUBS 2>/dev/null
+	wait $STUBS 2>/dev/null
+	lua "$TMP/stub.lua" network.interface dump "$1" & STUBS=$!
+	lua "$TMP/stub.lua" service get_data "$2" & STUBS="$STUBS $!"
+	sleep 1
+}
+
+# run_fw3 <timeout ms>, leaves output in $TMP/out and seconds taken in $took
+run_fw3() {
+	local t0=$(date +%s)
+	rm -f /var/run/fw3.*
+	"$FW3" -t "$1" print > "$TMP/out" 2>&1
+	took=$(( $(date +%s) - t0 ))
+}
+
+start_stubs 0 0
+run_fw3 1000
+grep -q "within .* ms" "$TMP/out" && fail "prompt replies: unexpected timeout warning"
+grep -q "br-lan" "$TMP/out" || fail "prompt replies: no rules for br-lan"
+
+start_stubs 0 4
+run_fw3 1000
+grep -q "No service data received within 1000 ms" "$TMP/out" || \
+	fail "late service data: no timeout warning"
+grep -q "br-lan" "$TMP/out" || fail "late service data: no rules for br-lan"
+[ $took -lt 4 ] || fail "late service data: took ${took}s, -t 1000 not honoured"
+warn_line=$(grep -n "within 1000 ms" "$TMP/out" | head -n1 | cut -d: -f1)
+rule_line=$(grep -n "br-lan" "$TMP/out" | head -n1 | cut -d: -f1)
+[ -n "$warn_line" ] && [ -n "$rule_line" ] && [ $warn_line -gt $rule_line ] && \
+	fail "late service data: rules emitted before the warning"
+
+start_stubs 4 0
+run_fw3 1000
+grep -q "Failed to connect to ubus" "$TMP/out" || \
+	fail "late interface dump: no connect warning"
+grep -q "br-lan" "$TMP/out" && fail "late interface dump: rules for br-lan"
+[ $took -lt 4 ] || fail "late interface dump: took ${took}s, -t 1000 not honoured"
+
+[ $failed = 0 ] && echo "PASS"
+exit $failed
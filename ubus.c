@@ -16,11 +16,26 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <libubox/avl-cmp.h>
+
 #include "ubus.h"
 
 static struct blob_attr *interfaces = NULL;
 static struct blob_attr *procd_data;
 
+int fw3_ubus_timeout = FW3_UBUS_TIMEOUT;
+
+/* interfaces of the dump, decoded once and indexed by name and by zone */
+struct fw3_ubus_iface {
+	struct avl_node node;
+	struct avl_node zone_node;
+	const char *device;
+	struct list_head addrs;
+};
+
+static AVL_TREE(iface_index, avl_strcmp, false, NULL);
+static AVL_TREE(zone_index, avl_strcmp, true, NULL);
+
 
 static void dump_cb(struct ubus_request *req, int type, struct blob_attr *msg)
 {
@@ -37,49 +52,6 @@ static void procd_data_cb(struct ubus_request *req, int type, struct blob_attr *
 	procd_data = blob_memdup(msg);
 }
 
-bool
-fw3_ubus_connect(void)
-{
-	bool status = false;
-	uint32_t id;
-	struct ubus_context *ctx = ubus_connect(NULL);
-	struct blob_buf b = { };
-
-	blob_buf_init(&b, 0);
-
-	if (!ctx)
-		goto out;
-
-	if (ubus_lookup_id(ctx, "network.interface", &id))
-		goto out;
-
-	if (ubus_invoke(ctx, id, "dump", b.head, dump_cb, NULL, 2000))
-		goto out;
-
-	status = true;
-
-	if (ubus_lookup_id(ctx, "service", &id))
-		goto out;
-
-	blobmsg_add_string(&b, "type", "firewall");
-	ubus_invoke(ctx, id, "get_data", b.head, procd_data_cb, NULL, 2000);
-
-out:
-	blob_buf_free(&b);
-
-	if (ctx)
-		ubus_free(ctx);
-
-	return status;
-}
-
-void
-fw3_ubus_disconnect(void)
-{
-	free(interfaces);
-	interfaces = NULL;
-}
-
 static struct fw3_address *
 parse_subnet(enum fw3_family family, struct blob_attr *dict, int rem)
 {
@@ -133,46 +105,341 @@ parse_subnets(struct list_head *head, enum fw3_family family,
 	return n;
 }
 
-struct fw3_device *
-fw3_ubus_device(const char *net)
+static void
+free_iface(struct fw3_ubus_iface *iface)
+{
+	struct fw3_address *addr, *tmp;
+
+	list_for_each_entry_safe(addr, tmp, &iface->addrs, list)
+		free(addr);
+
+	free(iface);
+}
+
+static void
+index_interface(struct blob_attr *c)
 {
 	enum {
-		DEV_INTERFACE,
-		DEV_DEVICE,
-		DEV_L3_DEVICE,
-		__DEV_MAX
+		IF_INTERFACE,
+		IF_DEVICE,
+		IF_L3_DEVICE,
+		IF_IPV4,
+		IF_IPV6,
+		IF_IPV6_PREFIX,
+		IF_DATA,
+		__IF_MAX
 	};
-	static const struct blobmsg_policy policy[__DEV_MAX] = {
-		[DEV_INTERFACE] = { "interface", BLOBMSG_TYPE_STRING },
-		[DEV_DEVICE] = { "device", BLOBMSG_TYPE_STRING },
-		[DEV_L3_DEVICE] = { "l3_device", BLOBMSG_TYPE_STRING },
+	static const struct blobmsg_policy policy[__IF_MAX] = {
+		[IF_INTERFACE] = { "interface", BLOBMSG_TYPE_STRING },
+		[IF_DEVICE] = { "device", BLOBMSG_TYPE_STRING },
+		[IF_L3_DEVICE] = { "l3_device", BLOBMSG_TYPE_STRING },
+		[IF_IPV4] = { "ipv4-address", BLOBMSG_TYPE_ARRAY },
+		[IF_IPV6] = { "ipv6-address", BLOBMSG_TYPE_ARRAY },
+		[IF_IPV6_PREFIX] = { "ipv6-prefix-assignment", BLOBMSG_TYPE_ARRAY },
+		[IF_DATA] = { "data", BLOBMSG_TYPE_TABLE },
 	};
-	struct fw3_device *dev = NULL;
-	struct blob_attr *tb[__DEV_MAX];
+	struct blob_attr *tb[__IF_MAX];
 	struct blob_attr *cur;
-	char *name = NULL;
-	int rem;
+	struct fw3_ubus_iface *iface;
+	const char *zone = NULL;
+	unsigned rem;
 
-	if (!net || !interfaces)
-		return NULL;
+	blobmsg_parse(policy, __IF_MAX, tb, blobmsg_data(c), blobmsg_len(c));
 
-	blobmsg_for_each_attr(cur, interfaces, rem) {
-		blobmsg_parse(policy, __DEV_MAX, tb, blobmsg_data(cur), blobmsg_len(cur));
-		if (!tb[DEV_INTERFACE] ||
-		    strcmp(blobmsg_data(tb[DEV_INTERFACE]), net) != 0)
-			continue;
+	if (!tb[IF_INTERFACE])
+		return;
 
-		if (tb[DEV_L3_DEVICE])
-			name = blobmsg_data(tb[DEV_L3_DEVICE]);
-		else if (tb[DEV_DEVICE])
-			name = blobmsg_data(tb[DEV_DEVICE]);
-		else
-			continue;
+	iface = fw3_alloc(sizeof(*iface));
+
+	INIT_LIST_HEAD(&iface->addrs);
+
+	iface->node.key = blobmsg_get_string(tb[IF_INTERFACE]);
+
+	if (tb[IF_L3_DEVICE])
+		iface->device = blobmsg_get_string(tb[IF_L3_DEVICE]);
+	else if (tb[IF_DEVICE])
+		iface->device = blobmsg_get_string(tb[IF_DEVICE]);
+
+	parse_subnets(&iface->addrs, FW3_FAMILY_V4, tb[IF_IPV4]);
+	parse_subnets(&iface->addrs, FW3_FAMILY_V6, tb[IF_IPV6]);
+	parse_subnets(&iface->addrs, FW3_FAMILY_V6, tb[IF_IPV6_PREFIX]);
+
+	if (tb[IF_DATA])
+		blobmsg_for_each_attr(cur, tb[IF_DATA], rem)
+			if (!strcmp(blobmsg_name(cur), "zone"))
+				zone = blobmsg_get_string(cur);
+
+	/* interface names are unique, keep the first entry if not */
+	if (avl_insert(&iface_index, &iface->node))
+	{
+		free_iface(iface);
+		return;
+	}
+
+	if (zone)
+	{
+		iface->zone_node.key = zone;
+		avl_insert(&zone_index, &iface->zone_node);
+	}
+}
+
+static void
+index_interfaces(void)
+{
+	struct blob_attr *c;
+	unsigned r;
+
+	blobmsg_for_each_attr(c, interfaces, r)
+		index_interface(c);
+}
+
+static void
+free_interfaces(void)
+{
+	struct fw3_ubus_iface *iface, *tmp;
+
+	avl_remove_all_elements(&iface_index, iface, node, tmp)
+		free_iface(iface);
+
+	avl_init(&zone_index, avl_strcmp, true, NULL);
+
+	free(interfaces);
+	interfaces = NULL;
+}
+
+static int
+elapsed_ms(const struct timespec *t0)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - t0->tv_sec) * 1000 +
+	       (now.tv_nsec - t0->tv_nsec) / 1000000;
+}
+
+/* Both requests are issued up front and share one deadline, a late
+ * service reply only costs the procd provided rules. */
+bool
+fw3_ubus_connect(void)
+{
+	bool status = false;
+	uint32_t id;
+	int left, rv;
+	struct timespec t0;
+	struct ubus_context *ctx = ubus_connect(NULL);
+	struct ubus_request dump_req, data_req;
+	bool data_pending = false;
+	struct blob_buf b = { }, d = { };
+
+	free_interfaces();
+
+	free(procd_data);
+	procd_data = NULL;
+
+	blob_buf_init(&b, 0);
+	blob_buf_init(&d, 0);
+
+	if (!ctx)
+		goto out;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (ubus_lookup_id(ctx, "network.interface", &id))
+		goto out;
+
+	if (ubus_invoke_async(ctx, id, "dump", b.head, &dump_req))
+		goto out;
+
+	dump_req.data_cb = dump_cb;
+
+	if (!ubus_lookup_id(ctx, "service", &id))
+	{
+		blobmsg_add_string(&d, "type", "firewall");
 
-		break;
+		if (!ubus_invoke_async(ctx, id, "get_data", d.head, &data_req))
+		{
+			data_req.data_cb = procd_data_cb;
+			data_pending = true;
+		}
+	}
+
+	if (ubus_complete_request(ctx, &dump_req, fw3_ubus_timeout))
+	{
+		if (data_pending)
+			ubus_abort_request(ctx, &data_req);
+
+		free(interfaces);
+		interfaces = NULL;
+
+		free(procd_data);
+		procd_data = NULL;
+
+		goto out;
+	}
+
+	index_interfaces();
+
+	status = true;
+
+	if (!data_pending)
+		goto out;
+
+	/* a timeout of 0 would wait forever */
+	left = fw3_ubus_timeout - elapsed_ms(&t0);
+
+	rv = ubus_complete_request(ctx, &data_req, (left > 0) ? left : 1);
+
+	if (rv == UBUS_STATUS_TIMEOUT)
+		warn("No service data received within %d ms, ignoring procd rules",
+		     fw3_ubus_timeout);
+
+	if (rv)
+	{
+		free(procd_data);
+		procd_data = NULL;
+	}
+
+out:
+	blob_buf_free(&b);
+	blob_buf_free(&d);
+
+	if (ctx)
+		ubus_free(ctx);
+
+	return status;
+}
+
+void
+fw3_ubus_disconnect(void)
+{
+	free_interfaces();
+
+	free(procd_data);
+	procd_data = NULL;
+}
+
+bool
+fw3_ubus_has_interfaces(void)
+{
+	return !!interfaces;
+}
+
+static uint32_t
+hash_string(uint32_t hv, const char *s)
+{
+	return s ? fw3_hash(hv, s, strlen(s) + 1) : fw3_hash(hv, "", 1);
+}
+
+/* The dump carries uptimes and address lifetimes which change all the
+ * time, only hash what the configuration state is built from. */
+static uint32_t
+hash_interface(uint32_t hv, struct blob_attr *c)
+{
+	enum {
+		IF_INTERFACE,
+		IF_UP,
+		IF_PROTO,
+		IF_DATA,
+		__IF_MAX
+	};
+	static const struct blobmsg_policy policy[__IF_MAX] = {
+		[IF_INTERFACE] = { "interface", BLOBMSG_TYPE_STRING },
+		[IF_UP] = { "up", BLOBMSG_TYPE_BOOL },
+		[IF_PROTO] = { "proto", BLOBMSG_TYPE_STRING },
+		[IF_DATA] = { "data", BLOBMSG_TYPE_TABLE },
+	};
+	struct blob_attr *tb[__IF_MAX];
+	struct fw3_ubus_iface *iface;
+	struct fw3_address *addr;
+	bool up;
+
+	blobmsg_parse(policy, __IF_MAX, tb, blobmsg_data(c), blobmsg_len(c));
+
+	if (!tb[IF_INTERFACE])
+		return hv;
+
+	up = tb[IF_UP] && blobmsg_get_bool(tb[IF_UP]);
+
+	hv = hash_string(hv, blobmsg_get_string(tb[IF_INTERFACE]));
+	hv = fw3_hash(hv, &up, sizeof(up));
+	hv = hash_string(hv, tb[IF_PROTO] ? blobmsg_get_string(tb[IF_PROTO]) : NULL);
+
+	if (tb[IF_DATA])
+		hv = fw3_hash(hv, tb[IF_DATA], blob_pad_len(tb[IF_DATA]));
+
+	iface = avl_find_element(&iface_index, blobmsg_get_string(tb[IF_INTERFACE]),
+	                         iface, node);
+
+	if (!iface)
+		return hv;
+
+	hv = hash_string(hv, iface->device);
+
+	list_for_each_entry(addr, &iface->addrs, list)
+	{
+		hv = fw3_hash(hv, &addr->family, sizeof(addr->family));
+		hv = fw3_hash(hv, &addr->address, sizeof(addr->address));
+		hv = fw3_hash(hv, &addr->mask, sizeof(addr->mask));
+	}
+
+	return hv;
+}
+
+uint32_t
+fw3_ubus_hash(uint32_t hv)
+{
+	struct blob_attr *c;
+	unsigned r;
+
+	if (interfaces)
+		blobmsg_for_each_attr(c, interfaces, r)
+			hv = hash_interface(hv, c);
+
+	/* only the firewall data of the services is requested */
+	if (procd_data)
+		hv = fw3_hash(hv, procd_data, blob_pad_len(procd_data));
+
+	return hv;
+}
+
+bool
+fw3_ubus_daemon_call(const char *method, int *rv)
+{
+	bool status = false;
+	uint32_t id;
+	struct ubus_context *ctx = ubus_connect(NULL);
+	struct blob_buf b = { };
+
+	if (!ctx)
+		return false;
+
+	blob_buf_init(&b, 0);
+
+	if (!ubus_lookup_id(ctx, FW3_UBUS_OBJECT, &id))
+	{
+		*rv = ubus_invoke(ctx, id, method, b.head, NULL, NULL, 30000) ? 1 : 0;
+		status = true;
 	}
 
-	if (!name)
+	blob_buf_free(&b);
+	ubus_free(ctx);
+
+	return status;
+}
+
+struct fw3_device *
+fw3_ubus_device(const char *net)
+{
+	struct fw3_ubus_iface *iface;
+	struct fw3_device *dev = NULL;
+
+	if (!net)
+		return NULL;
+
+	iface = avl_find_element(&iface_index, net, iface, node);
+
+	if (!iface || !iface->device)
 		return NULL;
 
 	dev = calloc(1, sizeof(*dev));
@@ -180,7 +447,7 @@ fw3_ubus_device(const char *net)
 	if (!dev)
 		return NULL;
 
-	snprintf(dev->name, sizeof(dev->name), "%s", name);
+	snprintf(dev->name, sizeof(dev->name), "%s", iface->device);
 	dev->set = true;
 
 	return dev;
@@ -189,36 +456,25 @@ fw3_ubus_device(const char *net)
 int
 fw3_ubus_address(struct list_head *list, const char *net)
 {
-	enum {
-		ADDR_INTERFACE,
-		ADDR_IPV4,
-		ADDR_IPV6,
-		ADDR_IPV6_PREFIX,
-		__ADDR_MAX
-	};
-	static const struct blobmsg_policy policy[__ADDR_MAX] = {
-		[ADDR_INTERFACE] = { "interface", BLOBMSG_TYPE_STRING },
-		[ADDR_IPV4] = { "ipv4-address", BLOBMSG_TYPE_ARRAY },
-		[ADDR_IPV6] = { "ipv6-address", BLOBMSG_TYPE_ARRAY },
-		[ADDR_IPV6_PREFIX] = { "ipv6-prefix-assignment", BLOBMSG_TYPE_ARRAY },
-	};
-	struct blob_attr *tb[__ADDR_MAX];
-	struct blob_attr *cur;
-	int rem, n = 0;
+	struct fw3_ubus_iface *iface;
+	struct fw3_address *addr, *tmp;
+	int n = 0;
 
-	if (!net || !interfaces)
+	if (!net)
 		return 0;
 
-	blobmsg_for_each_attr(cur, interfaces, rem) {
-		blobmsg_parse(policy, __ADDR_MAX, tb, blobmsg_data(cur), blobmsg_len(cur));
+	iface = avl_find_element(&iface_index, net, iface, node);
 
-		if (!tb[ADDR_INTERFACE] ||
-		    strcmp(blobmsg_data(tb[ADDR_INTERFACE]), net) != 0)
-			continue;
+	if (!iface)
+		return 0;
 
-		n += parse_subnets(list, FW3_FAMILY_V4, tb[ADDR_IPV4]);
-		n += parse_subnets(list, FW3_FAMILY_V6, tb[ADDR_IPV6]);
-		n += parse_subnets(list, FW3_FAMILY_V6, tb[ADDR_IPV6_PREFIX]);
+	list_for_each_entry(addr, &iface->addrs, list)
+	{
+		tmp = fw3_alloc(sizeof(*tmp));
+		memcpy(tmp, addr, sizeof(*tmp));
+
+		list_add_tail(&tmp->list, list);
+		n++;
 	}
 
 	return n;
@@ -227,26 +483,22 @@ fw3_ubus_address(struct list_head *list, const char *net)
 void
 fw3_ubus_zone_devices(struct fw3_zone *zone)
 {
-	struct blob_attr *c, *cur, *dcur;
-	unsigned r, rem, drem;
-	const char *name;
-	bool matches;
+	struct fw3_ubus_iface *iface;
 
-	blobmsg_for_each_attr(c, interfaces, r) {
-		name = NULL;
-		matches = false;
+	iface = avl_find_element(&zone_index, zone->name, iface, zone_node);
 
-		blobmsg_for_each_attr(cur, c, rem) {
-			if (!strcmp(blobmsg_name(cur), "interface"))
-				name = blobmsg_get_string(cur);
-			else if (!strcmp(blobmsg_name(cur), "data"))
-				blobmsg_for_each_attr(dcur, cur, drem)
-					if (!strcmp(blobmsg_name(dcur), "zone"))
-						matches = !strcmp(blobmsg_get_string(dcur), zone->name);
-		}
+	/* equally keyed nodes follow their leader in dump order */
+	while (iface)
+	{
+		fw3_parse_device(&zone->networks, iface->node.key, true);
+
+		if (avl_is_last(&zone_index, &iface->zone_node))
+			break;
+
+		iface = avl_next_element(iface, zone_node);
 
-		if (name && matches)
-			fw3_parse_device(&zone->networks, name, true);
+		if (iface->zone_node.leader)
+			break;
 	}
 }
 
@@ -24,10 +24,20 @@
 
 #include "options.h"
 
+#define FW3_UBUS_OBJECT	"fw3"
+#define FW3_UBUS_TIMEOUT	2000
+
+extern int fw3_ubus_timeout;
 
 bool fw3_ubus_connect(void);
 void fw3_ubus_disconnect(void);
 
+bool fw3_ubus_has_interfaces(void);
+
+uint32_t fw3_ubus_hash(uint32_t hv);
+
+bool fw3_ubus_daemon_call(const char *method, int *rv);
+
 struct fw3_device * fw3_ubus_device(const char *net);
 
 int fw3_ubus_address(struct list_head *list, const char *net);
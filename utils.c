@@ -377,6 +377,68 @@ fw3_lock()
 	return fw3_lock_path(&fw3_lock_fd, FW3_LOCKFILE);
 }
 
+bool
+fw3_trylock(void)
+{
+	int lock_fd = open(FW3_LOCKFILE, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR);
+
+	if (lock_fd < 0)
+	{
+		warn("Cannot create lock file %s: %s", FW3_LOCKFILE, strerror(errno));
+		return false;
+	}
+
+	if (flock(lock_fd, LOCK_EX|LOCK_NB))
+	{
+		if (errno != EWOULDBLOCK)
+			warn("Cannot acquire exclusive lock: %s", strerror(errno));
+
+		close(lock_fd);
+		return false;
+	}
+
+	fw3_lock_fd = lock_fd;
+
+	return true;
+}
+
+/* Pending reload requests are recorded by appending a byte to the request
+ * file, the lock holder truncates it before it reads the state. */
+void
+fw3_request_reload(void)
+{
+	int fd = open(FW3_RELOADFILE, O_CREAT|O_WRONLY|O_APPEND, S_IRUSR|S_IWUSR);
+
+	if (fd < 0)
+	{
+		warn("Cannot open %s: %s", FW3_RELOADFILE, strerror(errno));
+		return;
+	}
+
+	if (write(fd, "\n", 1) != 1)
+		warn("Cannot write %s: %s", FW3_RELOADFILE, strerror(errno));
+
+	close(fd);
+}
+
+off_t
+fw3_reload_requests(void)
+{
+	struct stat s;
+
+	if (stat(FW3_RELOADFILE, &s))
+		return 0;
+
+	return s.st_size;
+}
+
+void
+fw3_clear_reload_requests(void)
+{
+	if (truncate(FW3_RELOADFILE, 0) && errno != ENOENT)
+		warn("Cannot truncate %s: %s", FW3_RELOADFILE, strerror(errno));
+}
+
 
 void
 fw3_unlock_path(int *fd, const char *lockpath)
@@ -435,15 +497,20 @@ write_defaults_uci(struct uci_context *ctx, struct fw3_defaults *d,
 	ptr.option = "__flags_v6";
 	ptr.value  = buf;
 	uci_set(ctx, &ptr);
+
+	snprintf(buf, sizeof(buf), "0x%x", d->digest);
+	ptr.o      = NULL;
+	ptr.option = "__digest";
+	ptr.value  = buf;
+	uci_set(ctx, &ptr);
 }
 
 static void
 write_zone_uci(struct uci_context *ctx, struct fw3_zone *z,
-               struct uci_package *dest, struct ifaddrs *ifaddr)
+               struct uci_package *dest)
 {
 	struct fw3_device *dev;
 	struct fw3_address *sub;
-	struct ifaddrs *ifa;
 	enum fw3_family fam = FW3_FAMILY_ANY;
 
 	char *p, buf[INET6_ADDRSTRLEN];
@@ -545,30 +612,13 @@ write_zone_uci(struct uci_context *ctx, struct fw3_zone *z,
 	ptr.o      = NULL;
 	ptr.option = "__addrs";
 
-	fw3_foreach(dev, &z->devices)
+	fw3_foreach(sub, &z->old_addrs)
 	{
-		if (!dev)
+		if (!sub)
 			continue;
 
-		for (ifa = ifaddr; ifa; ifa = ifa->ifa_next)
-		{
-			if (!ifa->ifa_addr || strcmp(dev->name, ifa->ifa_name))
-				continue;
-
-			if (ifa->ifa_addr->sa_family == AF_INET)
-				inet_ntop(AF_INET,
-				          &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr,
-				          buf, sizeof(buf));
-			else if (ifa->ifa_addr->sa_family == AF_INET6)
-				inet_ntop(AF_INET6,
-				          &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr,
-				          buf, sizeof(buf));
-			else
-				continue;
-
-			ptr.value = buf;
-			uci_add_list(ctx, &ptr);
-		}
+		ptr.value = fw3_address_to_string(sub, false, false);
+		uci_add_list(ctx, &ptr);
 	}
 
 	if (z->extra_src)
@@ -598,6 +648,12 @@ write_zone_uci(struct uci_context *ctx, struct fw3_zone *z,
 	ptr.option = "__flags_v6";
 	ptr.value  = buf;
 	uci_set(ctx, &ptr);
+
+	snprintf(buf, sizeof(buf), "0x%x", z->digest);
+	ptr.o      = NULL;
+	ptr.option = "__digest";
+	ptr.value  = buf;
+	uci_set(ctx, &ptr);
 }
 
 static void
@@ -660,63 +716,36 @@ write_ipset_uci(struct uci_context *ctx, struct fw3_ipset *s,
 	}
 }
 
+/* Dump the runtime state in the UCI format of former versions */
 void
-fw3_write_statefile(void *state)
+fw3_export_statefile(void *state, FILE *out)
 {
-	FILE *sf;
+	FILE *empty;
 	struct fw3_state *s = state;
 	struct fw3_zone *z;
 	struct fw3_ipset *i;
-	struct ifaddrs *ifaddr;
 
 	struct uci_package *p;
 
-	if (fw3_no_family(s->defaults.flags[0]) &&
-	    fw3_no_family(s->defaults.flags[1]))
-	{
-		unlink(FW3_STATEFILE);
-	}
-	else
-	{
-		sf = fopen(FW3_STATEFILE, "w+");
-
-		if (!sf)
-		{
-			warn("Cannot create state %s: %s", FW3_STATEFILE, strerror(errno));
-			return;
-		}
-
-		if (getifaddrs(&ifaddr))
-		{
-			warn("Cannot get interface addresses: %s", strerror(errno));
-			ifaddr = NULL;
-		}
-
-		if ((p = uci_lookup_package(s->uci, "fw3_state")) != NULL)
-			uci_unload(s->uci, p);
-
-		uci_import(s->uci, sf, "fw3_state", NULL, true);
+	if (!(empty = fopen("/dev/null", "r")))
+		return;
 
-		if ((p = uci_lookup_package(s->uci, "fw3_state")) != NULL)
-		{
-			write_defaults_uci(s->uci, &s->defaults, p);
+	uci_import(s->uci, empty, "fw3_export", &p, true);
+	fclose(empty);
 
-			list_for_each_entry(z, &s->zones, list)
-				write_zone_uci(s->uci, z, p, ifaddr);
+	if (!p)
+		return;
 
-			list_for_each_entry(i, &s->ipsets, list)
-				write_ipset_uci(s->uci, i, p);
+	write_defaults_uci(s->uci, &s->defaults, p);
 
-			uci_export(s->uci, sf, p, true);
-			uci_unload(s->uci, p);
-		}
+	list_for_each_entry(z, &s->zones, list)
+		write_zone_uci(s->uci, z, p);
 
-		fsync(fileno(sf));
-		fclose(sf);
+	list_for_each_entry(i, &s->ipsets, list)
+		write_ipset_uci(s->uci, i, p);
 
-		if (ifaddr)
-			freeifaddrs(ifaddr);
-	}
+	uci_export(s->uci, out, p, true);
+	uci_unload(s->uci, p);
 }
 
 
@@ -1022,3 +1051,14 @@ fw3_check_loopback_addr(struct fw3_address *addr)
 
 	return false;
 }
+
+uint32_t
+fw3_hash(uint32_t hv, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len-- > 0)
+		hv = (hv ^ *p++) * 16777619;
+
+	return hv;
+}
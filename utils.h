@@ -39,6 +39,8 @@
 
 #define FW3_STATEFILE	"/var/run/fw3.state"
 #define FW3_LOCKFILE	"/var/run/fw3.lock"
+#define FW3_RELOADFILE	"/var/run/fw3.reload"
+#define FW3_CACHEFILE	"/var/run/fw3.cache"
 #define FW3_HELPERCONF	"/usr/share/fw3/helpers.conf"
 #define FW3_HOTPLUG     "/sbin/hotplug-call"
 
@@ -105,12 +107,17 @@ void fw3_pr(const char *fmt, ...)
 bool fw3_has_target(const bool ipv6, const char *target);
 
 bool fw3_lock(void);
+bool fw3_trylock(void);
 void fw3_unlock(void);
 bool fw3_lock_path(int *fw3_lock_fd, const char *path);
 void fw3_unlock_path(int *fw3_lock_fd, const char *path);
 
+void fw3_request_reload(void);
+off_t fw3_reload_requests(void);
+void fw3_clear_reload_requests(void);
 
-void fw3_write_statefile(void *state);
+
+void fw3_export_statefile(void *state, FILE *out);
 
 void fw3_free_object(void *obj, const void *opts);
 
@@ -131,4 +138,9 @@ const char * fw3_protoname(void *proto);
 bool fw3_check_loopback_dev(const char *name);
 
 bool fw3_check_loopback_addr(struct fw3_address *addr);
+
+#define FW3_HASH_INIT 2166136261u
+
+uint32_t fw3_hash(uint32_t hv, const void *data, size_t len);
+
 #endif
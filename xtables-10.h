@@ -122,31 +122,55 @@ fw3_xt_merge_target_options(struct xtables_globals *g, struct xtables_target *t)
 }
 
 static inline void
-fw3_xt_print_matches(void *ip, struct xtables_rule_match *matches)
+fw3_xt_print_target(void *ip, struct xtables_target *target, bool first)
 {
-	struct xtables_rule_match *rm;
-	struct xtables_match *m;
-
-	for (rm = matches; rm; rm = rm->next)
+	if (target)
 	{
-		m = rm->match;
-		printf(" -m %s", fw3_xt_get_match_name(m));
+		printf(" -j %s", fw3_xt_get_target_name(target));
 
-		if (m->save)
-			m->save(ip, m->m);
+		if (target->save)
+			target->save(ip, target->t);
 	}
 }
 
 static inline void
-fw3_xt_print_target(void *ip, struct xtables_target *target)
+fw3_xt_print_entry_match(void *ip, const struct xt_entry_match *em,
+                         bool first)
 {
-	if (target)
-	{
-		printf(" -j %s", fw3_xt_get_target_name(target));
+	int i;
+	struct xtables_match *m;
+	struct xtables_match *lists[] = { xtables_matches, xtables_pending_matches };
+
+	printf(" -m %s", em->u.user.name);
+
+	for (i = 0; i < 2; i++)
+		for (m = lists[i]; m; m = m->next)
+			if (m->revision == em->u.user.revision && m->save &&
+			    !strcmp(m->real_name ? m->real_name : m->name, em->u.user.name))
+			{
+				m->save(ip, em);
+				return;
+			}
+}
 
-		if (target->save)
-			target->save(ip, target->t);
-	}
+static inline void
+fw3_xt_print_entry_target(void *ip, const struct xt_entry_target *et,
+                          bool first)
+{
+	int i;
+	struct xtables_target *t;
+	struct xtables_target *lists[] = { xtables_targets, xtables_pending_targets };
+
+	printf(" -j %s", et->u.user.name);
+
+	for (i = 0; i < 2; i++)
+		for (t = lists[i]; t; t = t->next)
+			if (t->revision == et->u.user.revision && t->save &&
+			    !strcmp(t->real_name ? t->real_name : t->name, et->u.user.name))
+			{
+				t->save(ip, et);
+				return;
+			}
 }
 
 #endif
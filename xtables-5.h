@@ -88,34 +88,52 @@ fw3_xt_merge_target_options(struct xtables_globals *g, struct xtables_target *t)
 	g->opts = xtables_merge_options(g->opts, t->extra_opts, &t->option_offset);
 }
 
+/* save hooks of this version print a trailing blank, so only the first
+ * word after the address part needs a leading one */
 static inline void
-fw3_xt_print_matches(void *ip, struct xtables_rule_match *matches)
+fw3_xt_print_target(void *ip, struct xtables_target *target, bool first)
 {
-	struct xtables_rule_match *rm;
-	struct xtables_match *m;
-
-	printf(" ");
-
-	for (rm = matches; rm; rm = rm->next)
+	if (target)
 	{
-		m = rm->match;
-		printf("-m %s ", fw3_xt_get_match_name(m));
+		printf("%s-j %s ", first ? " " : "", fw3_xt_get_target_name(target));
 
-		if (m->save)
-			m->save(ip, m->m);
+		if (target->save)
+			target->save(ip, target->t);
 	}
 }
 
 static inline void
-fw3_xt_print_target(void *ip, struct xtables_target *target)
+fw3_xt_print_entry_match(void *ip, const struct xt_entry_match *em,
+                         bool first)
 {
-	if (target)
-	{
-		printf("-j %s ", fw3_xt_get_target_name(target));
+	struct xtables_match *m;
 
-		if (target->save)
-			target->save(ip, target->t);
-	}
+	printf("%s-m %s ", first ? " " : "", em->u.user.name);
+
+	for (m = xtables_matches; m; m = m->next)
+		if (m->revision == em->u.user.revision && m->save &&
+		    !strcmp(m->name, em->u.user.name))
+		{
+			m->save(ip, em);
+			return;
+		}
+}
+
+static inline void
+fw3_xt_print_entry_target(void *ip, const struct xt_entry_target *et,
+                          bool first)
+{
+	struct xtables_target *t;
+
+	printf("%s-j %s ", first ? " " : "", et->u.user.name);
+
+	for (t = xtables_targets; t; t = t->next)
+		if (t->revision == et->u.user.revision && t->save &&
+		    !strcmp(t->name, et->u.user.name))
+		{
+			t->save(ip, et);
+			return;
+		}
 }
 
 
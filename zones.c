@@ -16,6 +16,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <net/if.h>
+
+#include <libubox/avl-cmp.h>
+
 #include "zones.h"
 #include "ubus.h"
 #include "helpers.h"
@@ -94,6 +98,7 @@ const struct fw3_option fw3_zone_opts[] = {
 	FW3_OPT("__flags_v6",          int,      zone,     flags[1]),
 
 	FW3_LIST("__addrs",            address,  zone,     old_addrs),
+	FW3_OPT("__digest",            int,      zone,     digest),
 
 	{ }
 };
@@ -145,7 +150,10 @@ resolve_networks(struct uci_element *e, struct fw3_zone *zone)
 
 		if (!tmp)
 		{
-			warn_elem(e, "cannot resolve device of network '%s'", net->name);
+			/* no interface dump, e.g. for network lookups */
+			if (fw3_ubus_has_interfaces())
+				warn_elem(e, "cannot resolve device of network '%s'", net->name);
+
 			continue;
 		}
 
@@ -249,6 +257,8 @@ fw3_load_zones(struct fw3_state *state, struct uci_package *p)
 		if (!zone)
 			continue;
 
+		zone->hash = fw3_hash_section(s);
+
 		if (!fw3_parse_options(zone, fw3_zone_opts, s))
 			warn_elem(e, "has invalid options");
 
@@ -331,6 +341,23 @@ fw3_load_zones(struct fw3_state *state, struct uci_package *p)
 
 		list_add_tail(&zone->list, &state->zones);
 	}
+
+	fw3_index_zones(state);
+}
+
+void
+fw3_index_zones(struct fw3_state *state)
+{
+	struct fw3_zone *z;
+
+	avl_init(&state->zone_index, avl_strcmp, false, NULL);
+
+	/* the first of several equally named zones wins, like in a list scan */
+	list_for_each_entry(z, &state->zones, list)
+	{
+		z->index.key = z->name;
+		avl_insert(&state->zone_index, &z->index);
+	}
 }
 
 
@@ -405,7 +432,12 @@ print_zone_chain(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		    !fw3_hasbit(zone->flags[handle->family == FW3_FAMILY_V6], c->flag))
 			continue;
 
-		fw3_ipt_create_chain(handle, reload, format_chain(c->format, zone->name));
+		if (c->flag == FW3_FLAG_CUSTOM_CHAINS)
+			fw3_ipt_create_custom_chain(handle, reload,
+			                            format_chain(c->format, zone->name));
+		else
+			fw3_ipt_create_chain(handle, reload,
+			                     format_chain(c->format, zone->name));
 	}
 
 	if (zone->custom_chains)
@@ -435,17 +467,190 @@ print_zone_chain(struct fw3_ipt_handle *handle, struct fw3_state *state,
 	set(zone->flags, handle->family, handle->table);
 }
 
+/* Jumps from the builtin chains into the zone chains are collected over
+ * all zones first. Runs of jumps matching plain device names are then
+ * sorted by name and dispatched through a tree of chains, each level
+ * matching one more character of the name with a wildcard, instead of
+ * being compared one by one. Devices of different names never match the
+ * same packet, so only jumps for the same device need to keep their order,
+ * other jumps end a run. */
+
+#define FW3_DISPATCH_LEAF	4
+
+struct fw3_dispatch_rule {
+	struct list_head list;
+	struct fw3_ipt_rule *rule;
+	const char *device;
+	unsigned int seq;
+};
+
+struct fw3_dispatch {
+	const char *chain;
+	const char *tag;
+	bool out;
+	unsigned int seq;
+	unsigned int nchains;
+	struct list_head rules;
+};
+
+static void
+dispatch_rule(struct fw3_dispatch *dispatch, const char *chain,
+              struct fw3_ipt_rule *r, struct fw3_device *dev)
+{
+	struct fw3_dispatch *d;
+	struct fw3_dispatch_rule *e;
+
+	for (d = dispatch; d->chain && strcmp(d->chain, chain); d++);
+
+	e = fw3_alloc(sizeof(*e));
+	e->rule = r;
+	e->seq = d->seq++;
+
+	if (dev && !dev->any && !dev->invert && dev->name[0] &&
+	    !strchr(dev->name, '+'))
+		e->device = dev->name;
+
+	list_add_tail(&e->list, &d->rules);
+}
+
+static void
+emit_dispatch(struct fw3_dispatch *d, struct fw3_ipt_rule *r,
+              const char *chain)
+{
+	if (chain)
+		fw3_ipt_rule_append(r, "%s", chain);
+	else
+		fw3_ipt_rule_replace(r, "%s", d->chain);
+}
+
+static int
+cmp_dispatch(const void *a, const void *b)
+{
+	const struct fw3_dispatch_rule *x = *(struct fw3_dispatch_rule **)a;
+	const struct fw3_dispatch_rule *y = *(struct fw3_dispatch_rule **)b;
+	int rv = strcmp(x->device, y->device);
+
+	return rv ? rv : (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* emit the sorted jumps lo..hi whose devices share the first len
+ * characters into the given chain, the builtin one if NULL */
+static void
+dispatch_node(struct fw3_ipt_handle *handle, struct fw3_dispatch *d,
+              struct fw3_dispatch_rule **run, unsigned int lo,
+              unsigned int hi, size_t len, const char *chain)
+{
+	unsigned int i, j;
+	const char *name;
+	char buf[32];
+	struct fw3_device dev = { .set = true };
+	struct fw3_ipt_rule *r;
+
+	while (run[lo]->device[len] &&
+	       run[lo]->device[len] == run[hi - 1]->device[len])
+		len++;
+
+	for (i = lo; i < hi; i = j)
+	{
+		name = run[i]->device;
+
+		for (j = i + 1; j < hi && run[j]->device[len] == name[len]; j++);
+
+		/* small groups and names too long for another level are
+		 * matched directly */
+		if (!name[len] || j - i <= FW3_DISPATCH_LEAF ||
+		    len + 2 >= IFNAMSIZ)
+		{
+			for (; i < j; i++)
+				emit_dispatch(d, run[i]->rule, chain);
+
+			continue;
+		}
+
+		snprintf(buf, sizeof(buf), FW3_ZONE_DISPATCH_PREFIX "%s_%u",
+		         d->tag, d->nchains++);
+
+		fw3_ipt_create_chain(handle, true, buf);
+
+		snprintf(dev.name, sizeof(dev.name), "%.*s+", (int)len + 1, name);
+
+		r = fw3_ipt_rule_new(handle);
+		fw3_ipt_rule_in_out(r, d->out ? NULL : &dev, d->out ? &dev : NULL);
+		fw3_ipt_rule_target(r, "%s", buf);
+		emit_dispatch(d, r, chain);
+
+		dispatch_node(handle, d, run, i, j, len + 1, buf);
+	}
+}
+
+static void
+dispatch_run(struct fw3_ipt_handle *handle, struct fw3_state *state,
+             struct fw3_dispatch *d, struct fw3_dispatch_rule **run,
+             unsigned int n)
+{
+	unsigned int i;
+
+	if (!n)
+		return;
+
+	if (state->defaults.dispatch_threshold <= 0 ||
+	    n < state->defaults.dispatch_threshold)
+	{
+		for (i = 0; i < n; i++)
+			emit_dispatch(d, run[i]->rule, NULL);
+
+		return;
+	}
+
+	info("   * Dispatching %u %s jumps by device name", n, d->chain);
+
+	qsort(run, n, sizeof(*run), cmp_dispatch);
+	dispatch_node(handle, d, run, 0, n, 0, NULL);
+}
+
+static void
+flush_dispatch(struct fw3_ipt_handle *handle, struct fw3_state *state,
+               struct fw3_dispatch *d)
+{
+	unsigned int n = 0;
+	struct fw3_dispatch_rule *e, *tmp, **run;
+
+	run = fw3_alloc((d->seq + 1) * sizeof(*run));
+
+	list_for_each_entry(e, &d->rules, list)
+	{
+		if (e->device)
+		{
+			run[n++] = e;
+			continue;
+		}
+
+		dispatch_run(handle, state, d, run, n);
+		emit_dispatch(d, e->rule, NULL);
+		n = 0;
+	}
+
+	dispatch_run(handle, state, d, run, n);
+
+	list_for_each_entry_safe(e, tmp, &d->rules, list)
+	{
+		list_del(&e->list);
+		free(e);
+	}
+
+	free(run);
+}
+
 static void
 print_interface_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 					 bool reload, struct fw3_zone *zone,
-                     struct fw3_device *dev, struct fw3_address *sub)
+                     struct fw3_device *dev, struct fw3_address *sub,
+                     struct fw3_dispatch *dispatch)
 {
 	struct fw3_protocol tcp = { .protocol = 6 };
 	struct fw3_ipt_rule *r;
 	enum fw3_flag t;
 
-	char buf[32];
-
 	int i;
 
 	const char *chains[] = {
@@ -467,12 +672,9 @@ print_interface_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 				{
 					r = fw3_ipt_rule_create(handle, NULL, dev, NULL, sub, NULL);
 
-					snprintf(buf, sizeof(buf) - 1, "%s %s in: ",
-					         fw3_flag_names[t], zone->name);
-
 					fw3_ipt_rule_limit(r, &zone->log_limit);
-					fw3_ipt_rule_target(r, "LOG");
-					fw3_ipt_rule_addarg(r, false, "--log-prefix", buf);
+					fw3_ipt_rule_log(r, "%s %s in: ",
+					                 fw3_flag_names[t], zone->name);
 					fw3_ipt_rule_replace(r, "zone_%s_src_%s",
 					                     zone->name, fw3_flag_names[t]);
 				}
@@ -481,12 +683,9 @@ print_interface_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 				{
 					r = fw3_ipt_rule_create(handle, NULL, NULL, dev, NULL, sub);
 
-					snprintf(buf, sizeof(buf) - 1, "%s %s out: ",
-					         fw3_flag_names[t], zone->name);
-
 					fw3_ipt_rule_limit(r, &zone->log_limit);
-					fw3_ipt_rule_target(r, "LOG");
-					fw3_ipt_rule_addarg(r, false, "--log-prefix", buf);
+					fw3_ipt_rule_log(r, "%s %s out: ",
+					                 fw3_flag_names[t], zone->name);
 					fw3_ipt_rule_replace(r, "zone_%s_dest_%s",
 					                     zone->name, fw3_flag_names[t]);
 				}
@@ -499,8 +698,8 @@ print_interface_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 				fw3_ipt_rule_extra(r, zone->extra_src);
 
 				if (t == FW3_FLAG_ACCEPT && !state->defaults.drop_invalid)
-					fw3_ipt_rule_extra(r,
-					                   "-m conntrack --ctstate NEW,UNTRACKED");
+					fw3_ipt_rule_ctstate(r, false,
+					                     FW3_CTSTATE_NEW | FW3_CTSTATE_UNTRACKED);
 
 				fw3_ipt_rule_replace(r, "zone_%s_src_%s", zone->name,
 				                     fw3_flag_names[t]);
@@ -512,7 +711,7 @@ print_interface_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 				    zone->masq && !zone->masq_allow_invalid)
 				{
 					r = fw3_ipt_rule_create(handle, NULL, NULL, dev, NULL, sub);
-					fw3_ipt_rule_extra(r, "-m conntrack --ctstate INVALID");
+					fw3_ipt_rule_ctstate(r, false, FW3_CTSTATE_INVALID);
 					fw3_ipt_rule_comment(r, "Prevent NAT leakage");
 					fw3_ipt_rule_target(r, fw3_flag_names[FW3_FLAG_DROP]);
 					fw3_ipt_rule_replace(r, "zone_%s_dest_%s", zone->name,
@@ -541,7 +740,7 @@ print_interface_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 			else
 				fw3_ipt_rule_extra(r, zone->extra_src);
 
-			fw3_ipt_rule_replace(r, chains[i + 1]);
+			dispatch_rule(dispatch, chains[i + 1], r, dev);
 		}
 	}
 	else if (handle->table == FW3_TABLE_NAT)
@@ -551,7 +750,7 @@ print_interface_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 			r = fw3_ipt_rule_create(handle, NULL, dev, NULL, sub, NULL);
 			fw3_ipt_rule_target(r, "zone_%s_prerouting", zone->name);
 			fw3_ipt_rule_extra(r, zone->extra_src);
-			fw3_ipt_rule_replace(r, "PREROUTING");
+			dispatch_rule(dispatch, "PREROUTING", r, dev);
 		}
 
 		if (has(zone->flags, handle->family, FW3_FLAG_SNAT))
@@ -559,7 +758,7 @@ print_interface_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 			r = fw3_ipt_rule_create(handle, NULL, NULL, dev, NULL, sub);
 			fw3_ipt_rule_target(r, "zone_%s_postrouting", zone->name);
 			fw3_ipt_rule_extra(r, zone->extra_dest);
-			fw3_ipt_rule_replace(r, "POSTROUTING");
+			dispatch_rule(dispatch, "POSTROUTING", r, dev);
 		}
 	}
 	else if (handle->table == FW3_TABLE_MANGLE)
@@ -568,15 +767,12 @@ print_interface_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		{
 			if (zone->log & FW3_ZONE_LOG_MANGLE)
 			{
-				snprintf(buf, sizeof(buf) - 1, "MSSFIX %s out: ", zone->name);
-
 				r = fw3_ipt_rule_create(handle, &tcp, NULL, dev, NULL, sub);
 				fw3_ipt_rule_addarg(r, false, "--tcp-flags", "SYN,RST");
 				fw3_ipt_rule_addarg(r, false, "SYN", NULL);
 				fw3_ipt_rule_limit(r, &zone->log_limit);
 				fw3_ipt_rule_comment(r, "Zone %s MTU fix logging", zone->name);
-				fw3_ipt_rule_target(r, "LOG");
-				fw3_ipt_rule_addarg(r, false, "--log-prefix", buf);
+				fw3_ipt_rule_log(r, "MSSFIX %s out: ", zone->name);
 				fw3_ipt_rule_replace(r, "FORWARD");
 			}
 
@@ -626,7 +822,8 @@ print_interface_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 
 static void
 print_interface_rules(struct fw3_ipt_handle *handle, struct fw3_state *state,
-                      bool reload, struct fw3_zone *zone)
+                      bool reload, struct fw3_zone *zone,
+                      struct fw3_dispatch *dispatch)
 {
 	struct fw3_device *dev;
 	struct fw3_address *sub;
@@ -640,7 +837,7 @@ print_interface_rules(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		if (!dev && !sub && !zone->extra_src && !zone->extra_dest)
 			continue;
 
-		print_interface_rule(handle, state, reload, zone, dev, sub);
+		print_interface_rule(handle, state, reload, zone, dev, sub, dispatch);
 	}
 }
 
@@ -664,7 +861,8 @@ next_addr(struct fw3_address *addr, struct list_head *list,
 
 static void
 print_zone_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
-                bool reload, struct fw3_zone *zone)
+                bool reload, struct fw3_zone *zone,
+                struct fw3_dispatch *dispatch)
 {
 	bool first_src, first_dest;
 	struct fw3_address *msrc;
@@ -682,13 +880,13 @@ print_zone_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		if (has(zone->flags, handle->family, FW3_FLAG_DNAT))
 		{
 			r = fw3_ipt_rule_new(handle);
-			fw3_ipt_rule_extra(r, "-m conntrack --ctstate DNAT");
+			fw3_ipt_rule_ctstate(r, false, FW3_CTSTATE_DNAT);
 			fw3_ipt_rule_comment(r, "Accept port redirections");
 			fw3_ipt_rule_target(r, fw3_flag_names[FW3_FLAG_ACCEPT]);
 			fw3_ipt_rule_append(r, "zone_%s_input", zone->name);
 
 			r = fw3_ipt_rule_new(handle);
-			fw3_ipt_rule_extra(r, "-m conntrack --ctstate DNAT");
+			fw3_ipt_rule_ctstate(r, false, FW3_CTSTATE_DNAT);
 			fw3_ipt_rule_comment(r, "Accept port forwards");
 			fw3_ipt_rule_target(r, fw3_flag_names[FW3_FLAG_ACCEPT]);
 			fw3_ipt_rule_append(r, "zone_%s_forward", zone->name);
@@ -770,7 +968,7 @@ print_zone_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		break;
 	}
 
-	print_interface_rules(handle, state, reload, zone);
+	print_interface_rules(handle, state, reload, zone, dispatch);
 }
 
 void
@@ -788,9 +986,24 @@ fw3_print_zone_rules(struct fw3_ipt_handle *handle, struct fw3_state *state,
                      bool reload)
 {
 	struct fw3_zone *zone;
+	struct fw3_dispatch *d;
+	struct fw3_dispatch dispatch[] = {
+		{ .chain = "INPUT",       .tag = "input" },
+		{ .chain = "OUTPUT",      .tag = "output",      .out = true },
+		{ .chain = "FORWARD",     .tag = "forward" },
+		{ .chain = "PREROUTING",  .tag = "prerouting" },
+		{ .chain = "POSTROUTING", .tag = "postrouting", .out = true },
+		{ }
+	};
+
+	for (d = dispatch; d->chain; d++)
+		INIT_LIST_HEAD(&d->rules);
 
 	list_for_each_entry(zone, &state->zones, list)
-		print_zone_rule(handle, state, reload, zone);
+		print_zone_rule(handle, state, reload, zone, dispatch);
+
+	for (d = dispatch; d->chain; d++)
+		flush_dispatch(handle, state, d);
 }
 
 void
@@ -800,6 +1013,9 @@ fw3_flush_zones(struct fw3_ipt_handle *handle, struct fw3_state *state,
 	struct fw3_zone *z, *tmp;
 	const struct fw3_chain_spec *c;
 
+	/* dispatch chains still reference the zone chains */
+	fw3_ipt_delete_chains(handle, FW3_ZONE_DISPATCH_PREFIX);
+
 	list_for_each_entry_safe(z, tmp, &state->zones, list)
 	{
 		if (!has(z->flags, handle->family, handle->table))
@@ -873,15 +1089,7 @@ fw3_lookup_zone(struct fw3_state *state, const char *name)
 	if (list_empty(&state->zones))
 		return NULL;
 
-	list_for_each_entry(z, &state->zones, list)
-	{
-		if (strcmp(z->name, name))
-			continue;
-
-		return z;
-	}
-
-	return NULL;
+	return avl_find_element(&state->zone_index, name, z, index);
 }
 
 struct list_head *
@@ -926,3 +1134,267 @@ fw3_resolve_zone_addresses(struct fw3_zone *zone, struct fw3_address *addr)
 
 	return all;
 }
+
+static uint32_t
+hash_address(uint32_t hv, const struct fw3_address *addr)
+{
+	uint8_t flags[4] = { addr->set, addr->range, addr->invert, addr->family };
+
+	hv = fw3_hash(hv, flags, sizeof(flags));
+	hv = fw3_hash(hv, &addr->address, sizeof(addr->address));
+
+	return fw3_hash(hv, &addr->mask, sizeof(addr->mask));
+}
+
+static uint32_t
+zone_base_digest(struct fw3_zone *zone)
+{
+	uint32_t hv = zone->hash;
+	struct fw3_device *dev;
+	struct fw3_address *addr;
+	struct list_head *addrs;
+	const char *s;
+
+	list_for_each_entry(dev, &zone->devices, list)
+		hv = fw3_hash(hv, dev->name, strlen(dev->name) + 1);
+
+	addrs = fw3_resolve_zone_addresses(zone, NULL);
+
+	if (addrs)
+	{
+		list_for_each_entry(addr, addrs, list)
+		{
+			s = fw3_address_to_string(addr, true, false);
+			hv = fw3_hash(hv, s, strlen(s) + 1);
+		}
+
+		fw3_free_list(addrs);
+	}
+
+	return hv;
+}
+
+static uint32_t
+hash_addresses(uint32_t hv, const struct list_head *list)
+{
+	const struct fw3_address *addr;
+
+	list_for_each_entry(addr, list, list)
+		hv = hash_address(hv, addr);
+
+	return hv;
+}
+
+static bool
+refers_to(struct fw3_zone *z, struct fw3_zone **refs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (refs[i] == z)
+			return true;
+
+	return false;
+}
+
+/* fold a section hash into a zone digest, together with the base digests
+ * of all zones the section refers to */
+static uint32_t
+fold_section(uint32_t hv, uint32_t hash, struct fw3_zone **refs, int n)
+{
+	int i;
+
+	hv = fw3_hash(hv, &hash, sizeof(hash));
+
+	for (i = 0; i < n; i++)
+		if (refs[i])
+			hv = fw3_hash(hv, &refs[i]->digest, sizeof(refs[i]->digest));
+
+	return hv;
+}
+
+/* Compute a digest per zone covering everything which ends up in its
+ * chains: the zone section, its resolved devices and addresses and every
+ * rule, redirect, snat and forward touching it. Sections are hashed with
+ * their parsed addresses, network names among them are resolved through
+ * ubus. Sections and ubus data affecting all zones go into the defaults
+ * digest. */
+void
+fw3_digest_zones(struct fw3_state *state)
+{
+	uint32_t hv, hash, *digests;
+	unsigned int i, n = 0, max_refs = 2;
+	struct fw3_zone *z, **refs;
+	struct fw3_rule *rule;
+	struct fw3_redirect *redir;
+	struct fw3_snat *snat;
+	struct fw3_forward *fwd;
+	struct fw3_device *dev;
+	struct fw3_ipset *ipset;
+	struct fw3_include *inc;
+	struct fw3_cthelper *helper;
+
+	hv = state->defaults.hash;
+
+	list_for_each_entry(ipset, &state->ipsets, list)
+		hv = fw3_hash(hv, &ipset->hash, sizeof(ipset->hash));
+
+	list_for_each_entry(helper, &state->cthelpers, list)
+	{
+		hv = fw3_hash(hv, helper->name, strlen(helper->name) + 1);
+		hv = fw3_hash(hv, helper->module, strlen(helper->module) + 1);
+		hv = fw3_hash(hv, &helper->family, sizeof(helper->family));
+		hv = fw3_hash(hv, &helper->port, sizeof(helper->port));
+	}
+
+	state->defaults.digest = hv;
+
+	/* rules added by reload includes end up in arbitrary chains */
+	list_for_each_entry(inc, &state->includes, list)
+		if (inc->reload)
+			state->defaults.digest = 0;
+
+	list_for_each_entry(z, &state->zones, list)
+	{
+		z->digest = zone_base_digest(z);
+		n++;
+	}
+
+	if (!n)
+		return;
+
+	list_for_each_entry(redir, &state->redirects, list)
+	{
+		i = 2;
+
+		list_for_each_entry(dev, &redir->reflection_zones, list)
+			i++;
+
+		if (i > max_refs)
+			max_refs = i;
+	}
+
+	digests = fw3_alloc(n * sizeof(*digests));
+	refs = fw3_alloc(max_refs * sizeof(*refs));
+	i = 0;
+
+	list_for_each_entry(z, &state->zones, list)
+	{
+		hv = z->digest;
+
+		list_for_each_entry(rule, &state->rules, list)
+		{
+			refs[0] = rule->_src;
+			refs[1] = rule->_dest;
+
+			if (!refers_to(z, refs, 2))
+				continue;
+
+			hash = hash_addresses(rule->hash, &rule->ip_src);
+			hash = hash_addresses(hash, &rule->ip_dest);
+			hv = fold_section(hv, hash, refs, 2);
+		}
+
+		list_for_each_entry(redir, &state->redirects, list)
+		{
+			refs[0] = redir->_src;
+			refs[1] = redir->_dest;
+			n = 2;
+
+			list_for_each_entry(dev, &redir->reflection_zones, list)
+				refs[n++] = fw3_lookup_zone(state, dev->name);
+
+			if (!refers_to(z, refs, n))
+				continue;
+
+			hash = hash_address(redir->hash, &redir->ip_src);
+			hash = hash_address(hash, &redir->ip_dest);
+			hash = hash_address(hash, &redir->ip_redir);
+			hv = fold_section(hv, hash, refs, n);
+		}
+
+		list_for_each_entry(snat, &state->snats, list)
+		{
+			refs[0] = snat->_src;
+
+			if (!refers_to(z, refs, 1))
+				continue;
+
+			hash = hash_address(snat->hash, &snat->ip_src);
+			hash = hash_address(hash, &snat->ip_dest);
+			hash = hash_address(hash, &snat->ip_snat);
+			hv = fold_section(hv, hash, refs, 1);
+		}
+
+		list_for_each_entry(fwd, &state->forwards, list)
+		{
+			refs[0] = fwd->_src;
+			refs[1] = fwd->_dest;
+
+			if (refers_to(z, refs, 2))
+				hv = fold_section(hv, fwd->hash, refs, 2);
+		}
+
+		digests[i++] = hv;
+	}
+
+	i = 0;
+
+	list_for_each_entry(z, &state->zones, list)
+		z->digest = digests[i++];
+
+	free(refs);
+	free(digests);
+}
+
+/* flag zones whose digest matches the one recorded by the last run */
+void
+fw3_compare_zones(struct fw3_state *cfg_state, struct fw3_state *run_state)
+{
+	unsigned int n = 0, total = 0;
+	struct fw3_zone *z, *old;
+	bool same = (run_state && cfg_state->defaults.digest &&
+	             cfg_state->defaults.digest == run_state->defaults.digest);
+
+	list_for_each_entry(z, &cfg_state->zones, list)
+	{
+		old = same ? fw3_lookup_zone(run_state, z->name) : NULL;
+		z->unchanged = (old && old->digest == z->digest);
+
+		if (old)
+			old->unchanged = z->unchanged;
+
+		n += z->unchanged;
+		total++;
+	}
+
+	if (n)
+		info(" * Keeping %u of %u zones unchanged", n, total);
+}
+
+void
+fw3_keep_zone_chains(struct fw3_ipt_handle *handle, struct fw3_state *state)
+{
+	struct fw3_zone *z;
+	const struct fw3_chain_spec *c;
+
+	list_for_each_entry(z, &state->zones, list)
+	{
+		if (!z->unchanged)
+			continue;
+
+		for (c = zone_chains; c->format; c++)
+		{
+			if (c->flag == FW3_FLAG_CUSTOM_CHAINS)
+				continue;
+
+			if (!fw3_is_family(c, handle->family))
+				continue;
+
+			if (c->table != handle->table)
+				continue;
+
+			fw3_ipt_keep_chain(handle, format_chain(c->format, z->name));
+		}
+	}
+}
@@ -29,12 +29,17 @@
  */
 #define FW3_ZONE_MAXNAMELEN 11
 
+/* prefix of the device dispatch chains, see flush_dispatch() */
+#define FW3_ZONE_DISPATCH_PREFIX	"fw3d_"
+
 extern const struct fw3_option fw3_zone_opts[];
 
 struct fw3_zone * fw3_alloc_zone(void);
 
 void fw3_load_zones(struct fw3_state *state, struct uci_package *p);
 
+void fw3_index_zones(struct fw3_state *state);
+
 void fw3_print_zone_chains(struct fw3_ipt_handle *handle,
                            struct fw3_state *state, bool reload);
 
@@ -46,6 +51,14 @@ void fw3_flush_zones(struct fw3_ipt_handle *handle, struct fw3_state *state,
 
 void fw3_hotplug_zones(struct fw3_state *state, bool add);
 
+void fw3_digest_zones(struct fw3_state *state);
+
+void fw3_compare_zones(struct fw3_state *cfg_state,
+                       struct fw3_state *run_state);
+
+void fw3_keep_zone_chains(struct fw3_ipt_handle *handle,
+                          struct fw3_state *state);
+
 struct fw3_zone * fw3_lookup_zone(struct fw3_state *state, const char *name);
 
 struct list_head * fw3_resolve_zone_addresses(struct fw3_zone *zone,